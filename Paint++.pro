@@ -11,19 +11,40 @@ CONFIG += c++11
 HEADERS += \
     Paint.h \
     about.h \
+    benchmark.h \
+    brush.h \
+    canvas.h \
+    compositor.h \
     dialog_windows.h \
     commands.h \
     draw_area.h \
+    fill.h \
+    filter.h \
+    layers.h \
+    spsc_queue.h \
+    stroke_worker.h \
+    tile_pool.h \
+    tile_swap.h \
     toolbar.h \
     tool.h \
     constants.h
 SOURCES += main.cpp \
     Paint.cpp \
     about.cpp \
+    benchmark.cpp \
+    brush.cpp \
+    canvas.cpp \
     commands.cpp \
+    compositor.cpp \
     dialog_windows.cpp \
     toolbar.cpp \
     draw_area.cpp \
+    fill.cpp \
+    filter.cpp \
+    layers.cpp \
+    stroke_worker.cpp \
+    tile_pool.cpp \
+    tile_swap.cpp \
     tool.cpp
 
 RESOURCES += \
@@ -13,6 +13,7 @@ using namespace std;
 #include <QScrollArea>
 #include <QTranslator>
 #include <QStandardPaths>
+#include <QStatusBar>
 
 #include "Paint.h"
 #include "commands.h"
@@ -57,6 +58,8 @@ MainWindow::MainWindow(const char* name, QWidget *parent)
     lineDialog = 0;
     eraserDialog = 0;
     rectDialog = 0;
+    bucketDialog = 0;
+    layerDialog = 0;
 
     // adjust window size, name, & stop context menu
     setWindowTitle(tr(name));
@@ -93,6 +96,8 @@ MainWindow::MainWindow(QWidget *parent)
     lineDialog = 0;
     eraserDialog = 0;
     rectDialog = 0;
+    bucketDialog = 0;
+    layerDialog = 0;
 
     // adjust window size, name, & stop context menu
     setWindowTitle(tr("Paint++"));
@@ -117,6 +122,8 @@ MainWindow::~MainWindow()
     delete lineDialog;
     delete eraserDialog;
     delete rectDialog;
+    delete bucketDialog;
+    delete layerDialog;
 
     foreach (QAction *action, imageActions << toolActions) {
         action->deleteLater();
@@ -161,12 +168,33 @@ void MainWindow::loadSettings() {
     if (currLang != "en") {
         language(currLang);
     }
+    // memory budget of the undo history in MB, 0 = count mode
+    int budget = settings->value("undoBudget", UNDO_MEMORY_BUDGET).toInt();
+    drawArea->getHistory()->setByteBudget(qint64(budget) * 1024 * 1024);
+    drawArea->getHistory()->setSpillEnabled(settings->value("undoSpill", UNDO_SPILL_TO_DISK).toBool());
+    // disk budget of spilled undo commands in MB, 0 = unbounded
+    int diskBudget = settings->value("undoDiskBudget", UNDO_DISK_BUDGET).toInt();
+    drawArea->getHistory()->setDiskBudget(qint64(diskBudget) * 1024 * 1024);
+    drawArea->setThreadedStrokes(settings->value("threadedStrokes", THREADED_STROKES).toBool());
+    drawArea->setReplayOperations(settings->value("undoReplay", UNDO_REPLAY_OPERATIONS).toBool());
+    drawArea->setParallelFill(settings->value("parallelFill", PARALLEL_FILL).toBool());
+    // RAM the canvas may take in MB before tiles are paged out, 0 = all in RAM
+    int canvasBudget = settings->value("canvasBudget", CANVAS_MEMORY_BUDGET).toInt();
+    drawArea->setCanvasBudget(qint64(canvasBudget) * 1024 * 1024);
+
     restoreGeometry(settings->value("geometry", QByteArray()).toByteArray());
     restoreState(settings->value("state", QByteArray()).toByteArray());
 }
 
 void MainWindow::saveSettings() {
     settings->setValue("lang", currLang);
+    settings->setValue("undoBudget", drawArea->getHistory()->byteBudget() / (1024 * 1024));
+    settings->setValue("undoSpill", drawArea->getHistory()->spillEnabled());
+    settings->setValue("undoDiskBudget", drawArea->getHistory()->diskBudget() / (1024 * 1024));
+    settings->setValue("threadedStrokes", drawArea->threadedStrokes());
+    settings->setValue("undoReplay", drawArea->getReplayOperations());
+    settings->setValue("parallelFill", drawArea->getParallelFill());
+    settings->setValue("canvasBudget", drawArea->getCanvasBudget() / (1024 * 1024));
     settings->setValue("geometry", saveGeometry());
     settings->setValue("state", saveState());
     settings->sync();
@@ -234,7 +262,7 @@ void MainWindow::OnLoadImage()
  */
 void MainWindow::OnSaveImage()
 {
-    if(drawArea->getImage()->isNull())
+    if(drawArea->getCanvas()->isNull())
         return;
 
     if (path.isEmpty() || path.isNull()) {
@@ -249,7 +277,7 @@ void MainWindow::OnSaveImage()
  *                                  enter a filename and save location.
  */
 void MainWindow::OnSaveAsImage() {
-    if(drawArea->getImage()->isNull())
+    if(drawArea->getCanvas()->isNull())
         return;
 
     QString types;
@@ -282,14 +310,14 @@ void MainWindow::OnSaveAsImage() {
  */
 void MainWindow::OnResizeImage()
 {
-    QPixmap *image = drawArea->getImage();
-    if(image->isNull())
+    Canvas *canvas = drawArea->getCanvas();
+    if(canvas->isNull())
         return;
 
     CanvasSizeDialog* newCanvas = new CanvasSizeDialog(this,
                                                        QApplication::translate("MainWindow", "Resize Image"),
-                                                       image->width(),
-                                                       image->height());
+                                                       canvas->width(),
+                                                       canvas->height());
     newCanvas->exec();
     // if user hit 'OK' button, create new image
     if (newCanvas->result())
@@ -406,6 +434,61 @@ void MainWindow::OnRectangleDialog()
     rectDialog->show();
 }
 
+/**
+ * @brief MainWindow::OnBucketDialog - Open a BucketDialog prompting the user
+ *                                     to change bucket fill settings.
+ *
+ */
+void MainWindow::OnBucketDialog()
+{
+    if (!bucketDialog)
+        bucketDialog = new BucketDialog(this, drawArea);
+
+    if(bucketDialog->isVisible())
+        return;
+
+    bucketDialog->show();
+}
+
+/**
+ * @brief MainWindow::OnLayerDialog - Open a LayerDialog listing the layers
+ *                                    of the image.
+ *
+ */
+void MainWindow::OnLayerDialog()
+{
+    if (!layerDialog)
+        layerDialog = new LayerDialog(this, drawArea);
+
+    if(layerDialog->isVisible())
+        return;
+
+    layerDialog->show();
+}
+
+/**
+ * @brief MainWindow::OnFilter - Ask for the radius (and amount) of a
+ *                               filter, and run it if the user hit 'OK'.
+ *
+ */
+void MainWindow::OnFilter(int type)
+{
+    if(drawArea->getCanvas()->isNull())
+        return;
+
+    FilterDialog* filterDialog = new FilterDialog(this, drawArea, FilterType(type));
+    filterDialog->exec();
+    if (filterDialog->result())
+    {
+        QApplication::setOverrideCursor(Qt::WaitCursor);
+        drawArea->applyFilter(FilterType(type), filterDialog->getRadius(),
+                              filterDialog->getAmount());
+        QApplication::restoreOverrideCursor();
+    }
+    // done with the dialog, free it
+    delete filterDialog;
+}
+
 /**
  * @brief MainWindow::openToolDialog - call the appropriate dialog function
  *                                     based on the current tool.
@@ -419,6 +502,7 @@ void MainWindow::openToolDialog()
         case line: OnLineDialog();           break;
         case eraser: OnEraserDialog();       break;
         case rect_tool: OnRectangleDialog(); break;
+        case bucket: OnBucketDialog();       break;
     }
 }
 
@@ -432,6 +516,60 @@ void MainWindow::OnAboutDialog()
     delete dialog;
 }
 
+/**
+ * @brief MainWindow::OnHistoryChanged - show how much memory the undo
+ *                                       history currently holds
+ */
+void MainWindow::OnHistoryChanged(qint64 bytes)
+{
+    UndoHistory *history = drawArea->getHistory();
+    QString text = QApplication::translate("MainWindow", "History: %1 MB")
+                       .arg(bytes / (1024.0 * 1024.0), 0, 'f', 1);
+    if(history->byteBudget() > 0)
+        text += QString(" / %1 MB").arg(history->byteBudget() / (1024 * 1024));
+    if(history->branchCount() > 1)
+        text += QApplication::translate("MainWindow", ", %1 branches")
+                    .arg(history->branchCount());
+    if(history->dedupRatio() > 1)
+        text += QApplication::translate("MainWindow", ", dedup %1x")
+                    .arg(history->dedupRatio(), 0, 'f', 2);
+    if(history->diskUsage() > 0)
+        text += QApplication::translate("MainWindow", " (%1 MB on disk)")
+                    .arg(history->diskUsage() / (1024.0 * 1024.0), 0, 'f', 1);
+    historyLabel->setText(text);
+    updateCanvasLabel();
+}
+
+/**
+ * @brief MainWindow::OnStrokeFinished - show how many full-image format
+ *                                       conversions and heap allocated
+ *                                       tiles the last stroke took
+ */
+void MainWindow::OnStrokeFinished(int conversions)
+{
+    conversionLabel->setText(QApplication::translate("MainWindow", "Conversions: %1, tile allocations: %2")
+                                 .arg(conversions).arg(drawArea->getStrokeAllocations()));
+    updateCanvasLabel();
+}
+
+/**
+ * @brief MainWindow::updateCanvasLabel - show how much of the canvas is
+ *                                        in RAM and how much it paged
+ */
+void MainWindow::updateCanvasLabel()
+{
+    QString text = QApplication::translate("MainWindow", "Canvas: %1 MB")
+                       .arg(drawArea->getCanvas()->memoryUsage() / (1024.0 * 1024.0), 0, 'f', 1);
+    QSharedPointer<TileSwap> swap = drawArea->getTileSwap();
+    if(swap)
+    {
+        text += QString(" / %1 MB").arg(drawArea->getCanvasBudget() / (1024 * 1024));
+        text += QApplication::translate("MainWindow", " (paged in %1, out %2)")
+                    .arg(swap->pageIns()).arg(swap->pageOuts());
+    }
+    canvasLabel->setText(text);
+}
+
 /**
  * @brief ToolBar::createMenuAndToolBar() - ensure that everything gets
  *                                          created in the correct order
@@ -452,6 +590,30 @@ void MainWindow::createMenuAndToolBar()
 
     // add actions to the tool bar
     toolbar->showActions(imageActions, toolActions);
+
+    createStatusBar();
+}
+
+/**
+ * @brief MainWindow::createStatusBar - create the status bar and keep it
+ *                                      in sync with the undo history
+ */
+void MainWindow::createStatusBar()
+{
+    canvasLabel = new QLabel(this);
+    statusBar()->addPermanentWidget(canvasLabel);
+    historyLabel = new QLabel(this);
+    statusBar()->addPermanentWidget(historyLabel);
+    conversionLabel = new QLabel(this);
+    statusBar()->addPermanentWidget(conversionLabel);
+
+    connect(drawArea->getHistory(), &UndoHistory::memoryUsageChanged,
+            this, &MainWindow::OnHistoryChanged);
+    OnHistoryChanged(drawArea->getHistory()->memoryUsage());
+
+    connect(drawArea, &DrawArea::strokeFinished,
+            this, &MainWindow::OnStrokeFinished);
+    OnStrokeFinished(drawArea->getStrokeConversions());
 }
 
 /**
@@ -476,6 +638,7 @@ void MainWindow::createMenuActions()
     QIcon lineIcon = QIcon::fromTheme(":icons/lineIcon");
     QIcon eraserIcon = QIcon(":/icons/eraser");
     QIcon rectIcon = QIcon::fromTheme(":/icons/rectIcon");
+    QIcon bucketIcon = QIcon::fromTheme("color-fill", QIcon(":/icons/bucketIcon"));
     QIcon exitIcon = QIcon::fromTheme("application-exit");
     QIcon aboutIcon(":/icons/Icon");
 #else
@@ -493,6 +656,7 @@ void MainWindow::createMenuActions()
     QIcon lineIcon(":/icons/lineIcon");
     QIcon eraserIcon(":/icons/eraser");
     QIcon rectIcon(":/icons/rectIcon");
+    QIcon bucketIcon(":/icons/bucketIcon");
     QIcon exitIcon(":/icons/application-exit");
     QIcon aboutIcon(":/icons/Icon");
 #endif
@@ -516,6 +680,10 @@ void MainWindow::createMenuActions()
                                      drawArea, SLOT(OnUndo()), QKeySequence("Ctrl+Z"));
     redoAction = editMenu->addAction(redoIcon, QApplication::translate("MainWindow", "Redo"),
                                      drawArea, SLOT(OnRedo()), QKeySequence("Ctrl+Y"));
+    olderAction = editMenu->addAction(QApplication::translate("MainWindow", "Older State"),
+                                      drawArea, SLOT(OnOlderState()), QKeySequence("Ctrl+Alt+Z"));
+    newerAction = editMenu->addAction(QApplication::translate("MainWindow", "Newer State"),
+                                      drawArea, SLOT(OnNewerState()), QKeySequence("Ctrl+Alt+Y"));
     clearAction = editMenu->addAction(clearIcon, QApplication::translate("MainWindow", "Clear Canvas"),
                                       drawArea, SLOT(OnClearAll()), QKeySequence("Ctrl+C"));
     resizeAction = editMenu->addAction(resizeIcon, QApplication::translate("MainWindow", "Resize Image..."),
@@ -567,10 +735,16 @@ void MainWindow::createMenuActions()
             signalMapperT, SLOT(map()));
     rectAction->setShortcut(QKeySequence("R"));
 
+    bucketAction = new QAction(bucketIcon, QApplication::translate("MainWindow", "Bucket Fill"), this);
+    connect(bucketAction, SIGNAL(triggered()),
+            signalMapperT, SLOT(map()));
+    bucketAction->setShortcut(QKeySequence("G"));
+
     signalMapperT->setMapping(penAction, pen);
     signalMapperT->setMapping(lineAction, line);
     signalMapperT->setMapping(eraserAction, eraser);
     signalMapperT->setMapping(rectAction, rect_tool);
+    signalMapperT->setMapping(bucketAction, bucket);
 
     connect(signalMapperT, SIGNAL(mapped(int)), this, SLOT(OnChangeTool(int)));
 
@@ -580,6 +754,7 @@ void MainWindow::createMenuActions()
     toolsMenu->addAction(lineAction);
     toolsMenu->addAction(eraserAction);
     toolsMenu->addAction(rectAction);
+    toolsMenu->addAction(bucketAction);
     toolsMenu->addAction(QApplication::translate("MainWindow", "Pen Properties..."),
                      this, SLOT(OnPenDialog()));
     toolsMenu->addAction(QApplication::translate("MainWindow", "Line Properties..."),
@@ -588,6 +763,31 @@ void MainWindow::createMenuActions()
                      this, SLOT(OnEraserDialog()));
     toolsMenu->addAction(QApplication::translate("MainWindow", "Rectangle Properties..."),
                      this, SLOT(OnRectangleDialog()));
+    toolsMenu->addAction(QApplication::translate("MainWindow", "Bucket Fill Properties..."),
+                     this, SLOT(OnBucketDialog()));
+
+    // layers
+    layersMenu = new QMenu(QApplication::translate("MainWindow", "Layers"), this);
+    addLayerAction = layersMenu->addAction(QApplication::translate("MainWindow", "New Layer"),
+                                           drawArea, SLOT(OnAddLayer()), QKeySequence("Ctrl+Shift+N"));
+    removeLayerAction = layersMenu->addAction(QApplication::translate("MainWindow", "Delete Layer"),
+                                              drawArea, SLOT(OnRemoveLayer()));
+    layersMenu->addAction(QApplication::translate("MainWindow", "Layers..."),
+                          this, SLOT(OnLayerDialog()), QKeySequence("Ctrl+L"));
+
+    // filters
+    filtersMenu = new QMenu(QApplication::translate("MainWindow", "Filters"), this);
+    QSignalMapper *signalMapperF = new QSignalMapper(this);
+    QAction *gaussianAction = filtersMenu->addAction(QApplication::translate("MainWindow", "Gaussian Blur..."),
+                                                     signalMapperF, SLOT(map()));
+    QAction *boxAction = filtersMenu->addAction(QApplication::translate("MainWindow", "Box Blur..."),
+                                                signalMapperF, SLOT(map()));
+    QAction *sharpenAction = filtersMenu->addAction(QApplication::translate("MainWindow", "Unsharp Mask..."),
+                                                    signalMapperF, SLOT(map()));
+    signalMapperF->setMapping(gaussianAction, gaussian_filter);
+    signalMapperF->setMapping(boxAction, box_filter);
+    signalMapperF->setMapping(sharpenAction, sharpen_filter);
+    connect(signalMapperF, SIGNAL(mapped(int)), this, SLOT(OnFilter(int)));
 
     // add a toolbar toggle action to the menu
     // view
@@ -630,11 +830,14 @@ void MainWindow::createMenuActions()
     toolActions.append(lineAction);
     toolActions.append(eraserAction);
     toolActions.append(rectAction);
+    toolActions.append(bucketAction);
 
     // populate the menubar with menu items
     menuBar()->addMenu(fileMenu);
     menuBar()->addMenu(editMenu);
     menuBar()->addMenu(toolsMenu);
+    menuBar()->addMenu(layersMenu);
+    menuBar()->addMenu(filtersMenu);
     menuBar()->addMenu(viewMenu);
     menuBar()->addMenu(helpMenu);
 }
@@ -6,6 +6,7 @@
 #include <QAction>
 #include <QWidget>
 #include <QSettings>
+#include <QLabel>
 
 #include "dialog_windows.h"
 #include "draw_area.h"
@@ -43,11 +44,22 @@ public slots:
     void OnLineDialog();
     void OnEraserDialog();
     void OnRectangleDialog();
+    void OnBucketDialog();
+    void OnLayerDialog();
     void OnAboutDialog();
 
+    /** ask for a filter's settings, then run it on the current layer */
+    void OnFilter(int);
+
+    /** status bar */
+    void OnHistoryChanged(qint64);
+    void OnStrokeFinished(int);
+    void updateCanvasLabel();
+
 private:
     void createMenuActions();
     void createMenuAndToolBar();
+    void createStatusBar();
 
     /** tool dialog dispatcher */
     void openToolDialog();
@@ -72,6 +84,11 @@ private:
     /** main toolbar */
     ToolBar* toolbar;
 
+    /** status bar labels */
+    QLabel* canvasLabel;
+    QLabel* historyLabel;
+    QLabel* conversionLabel;
+
     /** current tool */
     Tool* currentTool;
 
@@ -80,6 +97,8 @@ private:
     LineDialog* lineDialog;
     EraserDialog* eraserDialog;
     RectDialog* rectDialog;
+    BucketDialog* bucketDialog;
+    LayerDialog* layerDialog;
 
     /** Don't allow copying */
     MainWindow(const MainWindow&);
@@ -92,6 +111,8 @@ private:
     QMenu *fileMenu;
     QMenu *editMenu;
     QMenu *toolsMenu;
+    QMenu *layersMenu;
+    QMenu *filtersMenu;
     QMenu *viewMenu;
     QMenu *helpMenu;
 
@@ -102,6 +123,8 @@ private:
     QAction *exitAction;
     QAction *undoAction;
     QAction *redoAction;
+    QAction *olderAction;
+    QAction *newerAction;
     QAction *clearAction;
     QAction *resizeAction;
     QAction *fColorAction;
@@ -110,6 +133,9 @@ private:
     QAction *lineAction;
     QAction *eraserAction;
     QAction *rectAction;
+    QAction *bucketAction;
+    QAction *addLayerAction;
+    QAction *removeLayerAction;
     QAction *toggleToolbar;
     QAction *helpAction;
     QAction *aboutAction;
@@ -0,0 +1,756 @@
+#include <cmath>
+
+#include <QVector>
+#include <QElapsedTimer>
+#include <QThread>
+
+#include "benchmark.h"
+#include "compositor.h"
+#include "canvas.h"
+#include "fill.h"
+#include "layers.h"
+#include "filter.h"
+#include "constants.h"
+
+
+namespace {
+
+/** about how long each path of a kernel runs */
+const qint64 RUN_MSECS = 300;
+
+/** how far the layer view's cached groups may round off the image */
+const int LAYER_VIEW_TOLERANCE = 2;
+
+/** a repeatable stream of pixels, so runs can be compared */
+class Random
+{
+public:
+    Random() { state = 0x2545f491; }
+
+    uint next()
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    /** a valid premultiplied pixel */
+    uint pixel()
+    {
+        uint value = next();
+        uint alpha = value >> 24;
+        uint pixel = alpha << 24;
+        for(int shift = 0; shift < 24; shift += 8)
+            pixel |= (((value >> shift) & 0xff) * alpha / 255) << shift;
+        return pixel;
+    }
+
+private:
+    quint32 state;
+};
+
+const char* modeName(BlendMode mode)
+{
+    switch(mode)
+    {
+        case multiply_blend:   return "multiply";
+        case screen_blend:     return "screen";
+        case darken_blend:     return "darken";
+        case lighten_blend:    return "lighten";
+        case erase_blend:      return "erase";
+        case overlay_blend:    return "overlay";
+        case add_blend:        return "add";
+        case difference_blend: return "difference";
+        default:               return "normal";
+    }
+}
+
+/**
+ * A layer pixel blended onto dst the slow and obvious way: the spec's
+ * blend functions on unpremultiplied colors, in floating point. Only the
+ * faded layer pixel is rounded first, like the kernels do it.
+ */
+uint referenceBlend(BlendMode mode, uint src, uint dst, uint opacity)
+{
+    qreal s[4], b[4];
+    for(int c = 0; c < 4; ++c)
+    {
+        s[c] = qRound(((src >> (8 * c)) & 0xff) * opacity / 255.0) / 255.0;
+        b[c] = ((dst >> (8 * c)) & 0xff) / 255.0;
+    }
+
+    const qreal sa = s[3];
+    const qreal ba = b[3];
+    qreal out[4];
+    for(int c = 0; c < 3; ++c)
+    {
+        const qreal cs = sa > 0 ? s[c] / sa : 0;
+        const qreal cb = ba > 0 ? b[c] / ba : 0;
+        qreal blended;
+        switch(mode)
+        {
+            case multiply_blend:   blended = cs * cb;                 break;
+            case screen_blend:     blended = cs + cb - cs * cb;       break;
+            case darken_blend:     blended = qMin(cs, cb);            break;
+            case lighten_blend:    blended = qMax(cs, cb);            break;
+            case difference_blend: blended = qAbs(cb - cs);           break;
+            case overlay_blend:
+                blended = cb <= 0.5 ? 2 * cs * cb : 1 - 2 * (1 - cs) * (1 - cb);
+                break;
+            default:               blended = cs;                      break;
+        }
+        out[c] = s[c] * (1 - ba) + b[c] * (1 - sa) + sa * ba * blended;
+        if(mode == add_blend)
+            out[c] = qMin(s[c] + b[c], qreal(1));
+    }
+    out[3] = mode == add_blend ? qMin(sa + ba, qreal(1)) : sa + ba - sa * ba;
+
+    uint pixel = 0;
+    for(int c = 0; c < 4; ++c)
+        pixel |= uint(qRound(out[c] * 255)) << (8 * c);
+    return pixel;
+}
+
+/** a canvas of random pixels, tile by tile */
+Canvas randomCanvas(const QSize &size, Random &random)
+{
+    QImage image(size, CANVAS_FORMAT);
+    for(int y = 0; y < size.height(); ++y)
+    {
+        uint *line = reinterpret_cast<uint*>(image.scanLine(y));
+        for(int x = 0; x < size.width(); ++x)
+            line[x] = random.pixel();
+    }
+    return Canvas(image);
+}
+
+/** one channel of the Filter's Gaussian at a pixel, in floating point
+ *  straight from the curve, edge pixels repeated */
+double referenceGauss(const QImage &image, int x, int y, int shift, int radius)
+{
+    const double sigma = radius / 3.0;
+    double total = 0;
+    double sum = 0;
+    for(int j = -radius; j <= radius; ++j)
+    {
+        const uint *line = reinterpret_cast<const uint*>(
+                    image.constScanLine(qBound(0, y + j, image.height() - 1)));
+        for(int i = -radius; i <= radius; ++i)
+        {
+            const double weight = std::exp(-(i * i + j * j) / (2 * sigma * sigma));
+            sum += weight * ((line[qBound(0, x + i, image.width() - 1)] >> shift) & 0xff);
+            total += weight;
+        }
+    }
+    return sum / total;
+}
+
+/** true if both canvases hold the same pixels */
+bool sameCanvas(const Canvas &a, const Canvas &b)
+{
+    if(a.size() != b.size())
+        return false;
+    for(int row = 0; row < a.rows(); ++row)
+    {
+        for(int column = 0; column < a.columns(); ++column)
+        {
+            if(!Canvas::sameTile(a.tileAt(column, row), b.tileAt(column, row)))
+                return false;
+        }
+    }
+    return true;
+}
+
+/** the layers of stack put on one another bottom up, a whole image at a
+ *  time with the scalar kernels, nothing cached or grouped */
+QImage sequentialFlatten(const LayerStack &stack)
+{
+    QImage image(stack.size(), CANVAS_FORMAT);
+    image.fill(Qt::transparent);
+    for(int i = 0; i < stack.count(); ++i)
+    {
+        const Layer *layer = stack.layer(i);
+        if(!layer->visible || layer->opacity == 0 || layer->canvas.size() != stack.size())
+            continue;
+
+        const QImage pixels = layer->canvas.toImage();
+        Compositor::LayerRow kernel = Compositor::layerRow(layer->mode, Compositor::scalar_path);
+        uint opacity = (layer->opacity * 255 + 50) / 100;
+        for(int y = 0; y < image.height(); ++y)
+            kernel(reinterpret_cast<uint*>(image.scanLine(y)),
+                   reinterpret_cast<const uint*>(pixels.constScanLine(y)),
+                   image.width(), opacity);
+    }
+    return image;
+}
+
+/** the most any channel of a pixel differs between two images */
+int maxDifference(const QImage &a, const QImage &b)
+{
+    int most = 0;
+    for(int y = 0; y < a.height(); ++y)
+    {
+        const uint *lineA = reinterpret_cast<const uint*>(a.constScanLine(y));
+        const uint *lineB = reinterpret_cast<const uint*>(b.constScanLine(y));
+        for(int x = 0; x < a.width(); ++x)
+        {
+            for(int shift = 0; shift < 32; shift += 8)
+                most = qMax(most, qAbs(int((lineA[x] >> shift) & 0xff)
+                                       - int((lineB[x] >> shift) & 0xff)));
+        }
+    }
+    return most;
+}
+
+} // namespace
+
+
+/**
+ * @brief Benchmark::run - Run every benchmark, printing to stdout
+ */
+int Benchmark::run()
+{
+    QTextStream out(stdout);
+    out << "Best path: " << Compositor::pathName(Compositor::bestPath()) << "\n";
+
+    bool agreed = compositing(out);
+    agreed = filling(out) && agreed;
+    agreed = parallelFilling(out) && agreed;
+    agreed = layerBlending(out) && agreed;
+    agreed = layering(out) && agreed;
+    agreed = filtering(out) && agreed;
+
+    out << (agreed ? "All paths agree\n" : "PATHS DISAGREE\n");
+    out.flush();
+    return agreed ? 0 : 1;
+}
+
+/**
+ * @brief Benchmark::compositing - The brush dab kernels, a 256 px dab
+ *                                 composited row by row like onto tiles
+ */
+bool Benchmark::compositing(QTextStream &out)
+{
+    const int size = 256;
+    const int pixels = size * size;
+
+    Random random;
+    QVector<uint> before(pixels);
+    QVector<quint8> mask(pixels);
+    QVector<quint8> coverage(pixels);
+    for(int i = 0; i < pixels; ++i)
+    {
+        before[i] = random.pixel();
+        mask[i] = quint8(random.next());
+        coverage[i] = quint8(random.next() >> 8);
+    }
+    const uint color = random.pixel() | 0xff000000;
+
+    out << "\nBrush dab compositing, " << size << "x" << size << " px\n";
+
+    bool agreed = true;
+    const BlendMode modes[] = {normal_blend, multiply_blend, screen_blend,
+                               darken_blend, lighten_blend, erase_blend,
+                               overlay_blend, add_blend, difference_blend};
+    for(unsigned m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m)
+    {
+        const BlendMode mode = modes[m];
+        QVector<uint> expected;
+        qreal scalarRate = 0;
+        for(int path = Compositor::scalar_path; path <= Compositor::avx2_path; ++path)
+        {
+            if(!Compositor::isSupported(Compositor::Path(path)))
+                continue;
+            Compositor::DabRow kernel = Compositor::dabRow(mode, Compositor::Path(path));
+
+            // one pass from the same start to compare the pixels
+            QVector<uint> dst(pixels);
+            QVector<quint8> cover = coverage;
+            for(int y = 0; y < size; ++y)
+            {
+                kernel(dst.data() + y * size, before.constData() + y * size, 0,
+                       cover.data() + y * size, mask.constData() + y * size,
+                       size, color, 200);
+            }
+            bool same = expected.isEmpty() || dst == expected;
+            if(expected.isEmpty())
+                expected = dst;
+            agreed = agreed && same;
+
+            QElapsedTimer timer;
+            timer.start();
+            qint64 passes = 0;
+            do
+            {
+                for(int y = 0; y < size; ++y)
+                {
+                    kernel(dst.data() + y * size, before.constData() + y * size, 0,
+                           cover.data() + y * size, mask.constData() + y * size,
+                           size, color, 200);
+                }
+                passes++;
+            } while(timer.elapsed() < RUN_MSECS);
+
+            qreal rate = passes * pixels / (timer.nsecsElapsed() / 1e9) / 1e6;
+            if(path == Compositor::scalar_path)
+                scalarRate = rate;
+
+            out << QString("  %1 %2 %3 Mpx/s  %4x%5\n")
+                   .arg(modeName(mode), -10)
+                   .arg(Compositor::pathName(Compositor::Path(path)), -7)
+                   .arg(rate, 8, 'f', 1)
+                   .arg(scalarRate > 0 ? rate / scalarRate : 1, 0, 'f', 2)
+                   .arg(same ? "" : "  MISMATCH");
+        }
+    }
+    return agreed;
+}
+
+/**
+ * @brief Benchmark::filling - Bucket fills of a 16 megapixel canvas: a
+ *                             blank one, a maze of one pixel walls the
+ *                             fill has to wind through, and noise that
+ *                             only fills with some tolerance
+ */
+bool Benchmark::filling(QTextStream &out)
+{
+    const int size = 4096;
+    out << "\nBucket fill, " << size << "x" << size << " px\n";
+
+    Canvas blank(QSize(size, size), Qt::white);
+
+    // walls every 16 px, open at the bottom and the top in turn
+    Canvas maze = blank;
+    maze.paint(maze.rect(), [&](QPainter &painter) {
+        painter.setPen(Qt::black);
+        for(int x = 16; x < size; x += 16)
+        {
+            if(x / 16 % 2)
+                painter.drawLine(x, 0, x, size - 2);
+            else
+                painter.drawLine(x, 1, x, size - 1);
+        }
+    });
+
+    Random random;
+    Canvas noise = blank;
+    noise.paintPixels(noise.rect(), [&](QImage &image, const QRect&) {
+        for(int y = 0; y < image.height(); ++y)
+        {
+            uint *row = reinterpret_cast<uint*>(image.scanLine(y));
+            for(int x = 0; x < image.width(); ++x)
+                row[x] = 0xffffffff - (random.next() & 0x000f0f0f);
+        }
+    });
+
+    struct Case
+    {
+        const char *name;
+        const Canvas *canvas;
+        int tolerance;
+    };
+    const Case cases[] = {{"blank", &blank, 0}, {"maze", &maze, 0}, {"noise", &noise, 20}};
+
+    bool agreed = true;
+    for(unsigned c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c)
+    {
+        Canvas expected;
+        qreal scalarRate = 0;
+        for(int path = Compositor::scalar_path; path <= Compositor::avx2_path; ++path)
+        {
+            if(!Compositor::isSupported(Compositor::Path(path)))
+                continue;
+
+            // fill copies of the canvas, the copy itself is only shared tiles
+            Canvas filled;
+            qint64 pixels = 0;
+            qint64 nsecs = 0;
+            int passes = 0;
+            QElapsedTimer total;
+            total.start();
+            do
+            {
+                filled = *cases[c].canvas;
+                FloodFill fill(&filled, uint(cases[c].tolerance), Compositor::Path(path));
+                QElapsedTimer timer;
+                timer.start();
+                fill.fill(QPoint(0, 0), Qt::red);
+                nsecs += timer.nsecsElapsed();
+                pixels = fill.filledPixels();
+                passes++;
+            } while(total.elapsed() < RUN_MSECS);
+
+            bool same = expected.isNull() || sameCanvas(filled, expected);
+            if(expected.isNull())
+                expected = filled;
+            agreed = agreed && same;
+
+            qreal msecs = nsecs / 1e6 / passes;
+            qreal rate = pixels / (msecs / 1e3) / 1e6;
+            if(path == Compositor::scalar_path)
+                scalarRate = rate;
+
+            out << QString("  %1 %2 %3 ms %4 Mpx/s  %5x%6\n")
+                   .arg(cases[c].name, -9)
+                   .arg(Compositor::pathName(Compositor::Path(path)), -7)
+                   .arg(msecs, 8, 'f', 2)
+                   .arg(rate, 8, 'f', 1)
+                   .arg(scalarRate > 0 ? rate / scalarRate : 1, 0, 'f', 2)
+                   .arg(same ? "" : "  MISMATCH");
+        }
+    }
+    return agreed;
+}
+
+/**
+ * @brief Benchmark::parallelFilling - A ParallelFill of a 100 megapixel
+ *                                     maze on 1, 2, 4... threads up to
+ *                                     the core count, against FloodFill
+ */
+bool Benchmark::parallelFilling(QTextStream &out)
+{
+    const int size = 10240;
+    const int cores = QThread::idealThreadCount();
+    out << "\nParallel bucket fill, " << size << "x" << size << " px, "
+        << cores << " cores\n";
+
+    // walls every 128 px, open at the bottom and the top in turn, so
+    // only every other column of tiles gets pixels
+    Canvas maze(QSize(size, size), Qt::white);
+    for(int x = 128; x < size; x += 128)
+    {
+        maze.paint(QRect(x, 0, 1, size), [&](QPainter &painter) {
+            painter.setPen(Qt::black);
+            if(x / 128 % 2)
+                painter.drawLine(x, 0, x, size - 2);
+            else
+                painter.drawLine(x, 1, x, size - 1);
+        });
+    }
+
+    Canvas expected = maze;
+    QElapsedTimer timer;
+    timer.start();
+    FloodFill serial(&expected, 0);
+    serial.fill(QPoint(0, 0), Qt::red);
+    out << QString("  %1 %2 ms\n").arg("FloodFill", -12)
+                                  .arg(timer.nsecsElapsed() / 1e6, 8, 'f', 1);
+
+    bool agreed = true;
+    qreal single = 0;
+    for(int threads = 1; ; threads = qMin(threads * 2, cores))
+    {
+        // the best of a few runs
+        qreal best = 0;
+        bool same = true;
+        for(int pass = 0; pass < 3; ++pass)
+        {
+            Canvas filled = maze;
+            ParallelFill fill(&filled, 0, threads);
+            timer.restart();
+            fill.fill(QPoint(0, 0), Qt::red);
+            qreal msecs = timer.nsecsElapsed() / 1e6;
+            best = pass == 0 ? msecs : qMin(best, msecs);
+            same = same && sameCanvas(filled, expected);
+        }
+        agreed = agreed && same;
+        if(threads == 1)
+            single = best;
+
+        out << QString("  %1 %2 ms  %3x%4\n")
+               .arg(QString("%1 thread%2").arg(threads).arg(threads > 1 ? "s" : ""), -12)
+               .arg(best, 8, 'f', 1)
+               .arg(single / best, 0, 'f', 2)
+               .arg(same ? "" : "  MISMATCH");
+        if(threads >= cores)
+            break;
+    }
+    return agreed;
+}
+
+/**
+ * @brief Benchmark::layerBlending - The layer kernels, a layer blended
+ *                                   onto another a tile row at a time,
+ *                                   checked against referenceBlend too
+ */
+bool Benchmark::layerBlending(QTextStream &out)
+{
+    const int pixels = 256 * 256;
+    const int row = TILE_SIZE;
+
+    Random random;
+    QVector<uint> src(pixels);
+    QVector<uint> dst(pixels);
+    for(int i = 0; i < pixels; ++i)
+    {
+        src[i] = random.pixel();
+        dst[i] = random.pixel();
+    }
+
+    out << "\nLayer blending, " << pixels / 1024 << "K px in rows of " << row << "\n";
+
+    bool agreed = true;
+    const BlendMode modes[] = {normal_blend, multiply_blend, screen_blend, overlay_blend,
+                               darken_blend, lighten_blend, add_blend, difference_blend};
+    for(unsigned m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m)
+    {
+        const BlendMode mode = modes[m];
+        QVector<uint> expected;
+        qreal scalarRate = 0;
+        for(int path = Compositor::scalar_path; path <= Compositor::avx2_path; ++path)
+        {
+            if(!Compositor::isSupported(Compositor::Path(path)))
+                continue;
+            Compositor::LayerRow kernel = Compositor::layerRow(mode, Compositor::Path(path));
+
+            // one pass from the same start to compare the pixels, faded
+            // so the opacity is checked as well
+            QVector<uint> blended = dst;
+            for(int i = 0; i < pixels; i += row)
+                kernel(blended.data() + i, src.constData() + i, row, 200);
+            bool same = expected.isEmpty() || blended == expected;
+            if(expected.isEmpty())
+            {
+                expected = blended;
+                for(int i = 0; i < pixels; ++i)
+                    same = same && blended[i] == referenceBlend(mode, src[i], dst[i], 200);
+            }
+            agreed = agreed && same;
+
+            QElapsedTimer timer;
+            timer.start();
+            qint64 passes = 0;
+            do
+            {
+                for(int i = 0; i < pixels; i += row)
+                    kernel(blended.data() + i, src.constData() + i, row, 255);
+                passes++;
+            } while(timer.elapsed() < RUN_MSECS);
+
+            qreal rate = passes * pixels / (timer.nsecsElapsed() / 1e9) / 1e6;
+            if(path == Compositor::scalar_path)
+                scalarRate = rate;
+
+            out << QString("  %1 %2 %3 Mpx/s  %4x%5\n")
+                   .arg(modeName(mode), -10)
+                   .arg(Compositor::pathName(Compositor::Path(path)), -7)
+                   .arg(rate, 8, 'f', 1)
+                   .arg(scalarRate > 0 ? rate / scalarRate : 1, 0, 'f', 2)
+                   .arg(same ? "" : "  MISMATCH");
+        }
+    }
+    return agreed;
+}
+
+/**
+ * @brief Benchmark::layering - Small paints on the middle one of 50
+ *                              layers, each redrawn like a paint event,
+ *                              against composing the whole stack. The
+ *                              saved image is checked against the layers
+ *                              put on one by one.
+ */
+bool Benchmark::layering(QTextStream &out)
+{
+    const int size = 2048;
+    const int count = 50;
+    out << "\nLayers, " << count << " of " << size << "x" << size << " px\n";
+
+    // a translucent disc on each layer, overlapping the ones below
+    LayerStack stack(QSize(size, size), Qt::white);
+    for(int i = 1; i < count; ++i)
+    {
+        Layer *layer = stack.insert(stack.currentIndex(), QString("Layer %1").arg(i));
+        QRect bounds((i * 397) % (size - 1024), (i * 211) % (size - 1024), 1024, 1024);
+        QColor color = QColor::fromHsv(i * 7 % 360, 200, 220, 160);
+        layer->canvas.paint(bounds, [&](QPainter &painter) {
+            painter.setRenderHint(QPainter::Antialiasing);
+            painter.setPen(Qt::NoPen);
+            painter.setBrush(color);
+            painter.drawEllipse(bounds);
+        });
+        stack.setOpacity(i, 50 + i);
+        if(i == count - 5)
+            stack.setMode(i, multiply_blend);
+    }
+    stack.setCurrent(count / 2);
+
+    QImage view(stack.size(), CANVAS_FORMAT);
+    QPainter painter(&view);
+    painter.setCompositionMode(QPainter::CompositionMode_Source);
+
+    QElapsedTimer timer;
+    timer.start();
+    stack.draw(&painter, stack.rect());
+    qreal full = timer.nsecsElapsed() / 1e6;
+    out << QString("  %1 %2 ms\n").arg("whole stack", -24).arg(full, 8, 'f', 2);
+
+    const int paints = 200;
+    timer.restart();
+    for(int i = 0; i < paints; ++i)
+    {
+        QRect dab((i * 37) % (size - 48), 512 + (i * 5) % 1024, 48, 48);
+        stack.current()->canvas.paint(dab, [&](QPainter &layerPainter) {
+            layerPainter.fillRect(dab, QColor(0, 0, 0, 128));
+        });
+        stack.changed(stack.currentIndex(), dab);
+        stack.draw(&painter, dab);
+    }
+    qreal each = timer.nsecsElapsed() / 1e6 / paints;
+    painter.end();
+
+    // composing the view from scratch has to give the same pixels
+    QImage redrawn(stack.size(), CANVAS_FORMAT);
+    QPainter redrawPainter(&redrawn);
+    redrawPainter.setCompositionMode(QPainter::CompositionMode_Source);
+    stack.changedAll();
+    stack.draw(&redrawPainter, stack.rect());
+    redrawPainter.end();
+    bool same = view == redrawn;
+
+    out << QString("  %1 %2 ms  %3x%4\n")
+           .arg("48 px paint, redrawn", -24)
+           .arg(each, 8, 'f', 3)
+           .arg(full / each, 0, 'f', 0)
+           .arg(same ? "" : "  MISMATCH");
+
+    // the saved image is the layers one by one, the view rounds the
+    // cached groups differently but only by a level or so
+    const QImage reference = sequentialFlatten(stack);
+    bool exact = stack.toImage() == reference;
+    int off = maxDifference(view, reference);
+    bool close = off <= LAYER_VIEW_TOLERANCE;
+    out << QString("  %1 %2, view off by up to %3%4\n")
+           .arg("saved image", -24)
+           .arg(exact ? "exact" : "MISMATCH")
+           .arg(off)
+           .arg(close ? "" : "  MISMATCH");
+    return same && exact && close;
+}
+
+/**
+ * @brief Benchmark::filtering - The blur kernels on each path, checked
+ *                               against each other and a floating point
+ *                               Gaussian, then a radius 20 blur of 40
+ *                               megapixels on 1, 2, 4... threads
+ */
+bool Benchmark::filtering(QTextStream &out)
+{
+    Random random;
+    const int radius = 20;
+    out << "\nFilters, radius " << radius << "\n";
+
+    // every path gives the same pixels, within a rounding of the curve
+    const Canvas small = randomCanvas(QSize(333, 277), random);
+    const QImage before = small.toImage();
+    Canvas expected;
+    bool agreed = true;
+    for(int path = Compositor::scalar_path; path <= Compositor::avx2_path; ++path)
+    {
+        if(!Compositor::isSupported(Compositor::Path(path)))
+            continue;
+        Canvas blurred = small;
+        Filter filter(gaussian_filter, radius, DEFAULT_SHARPEN_AMOUNT, 1, Compositor::Path(path));
+        filter.apply(&blurred, blurred.rect());
+
+        bool same = expected.isNull() || sameCanvas(blurred, expected);
+        if(expected.isNull())
+        {
+            expected = blurred;
+            const QImage after = blurred.toImage();
+            for(int y = 0; y < after.height(); y += 7)
+            {
+                const uint *line = reinterpret_cast<const uint*>(after.constScanLine(y));
+                for(int x = 0; x < after.width(); x += 7)
+                {
+                    for(int shift = 0; shift < 32; shift += 8)
+                    {
+                        const double difference = ((line[x] >> shift) & 0xff)
+                                                - referenceGauss(before, x, y, shift, radius);
+                        same = same && std::fabs(difference) <= 1;
+                    }
+                }
+            }
+        }
+        agreed = agreed && same;
+        out << QString("  %1 %2\n").arg(Compositor::pathName(Compositor::Path(path)), -7)
+                                   .arg(same ? "ok" : "MISMATCH");
+    }
+
+    const QSize size(7744, 5168);
+    const int cores = QThread::idealThreadCount();
+    out << "  " << size.width() << "x" << size.height() << " px, "
+        << cores << " cores\n";
+
+    const Canvas big = randomCanvas(size, random);
+    QElapsedTimer timer;
+    Canvas single;
+    qreal singleMsecs = 0;
+    for(int threads = 1; ; threads = qMin(threads * 2, cores))
+    {
+        Canvas blurred = big;
+        Filter filter(gaussian_filter, radius, DEFAULT_SHARPEN_AMOUNT, threads);
+        timer.start();
+        filter.apply(&blurred, blurred.rect());
+        qreal msecs = timer.nsecsElapsed() / 1e6;
+
+        // however the blocks are shared out, the pixels are the same
+        bool same = single.isNull() || sameCanvas(blurred, single);
+        if(single.isNull())
+        {
+            single = blurred;
+            singleMsecs = msecs;
+        }
+        agreed = agreed && same;
+
+        out << QString("  %1 %2 ms  %3x%4\n")
+               .arg(QString("Gaussian, %1 thread%2").arg(threads).arg(threads > 1 ? "s" : ""), -22)
+               .arg(msecs, 8, 'f', 1)
+               .arg(singleMsecs / msecs, 0, 'f', 2)
+               .arg(same ? "" : "  MISMATCH");
+        if(threads >= cores)
+            break;
+    }
+
+    // a preview only filters the tiles in view, and gets the same pixels
+    // there as the whole image
+    {
+        const QRect view(16 * TILE_SIZE, 16 * TILE_SIZE, 30 * TILE_SIZE, 17 * TILE_SIZE);
+        Filter filter(gaussian_filter, radius);
+        timer.start();
+        typedef QPair<int, Tile> NewTile;
+        const QVector<NewTile> tiles = filter.filterTiles(big, view);
+        qreal msecs = timer.nsecsElapsed() / 1e6;
+
+        bool same = true;
+        foreach(const NewTile &tile, tiles)
+        {
+            same = same && Canvas::sameTile(tile.second, single.tileAt(tile.first % single.columns(),
+                                                                      tile.first / single.columns()));
+        }
+
+        // a cancelled preview gives up and hands nothing back
+        QAtomicInt cancelled(1);
+        same = same && filter.filterTiles(big, view, &cancelled).isEmpty();
+        agreed = agreed && same;
+
+        out << QString("  %1 %2 ms  %3x%4\n")
+               .arg(QString("preview, %1x%2 view").arg(view.width()).arg(view.height()), -22)
+               .arg(msecs, 8, 'f', 1)
+               .arg(singleMsecs / msecs, 0, 'f', 2)
+               .arg(same ? "" : "  MISMATCH");
+    }
+
+    const FilterType others[] = {box_filter, sharpen_filter};
+    const char *names[] = {"box blur", "unsharp mask"};
+    for(int i = 0; i < 2; ++i)
+    {
+        Canvas filtered = big;
+        Filter filter(others[i], radius);
+        timer.start();
+        filter.apply(&filtered, filtered.rect());
+        out << QString("  %1 %2 ms\n").arg(QString("%1, %2 threads").arg(names[i]).arg(cores), -22)
+                                      .arg(timer.nsecsElapsed() / 1e6, 8, 'f', 1);
+    }
+    return agreed;
+}
@@ -0,0 +1,27 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <QTextStream>
+
+
+/**
+ * Microbenchmarks of the hot pixel loops, run with --benchmark instead of
+ * opening the window. Every kernel is timed on each path the CPU runs, and
+ * each path's pixels are checked against the scalar ones.
+ */
+class Benchmark
+{
+public:
+    /** print the results, returns 0 if every path agreed */
+    static int run();
+
+private:
+    static bool compositing(QTextStream&);
+    static bool filling(QTextStream&);
+    static bool parallelFilling(QTextStream&);
+    static bool layerBlending(QTextStream&);
+    static bool layering(QTextStream&);
+    static bool filtering(QTextStream&);
+};
+
+#endif // BENCHMARK_H
@@ -0,0 +1,180 @@
+#include <QMutex>
+#include <QMutexLocker>
+#include <QLineF>
+#include <QtMath>
+
+#include "brush.h"
+#include "constants.h"
+
+
+namespace {
+
+/** the masks made so far, shared by the GUI and stroke worker threads */
+struct MaskCache
+{
+    QMutex mutex;
+    QHash<quint64, QSharedPointer<const BrushMask>> masks;
+};
+
+} // namespace
+
+Q_GLOBAL_STATIC(MaskCache, maskCache)
+
+
+/**
+ * @brief BrushMask::BrushMask - Work out the coverage of every pixel of a
+ *                               dab, smoothstepping from full at hardness
+ *                               percent of the radius to none at the edge
+ */
+BrushMask::BrushMask(int diameter, int hardness)
+{
+    size = qMax(1, diameter);
+    hard = qBound(0, hardness, 100);
+    coverage.resize(size * size);
+
+    qreal radius = size / 2.0;
+    qreal core = hard / 100.0;
+    for(int y = 0; y < size; ++y)
+    {
+        for(int x = 0; x < size; ++x)
+        {
+            qreal distance = qSqrt(qPow(x + 0.5 - radius, 2) + qPow(y + 0.5 - radius, 2));
+            qreal value = qBound(qreal(0), radius - distance + 0.5, qreal(1));
+            if(core < 1)
+            {
+                qreal t = qBound(qreal(0), (distance / radius - core) / (1 - core), qreal(1));
+                value *= 1 - t * t * (3 - 2 * t);
+            }
+            coverage[y * size + x] = quint8(qRound(value * 255));
+        }
+    }
+}
+
+/**
+ * @brief BrushMask::get - The cached mask, or a new one. The cache is
+ *                         emptied once it holds BRUSH_MASK_CACHE masks,
+ *                         strokes still using one keep it alive.
+ */
+QSharedPointer<const BrushMask> BrushMask::get(int diameter, int hardness)
+{
+    quint64 key = quint64(quint32(diameter)) << 32 | quint32(hardness);
+
+    QMutexLocker lock(&maskCache()->mutex);
+    QSharedPointer<const BrushMask> mask = maskCache()->masks.value(key);
+    if(!mask)
+    {
+        if(maskCache()->masks.size() >= BRUSH_MASK_CACHE)
+            maskCache()->masks.clear();
+        mask = QSharedPointer<const BrushMask>(new BrushMask(diameter, hardness));
+        maskCache()->masks.insert(key, mask);
+    }
+    return mask;
+}
+
+BrushEngine::BrushEngine()
+{
+    hardness = DEFAULT_BRUSH_HARDNESS;
+    spacing = DEFAULT_BRUSH_SPACING;
+    opacity = DEFAULT_BRUSH_OPACITY;
+    blendMode = normal_blend;
+    kernel = Compositor::dabRow(blendMode);
+    pixel = 0;
+    alpha = 0;
+    started = false;
+    travelled = 0;
+}
+
+/**
+ * @brief BrushEngine::beginStroke - Drop the tiles kept for the last stroke
+ */
+void BrushEngine::beginStroke()
+{
+    started = false;
+    travelled = 0;
+    strokeTiles.clear();
+}
+
+/**
+ * @brief BrushEngine::strokeTo - Place a dab every spacing along the line
+ *                                to point, carrying what is left over to
+ *                                the next call
+ */
+QRect BrushEngine::strokeTo(Canvas *canvas, const QPointF &point, qreal size,
+                            const QColor &color)
+{
+    int diameter = qMax(1, qRound(size));
+    if(!mask || mask->diameter() != diameter || mask->hardness() != hardness)
+        mask = BrushMask::get(diameter, hardness);
+    pixel = qPremultiply(color.rgba());
+    alpha = uint(opacity * 255 / 100);
+    kernel = Compositor::dabRow(blendMode);
+
+    if(!started)
+    {
+        started = true;
+        last = point;
+        travelled = 0;
+        return dab(canvas, point);
+    }
+
+    QRect dirty;
+    qreal step = qMax(qreal(1), diameter * spacing / qreal(100));
+    qreal length = QLineF(last, point).length();
+    qreal at = step - travelled;
+    for(; at <= length; at += step)
+        dirty |= dab(canvas, last + (point - last) * (at / length));
+
+    travelled = length - (at - step);
+    last = point;
+    return dirty;
+}
+
+/**
+ * @brief BrushEngine::dab - Raise the stroke's coverage under the mask
+ *                           and blend the pixels under it again, with the
+ *                           kernel of the blend mode
+ */
+QRect BrushEngine::dab(Canvas *canvas, const QPointF &center)
+{
+    const int diameter = mask->diameter();
+    const QPoint origin(qRound(center.x() - diameter / 2.0),
+                        qRound(center.y() - diameter / 2.0));
+    QRect box = QRect(origin, QSize(diameter, diameter)) & canvas->rect();
+    if(box.isEmpty())
+        return QRect();
+
+    // keep the tiles as they were before the stroke first reaches them
+    for(int row = box.top() / TILE_SIZE; row <= box.bottom() / TILE_SIZE; ++row)
+    {
+        for(int column = box.left() / TILE_SIZE; column <= box.right() / TILE_SIZE; ++column)
+        {
+            int index = row * canvas->columns() + column;
+            if(strokeTiles.contains(index))
+                continue;
+
+            const Tile &tile = canvas->tileAt(column, row);
+            StrokeTile &kept = strokeTiles[index];
+            kept.before = tile.pixels();
+            kept.color = tile.color;
+            kept.coverage.fill(0, TILE_SIZE * TILE_SIZE);
+        }
+    }
+
+    canvas->paintPixels(box, [&](QImage &image, const QRect &tileRect) {
+        StrokeTile &kept = strokeTiles[tileRect.top() / TILE_SIZE * canvas->columns()
+                                       + tileRect.left() / TILE_SIZE];
+        QRect part = box & tileRect;
+        for(int y = part.top(); y <= part.bottom(); ++y)
+        {
+            const int row = y - tileRect.top();
+            const int left = part.left() - tileRect.left();
+            const quint8 *cover = mask->scanLine(y - origin.y()) + part.left() - origin.x();
+            quint8 *strokeCover = kept.coverage.data() + row * TILE_SIZE + left;
+            uint *dst = reinterpret_cast<uint*>(image.scanLine(row)) + left;
+            const uint *before = kept.before.isNull() ? nullptr
+                : reinterpret_cast<const uint*>(kept.before.constScanLine(row)) + left;
+            kernel(dst, before, kept.color, strokeCover, cover, part.width(), pixel, alpha);
+        }
+    });
+    return box;
+}
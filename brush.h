@@ -0,0 +1,107 @@
+#ifndef BRUSH_H
+#define BRUSH_H
+
+#include <QVector>
+#include <QHash>
+#include <QPointF>
+#include <QColor>
+#include <QSharedPointer>
+
+#include "canvas.h"
+#include "compositor.h"
+
+
+/**
+ * The coverage of one dab, diameter pixels square, 0-255 per pixel. A
+ * hard brush is fully covered up to its antialiased edge, a softer one
+ * fades out from hardness percent of its radius on. Masks never change
+ * once made, get() hands out the cached one for a size and hardness.
+ */
+class BrushMask
+{
+public:
+    BrushMask(int diameter, int hardness);
+
+    /** the mask for a diameter and hardness, made the first time it is
+     *  asked for and kept for every dab after. Thread safe. */
+    static QSharedPointer<const BrushMask> get(int diameter, int hardness);
+
+    int diameter() const { return size; }
+    int hardness() const { return hard; }
+    const quint8* scanLine(int y) const { return coverage.constData() + y * size; }
+
+private:
+    int size;
+    int hard;
+    QVector<quint8> coverage;
+};
+
+/**
+ * Draws strokes as a row of dabs, spacing percent of the brush size apart.
+ * Where dabs overlap the stronger one wins, so a stroke never gets more
+ * opaque than opacity however slowly it is drawn: every pixel is blended
+ * from how it was before the stroke, kept per tile as the stroke reaches it.
+ * The blending itself is done by the Compositor's dab kernels.
+ * Each stroke belongs to one thread, the worker's in threaded mode.
+ */
+class BrushEngine
+{
+public:
+    BrushEngine();
+
+    /** 0-100 percent */
+    int getHardness() const { return hardness; }
+    void setHardness(int percent) { hardness = qBound(0, percent, 100); }
+    int getSpacing() const { return spacing; }
+    void setSpacing(int percent) { spacing = qMax(1, percent); }
+    int getOpacity() const { return opacity; }
+    void setOpacity(int percent) { opacity = qBound(0, percent, 100); }
+
+    /** how the color goes onto the pixels, erase_blend takes them away */
+    BlendMode getBlendMode() const { return blendMode; }
+    void setBlendMode(BlendMode mode) { blendMode = mode; }
+
+    /** a hard opaque normal brush looks just like a plain pen stroke,
+     *  which is drawn faster as a line */
+    bool isSoft() const { return hardness < 100 || opacity < 100 || blendMode != normal_blend; }
+
+    /** forget the previous stroke */
+    void beginStroke();
+
+    /** dab along the way from the last point to point, the first point of
+     *  a stroke gets a dab of its own. Returns the area painted. */
+    QRect strokeTo(Canvas*, const QPointF &point, qreal size, const QColor&);
+
+private:
+    /** a tile the stroke reached, as it was before, and the coverage
+     *  the stroke put on it so far */
+    struct StrokeTile
+    {
+        QImage before;
+        uint color;
+        QVector<quint8> coverage;
+    };
+
+    QRect dab(Canvas*, const QPointF &center);
+
+    int hardness;
+    int spacing;
+    int opacity;
+    BlendMode blendMode;
+
+    /** the current stroke */
+    QSharedPointer<const BrushMask> mask;
+    Compositor::DabRow kernel;
+    uint pixel;
+    uint alpha;
+    bool started;
+    QPointF last;
+    qreal travelled;
+    QHash<int, StrokeTile> strokeTiles;
+
+    /** Don't allow copying */
+    BrushEngine(const BrushEngine&);
+    BrushEngine& operator=(const BrushEngine&);
+};
+
+#endif // BRUSH_H
@@ -0,0 +1,504 @@
+#include <cstring>
+#include <QAtomicInt>
+#include <QPaintEngine>
+
+#include "canvas.h"
+
+
+namespace {
+
+/** see Canvas::conversions */
+QAtomicInt conversionCount;
+
+/**
+ * @brief convertsOnDraw - true if drawing CANVAS_FORMAT pixels with the
+ *                         painter converts them, i.e. it paints on an
+ *                         image in neither CANVAS_FORMAT nor RGB32
+ */
+bool convertsOnDraw(QPainter *painter)
+{
+    QPaintDevice *device = painter->paintEngine() ? painter->paintEngine()->paintDevice()
+                                                  : painter->device();
+    if(!device || device->devType() != QInternal::Image)
+        return false;
+
+    QImage::Format format = static_cast<QImage*>(device)->format();
+    return format != CANVAS_FORMAT && format != QImage::Format_RGB32;
+}
+
+/**
+ * @brief uniformColor - true if every pixel of image is the same,
+ *                       which is then stored in pixel
+ */
+bool uniformColor(const QImage &image, uint *pixel)
+{
+    const uint first = reinterpret_cast<const uint*>(image.constScanLine(0))[0];
+    for(int y = 0; y < image.height(); ++y)
+    {
+        const uint *line = reinterpret_cast<const uint*>(image.constScanLine(y));
+        for(int x = 0; x < image.width(); ++x)
+        {
+            if(line[x] != first)
+                return false;
+        }
+    }
+    *pixel = first;
+    return true;
+}
+
+} // namespace
+
+
+/**
+ * @brief Canvas::Canvas - A null canvas
+ */
+Canvas::Canvas()
+{
+    tileColumns = 0;
+    tileRows = 0;
+    editing = false;
+    budget = 0;
+    resident = 0;
+    newest = -1;
+    oldest = -1;
+}
+
+/**
+ * @brief Canvas::Canvas - A canvas of the given size, all in one color.
+ *                         No tile has pixels yet, whatever the size.
+ */
+Canvas::Canvas(const QSize &size, const QColor &fill)
+{
+    canvasSize = size.expandedTo(QSize(0, 0));
+    tileColumns = (canvasSize.width() + TILE_SIZE - 1) / TILE_SIZE;
+    tileRows = (canvasSize.height() + TILE_SIZE - 1) / TILE_SIZE;
+    tiles.resize(tileColumns * tileRows);
+    editing = false;
+    budget = 0;
+    resident = 0;
+    newest = -1;
+    oldest = -1;
+    this->fill(fill);
+}
+
+/**
+ * @brief Canvas::Canvas - Split an image in CANVAS_FORMAT into tiles,
+ *                         keeping one-color tiles as just the color
+ */
+Canvas::Canvas(const QImage &image)
+    : Canvas(image.size())
+{
+    Q_ASSERT(image.format() == CANVAS_FORMAT);
+    for(int row = 0; row < tileRows; ++row)
+    {
+        for(int column = 0; column < tileColumns; ++column)
+        {
+            // look at the tile in place, only a pool buffer is allocated
+            Tile &tile = tiles[row * tileColumns + column];
+            QRect bounds = tileRect(column, row);
+            QImage part(image.constScanLine(bounds.top()) + bounds.left() * 4,
+                        bounds.width(), bounds.height(), image.bytesPerLine(),
+                        CANVAS_FORMAT);
+            if(!uniformColor(part, &tile.color))
+                tile.image = TilePool::instance()->copy(part);
+        }
+    }
+}
+
+/**
+ * @brief Canvas::copy - Flatten the tiles inside rect into one image
+ */
+QImage Canvas::copy(const QRect &rect) const
+{
+    QImage image(rect.size(), CANVAS_FORMAT);
+    image.fill(Qt::transparent);
+
+    QPainter painter(&image);
+    painter.translate(-rect.topLeft());
+    painter.setCompositionMode(QPainter::CompositionMode_Source);
+    draw(&painter, rect);
+    return image;
+}
+
+/**
+ * @brief Canvas::fill - Make every tile the given color, dropping all
+ *                       tile pixels
+ */
+void Canvas::fill(const QColor &color)
+{
+    Tile tile;
+    tile.color = qPremultiply(color.rgba());
+    tiles.fill(tile);
+
+    resident = 0;
+    newest = -1;
+    oldest = -1;
+}
+
+/**
+ * @brief Canvas::draw - Blit only the tiles inside area, one-color
+ *                       tiles are simply filled
+ */
+void Canvas::draw(QPainter *painter, const QRect &area) const
+{
+    QRect visible = area & rect();
+    if(visible.isEmpty())
+        return;
+
+    // the window's backing store or a caller's image, every tile blit
+    // onto a foreign format is one conversion
+    bool converts = convertsOnDraw(painter);
+
+    // uniform tiles are drawn from an image of their premultiplied
+    // color, a QColor would have to unpremultiply and lose precision
+    QImage uniform;
+    uint uniformPixel = 0;
+
+    for(int row = visible.top() / TILE_SIZE; row <= visible.bottom() / TILE_SIZE; ++row)
+    {
+        for(int column = visible.left() / TILE_SIZE; column <= visible.right() / TILE_SIZE; ++column)
+        {
+            const Tile &tile = touch(row * tileColumns + column);
+            QRect bounds = tileRect(column, row);
+            QRect part = bounds & visible;
+            if(converts || (tile.isResident() && tile.image.format() != CANVAS_FORMAT))
+                countConversion();
+
+            if(tile.isUniform())
+            {
+                if(uniform.isNull() || uniformPixel != tile.color)
+                {
+                    if(uniform.isNull())
+                        uniform = TilePool::instance()->create(QSize(TILE_SIZE, TILE_SIZE));
+                    uniform.fill(tile.color);
+                    uniformPixel = tile.color;
+                }
+                painter->drawImage(part.topLeft(), uniform, QRect(QPoint(0, 0), part.size()));
+            }
+            else
+                painter->drawImage(part.topLeft(), tile.image,
+                                   part.translated(-bounds.topLeft()));
+            trim();
+        }
+    }
+}
+
+/**
+ * @brief Canvas::tileRect - Where a tile sits on the canvas
+ */
+QRect Canvas::tileRect(int column, int row) const
+{
+    return QRect(column * TILE_SIZE, row * TILE_SIZE, TILE_SIZE, TILE_SIZE) & rect();
+}
+
+/**
+ * @brief Canvas::detachTile - Give a tile its own pixels, filling them
+ *                             with its color if it was uniform. The
+ *                             pixels always come from the TilePool.
+ */
+QImage& Canvas::detachTile(int column, int row)
+{
+    int index = row * tileColumns + column;
+    if(editing && !edited.contains(index))
+        edited.insert(index, tiles.at(index));
+
+    Tile &tile = touch(index);
+    if(tile.isUniform())
+    {
+        tile.image = TilePool::instance()->create(tileRect(column, row).size());
+        tile.image.fill(tile.color);
+        if(tileSwap)
+        {
+            resident += tile.byteCost();
+            link(index);
+        }
+    }
+    else if(!tile.image.isDetached())
+    {
+        // still shared with undo, copy it into a pool buffer ourselves
+        // instead of letting the painter's detach allocate one
+        tile.image = TilePool::instance()->copy(tile.image);
+    }
+
+    // a painter on any other format converts its pixels as it goes
+    if(tile.image.format() != CANVAS_FORMAT)
+        countConversion();
+
+    // about to be painted on, the paged out copy goes stale
+    tile.page.clear();
+    return tile.image;
+}
+
+/**
+ * @brief Canvas::conversions - Pixel format conversions counted by every
+ *                              canvas, from any thread
+ */
+int Canvas::conversions()
+{
+    return conversionCount.load();
+}
+
+void Canvas::countConversion()
+{
+    conversionCount.ref();
+}
+
+/**
+ * @brief Canvas::replaceTile - Swap in a whole new tile made elsewhere,
+ *                              e.g. by a fill, as if painted on
+ */
+void Canvas::replaceTile(int column, int row, const Tile &tile)
+{
+    int index = row * tileColumns + column;
+    if(editing && !edited.contains(index))
+        edited.insert(index, tiles.at(index));
+
+    setTile(column, row, tile);
+}
+
+/**
+ * @brief Canvas::beginEdit - Start keeping the tiles paints touch
+ */
+void Canvas::beginEdit()
+{
+    editing = true;
+    edited.clear();
+}
+
+/**
+ * @brief Canvas::endEdit - The tiles touched since beginEdit, as they
+ *                          were before. A tile painted on without any
+ *                          pixel changing, e.g. by the antialiased edge
+ *                          of a stroke passing by, gets the old one back
+ *                          and shares its pixels again.
+ */
+QHash<int, Tile> Canvas::endEdit()
+{
+    editing = false;
+    QHash<int, Tile> before;
+    for(QHash<int, Tile>::const_iterator it = edited.constBegin();
+        it != edited.constEnd(); ++it)
+    {
+        int column = it.key() % tileColumns;
+        int row = it.key() / tileColumns;
+        if(sameTile(it.value(), tiles.at(it.key())))
+            setTile(column, row, it.value());
+        else
+            before.insert(it.key(), it.value());
+    }
+    edited.clear();
+    return before;
+}
+
+/**
+ * @brief Canvas::setTile - Replace a tile, e.g. from undo/redo
+ */
+void Canvas::setTile(int column, int row, const Tile &tile)
+{
+    int index = row * tileColumns + column;
+    if(tileSwap && tiles.at(index).isResident())
+    {
+        resident -= tiles.at(index).byteCost();
+        unlink(index);
+    }
+
+    tiles[index] = tile;
+
+    if(tileSwap && tile.isResident())
+    {
+        resident += tile.byteCost();
+        link(index);
+        trim();
+    }
+}
+
+/**
+ * @brief Canvas::sameTile - Compare two tiles of the same size. Shared
+ *                           pixels and two uniform tiles are cheap, only
+ *                           real pixels have to be looked at.
+ */
+bool Canvas::sameTile(const Tile &a, const Tile &b)
+{
+    if(a.isUniform() && b.isUniform())
+        return a.color == b.color;
+
+    // a page is only kept while it matches the tile
+    if(a.page && a.page == b.page)
+        return true;
+
+    if(a.isUniform() || b.isUniform())
+    {
+        uint pixel;
+        const Tile &pixels = a.isUniform() ? b : a;
+        const Tile &uniform = a.isUniform() ? a : b;
+        return uniformColor(pixels.pixels(), &pixel) && pixel == uniform.color;
+    }
+
+    QImage imageA = a.pixels();
+    QImage imageB = b.pixels();
+    if(imageA.constBits() == imageB.constBits())
+        return true;
+    if(imageA.size() != imageB.size())
+        return false;
+
+    const size_t rowBytes = size_t(imageA.width()) * 4;
+    for(int y = 0; y < imageA.height(); ++y)
+    {
+        if(memcmp(imageA.constScanLine(y), imageB.constScanLine(y), rowBytes) != 0)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Canvas::memoryUsage - Bytes of pixels held by the tiles
+ */
+qint64 Canvas::memoryUsage() const
+{
+    qint64 bytes = 0;
+    foreach(const Tile &tile, tiles)
+        bytes += tile.byteCost();
+    return bytes;
+}
+
+/**
+ * @brief Canvas::unsharedUsage - Bytes of pixels held by tiles whose
+ *                                image has no other copy
+ */
+qint64 Canvas::unsharedUsage() const
+{
+    qint64 bytes = 0;
+    foreach(const Tile &tile, tiles)
+    {
+        if(tile.image.isDetached())
+            bytes += tile.byteCost();
+    }
+    return bytes;
+}
+
+/**
+ * @brief Canvas::setSwap - Run out of core with the given swap and RAM
+ *                          budget, or back in RAM with a null swap
+ */
+void Canvas::setSwap(const QSharedPointer<TileSwap> &swap, qint64 budget)
+{
+    if(swap != tileSwap)
+    {
+        // leaving the swap, everything has to be in RAM again
+        if(!swap)
+        {
+            for(int index = 0; index < tiles.size(); ++index)
+            {
+                Tile &tile = tiles[index];
+                if(!tile.isResident() && tile.page)
+                    tile.image = tile.page->read();
+                tile.page.clear();
+            }
+        }
+
+        tileSwap = swap;
+        resident = 0;
+        newest = -1;
+        oldest = -1;
+        newer.fill(-1, tiles.size());
+        older.fill(-1, tiles.size());
+        if(tileSwap)
+        {
+            for(int index = 0; index < tiles.size(); ++index)
+            {
+                if(tiles.at(index).isResident())
+                {
+                    resident += tiles.at(index).byteCost();
+                    link(index);
+                }
+            }
+        }
+    }
+
+    this->budget = budget;
+    trim();
+}
+
+/**
+ * @brief Canvas::touch - Page a tile in if it is out and make it the
+ *                        most recently used one
+ */
+Tile& Canvas::touch(int index) const
+{
+    Tile &tile = tiles[index];
+    if(!tileSwap)
+        return tile;
+
+    if(tile.isResident())
+    {
+        unlink(index);
+        link(index);
+    }
+    else if(tile.page)
+    {
+        tile.image = tile.page->read();
+        resident += tile.byteCost();
+        link(index);
+    }
+    return tile;
+}
+
+/**
+ * @brief Canvas::trim - Page out the least recently used tiles while over
+ *                       budget. Tiles that weren't painted on since they
+ *                       were paged in still have their page and are
+ *                       simply dropped.
+ */
+void Canvas::trim() const
+{
+    if(!tileSwap)
+        return;
+
+    while(resident > budget && oldest != -1)
+    {
+        int index = oldest;
+        Tile &tile = tiles[index];
+        if(!tile.page)
+        {
+            // if the swap file can't grow, the rest stays in RAM
+            tile.page = tileSwap->write(tile.image);
+            if(!tile.page)
+                return;
+        }
+
+        unlink(index);
+        resident -= tile.byteCost();
+        tile.image = QImage();
+    }
+}
+
+/**
+ * @brief Canvas::link - Put a tile at the newest end of the LRU list
+ */
+void Canvas::link(int index) const
+{
+    older[index] = newest;
+    newer[index] = -1;
+    if(newest != -1)
+        newer[newest] = index;
+    newest = index;
+    if(oldest == -1)
+        oldest = index;
+}
+
+/**
+ * @brief Canvas::unlink - Take a tile out of the LRU list
+ */
+void Canvas::unlink(int index) const
+{
+    int before = older.at(index);
+    int after = newer.at(index);
+    if(before != -1)
+        newer[before] = after;
+    else
+        oldest = after;
+    if(after != -1)
+        older[after] = before;
+    else
+        newest = before;
+}
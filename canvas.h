@@ -0,0 +1,224 @@
+#ifndef CANVAS_H
+#define CANVAS_H
+
+#include <QImage>
+#include <QVector>
+#include <QHash>
+#include <QPainter>
+#include <QPainterPath>
+#include <QColor>
+#include <QSharedPointer>
+
+#include "constants.h"
+#include "tile_swap.h"
+#include "tile_pool.h"
+
+
+/** one TILE_SIZE square of the canvas, smaller at the right/bottom edge */
+struct Tile
+{
+    Tile() : color(0) {}
+
+    /** null while the whole tile is one color, or while it is paged out */
+    QImage image;
+    /** that color as a CANVAS_FORMAT pixel */
+    uint color;
+    /** the pixels in the swap file, kept while they match the image */
+    QSharedPointer<SwapPage> page;
+
+    bool isUniform() const { return image.isNull() && page.isNull(); }
+    bool isResident() const { return !image.isNull(); }
+    qint64 byteCost() const { return image.isNull() ? 0 : image.sizeInBytes(); }
+
+    /** the tile's pixels, read from the swap file if paged out, without
+     *  paging it in. Null for a uniform tile. */
+    QImage pixels() const { return image.isNull() && page ? page->read() : image; }
+};
+
+/**
+ * The image being drawn on, split into tiles. Tiles that are all one
+ * color (all background) are kept as just that color and only get
+ * pixels once something paints on them. Copies share their tiles, a
+ * tile's pixels are only copied when one side paints on it.
+ *
+ * With a TileSwap set the canvas runs out of core: once its tiles take
+ * more than the budget, the least recently drawn or painted ones are
+ * paged out and paged back in when they are needed again.
+ */
+class Canvas
+{
+public:
+    Canvas();
+    Canvas(const QSize &size, const QColor &fill = Qt::transparent);
+    explicit Canvas(const QImage &image);
+
+    QSize size() const { return canvasSize; }
+    int width() const { return canvasSize.width(); }
+    int height() const { return canvasSize.height(); }
+    QRect rect() const { return QRect(QPoint(0, 0), canvasSize); }
+    bool isNull() const { return canvasSize.isEmpty(); }
+
+    /** flatten to one image, for saving and resizing */
+    QImage toImage() const { return copy(rect()); }
+    QImage copy(const QRect&) const;
+
+    void fill(const QColor&);
+
+    /** draw the part of the canvas inside area, in canvas coordinates */
+    void draw(QPainter*, const QRect &area) const;
+
+    /** paint on every tile bounds touches. draw(QPainter&) is called once
+     *  per tile, with the painter translated to canvas coordinates. */
+    template<typename Draw>
+    void paint(const QRect &bounds, Draw draw);
+
+    /** paint only on the tiles coverage reaches into, for lines and
+     *  outlines whose bounding rect is mostly untouched */
+    template<typename Draw>
+    void paint(const QPainterPath &coverage, Draw draw);
+
+    /** like paint for code writing pixels itself: write(QImage&, const
+     *  QRect&) gets each tile's image and where the tile is on the canvas */
+    template<typename Write>
+    void paintPixels(const QRect &bounds, Write write);
+
+    /** tile access */
+    int columns() const { return tileColumns; }
+    int rows() const { return tileRows; }
+    QRect tileRect(int column, int row) const;
+    const Tile& tileAt(int column, int row) const
+        { return tiles.at(row * tileColumns + column); }
+    void setTile(int column, int row, const Tile &tile);
+
+    /** the tile's pixels, ready to be painted on */
+    QImage& detachTile(int column, int row);
+
+    /** setTile as a paint would do it, kept for the edit in progress */
+    void replaceTile(int column, int row, const Tile &tile);
+
+    /** keep each tile as it was before the first paint on it from now
+     *  on, endEdit hands them over by index. Nothing is copied, the kept
+     *  tiles share their pixels until the paint detaches them. */
+    void beginEdit();
+    QHash<int, Tile> endEdit();
+
+    /** true if both tiles hold the same pixels */
+    static bool sameTile(const Tile&, const Tile&);
+
+    /** pixel format conversions a draw or paint went through so far,
+     *  a stroke should add none. Counted from any thread. */
+    static int conversions();
+    static void countConversion();
+
+    /** pixels held in RAM by tiles that aren't uniform */
+    qint64 memoryUsage() const;
+
+    /** the part of it no other canvas or undo command shares */
+    qint64 unsharedUsage() const;
+
+    /** page tiles out to swap beyond budget bytes, a null swap keeps
+     *  every tile in RAM */
+    void setSwap(const QSharedPointer<TileSwap>&, qint64 budget);
+    QSharedPointer<TileSwap> swap() const { return tileSwap; }
+    qint64 swapBudget() const { return budget; }
+
+private:
+    /** the tile, paged in and marked as just used */
+    Tile& touch(int index) const;
+
+    /** page out the least recently used tiles until within budget */
+    void trim() const;
+
+    /** the LRU list of tiles in RAM, newest first */
+    void link(int index) const;
+    void unlink(int index) const;
+
+    QSize canvasSize;
+    int tileColumns;
+    int tileRows;
+
+    /** the tiles before the edit in progress touched them */
+    bool editing;
+    QHash<int, Tile> edited;
+
+    /** paging changes how a tile is held, never its pixels, so it
+     *  happens in const draws too */
+    mutable QVector<Tile> tiles;
+
+    /** out of core mode, the rest is only kept up to date while
+     *  tileSwap is set */
+    QSharedPointer<TileSwap> tileSwap;
+    qint64 budget;
+    mutable qint64 resident;
+    mutable QVector<int> newer;
+    mutable QVector<int> older;
+    mutable int newest;
+    mutable int oldest;
+};
+
+template<typename Draw>
+void Canvas::paint(const QRect &bounds, Draw draw)
+{
+    QRect area = bounds & rect();
+    if(area.isEmpty())
+        return;
+
+    for(int row = area.top() / TILE_SIZE; row <= area.bottom() / TILE_SIZE; ++row)
+    {
+        for(int column = area.left() / TILE_SIZE; column <= area.right() / TILE_SIZE; ++column)
+        {
+            {
+                QImage &image = detachTile(column, row);
+                QPainter painter(&image);
+                painter.translate(-column * TILE_SIZE, -row * TILE_SIZE);
+                draw(painter);
+            }
+            trim();
+        }
+    }
+}
+
+template<typename Draw>
+void Canvas::paint(const QPainterPath &coverage, Draw draw)
+{
+    QRect area = coverage.boundingRect().toAlignedRect() & rect();
+    if(area.isEmpty())
+        return;
+
+    for(int row = area.top() / TILE_SIZE; row <= area.bottom() / TILE_SIZE; ++row)
+    {
+        for(int column = area.left() / TILE_SIZE; column <= area.right() / TILE_SIZE; ++column)
+        {
+            // a tile the shape passes by keeps sharing its pixels
+            if(!coverage.intersects(QRectF(tileRect(column, row))))
+                continue;
+
+            {
+                QImage &image = detachTile(column, row);
+                QPainter painter(&image);
+                painter.translate(-column * TILE_SIZE, -row * TILE_SIZE);
+                draw(painter);
+            }
+            trim();
+        }
+    }
+}
+
+template<typename Write>
+void Canvas::paintPixels(const QRect &bounds, Write write)
+{
+    QRect area = bounds & rect();
+    if(area.isEmpty())
+        return;
+
+    for(int row = area.top() / TILE_SIZE; row <= area.bottom() / TILE_SIZE; ++row)
+    {
+        for(int column = area.left() / TILE_SIZE; column <= area.right() / TILE_SIZE; ++column)
+        {
+            write(detachTile(column, row), tileRect(column, row));
+            trim();
+        }
+    }
+}
+
+#endif // CANVAS_H
@@ -1,32 +1,1427 @@
+#include <QDataStream>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QMutexLocker>
+#include <QDir>
+#include <QHash>
+#include <QSet>
+#include <cstring>
+
 #include "commands.h"
-#include "qrect.h"
+#include "constants.h"
+
+
+namespace {
+
+/**
+ * @brief hashPixels - A fast 64 bit hash of a tile's pixels, the key in
+ *                     the TileStore
+ */
+quint64 hashPixels(const QImage &image)
+{
+    quint64 hash = quint64(image.width()) << 32 | quint32(image.height());
+    for(int y = 0; y < image.height(); ++y)
+    {
+        const quint32 *line = reinterpret_cast<const quint32*>(image.constScanLine(y));
+        for(int x = 0; x < image.width(); ++x)
+            hash = (hash ^ line[x]) * Q_UINT64_C(0x9E3779B97F4A7C15);
+    }
+    return hash ^ (hash >> 32);
+}
+
+/**
+ * @brief compressTile - A tile's pixels, row after row, compressed
+ */
+QByteArray compressTile(const QImage &image)
+{
+    const int rowBytes = image.width() * 4;
+    QByteArray bytes(rowBytes * image.height(), Qt::Uninitialized);
+    for(int y = 0; y < image.height(); ++y)
+        memcpy(bytes.data() + y * rowBytes, image.constScanLine(y), size_t(rowBytes));
+    return qCompress(bytes);
+}
+
+/**
+ * @brief decompressTile - Read back a tile written by compressTile
+ */
+QImage decompressTile(const QSize &size, const QByteArray &compressed)
+{
+    QByteArray bytes = qUncompress(compressed);
+    QImage image = TilePool::instance()->create(size);
+    const int rowBytes = size.width() * 4;
+    if(bytes.size() != rowBytes * size.height())
+        return image;
+
+    for(int y = 0; y < size.height(); ++y)
+        memcpy(image.scanLine(y), bytes.constData() + y * rowBytes, size_t(rowBytes));
+    return image;
+}
+
+/**
+ * @brief writeTile - Append a tile to a packed table. Uniform tiles are
+ *                    just their color, the others go to the store and
+ *                    are written as an index into refs.
+ */
+void writeTile(QDataStream &out, const Tile &tile, TileStore *store,
+               QVector<QSharedPointer<StoredTile> > *refs)
+{
+    out << tile.isUniform();
+    if(tile.isUniform())
+    {
+        out << quint32(tile.color);
+        return;
+    }
+    out << qint32(refs->size());
+    refs->append(store->intern(tile.pixels()));
+}
+
+/**
+ * @brief readTile - Read back a tile written by writeTile, given the
+ *                   pixels of the refs
+ */
+Tile readTile(QDataStream &in, const QVector<QImage> &images)
+{
+    Tile tile;
+    bool uniform;
+    in >> uniform;
+    if(uniform)
+    {
+        quint32 color;
+        in >> color;
+        tile.color = color;
+    }
+    else
+    {
+        qint32 ref;
+        in >> ref;
+        tile.image = images.value(ref);
+    }
+    return tile;
+}
+
+/** compresses, or spills if given a journal, one TileDelta on the
+ *  history's background thread */
+class PackJob : public QRunnable
+{
+public:
+    PackJob(const QSharedPointer<TileDelta> &delta, QObject *history,
+            const QSharedPointer<TileStore> &store,
+            const QSharedPointer<UndoJournal> &journal)
+        : delta(delta), history(history), store(store), journal(journal) {}
+
+    void run() override
+    {
+        if(journal)
+            delta->spill(journal, store);
+        else
+            delta->pack(store);
+        delta->queued.storeRelease(0);
+        QMetaObject::invokeMethod(history, "updateUsage", Qt::QueuedConnection);
+    }
+
+private:
+    QSharedPointer<TileDelta> delta;
+    QObject *history;
+    QSharedPointer<TileStore> store;
+    QSharedPointer<UndoJournal> journal;
+};
+
+/** moves the records of spilled deltas to a new journal, on the same
+ *  thread as the PackJobs so a spill queued before it is moved too */
+class CompactJob : public QRunnable
+{
+public:
+    CompactJob(const QList<QSharedPointer<TileDelta> > &deltas,
+               const QSharedPointer<UndoJournal> &journal)
+        : deltas(deltas), journal(journal) {}
+
+    void run() override
+    {
+        foreach(const QSharedPointer<TileDelta> &delta, deltas)
+            delta->moveRecord(journal);
+    }
+
+private:
+    QList<QSharedPointer<TileDelta> > deltas;
+    QSharedPointer<UndoJournal> journal;
+};
+
+} // namespace
+
+
+/**
+ * @brief UndoJournal::UndoJournal - The journal file is only created
+ *                                   once the first record is written
+ */
+UndoJournal::UndoJournal()
+    : file(QDir::tempPath() + "/paintpp-undo-XXXXXX.journal")
+{
+    end = 0;
+    live = 0;
+}
+
+/**
+ * @brief UndoJournal::append - Write a record at the end of the journal
+ */
+qint64 UndoJournal::append(const QByteArray &bytes)
+{
+    QMutexLocker lock(&mutex);
+    if(!file.isOpen() && !file.open())
+        return -1;
+
+    if(!file.seek(end) || file.write(bytes) != bytes.size() || !file.flush())
+        return -1;
+
+    qint64 offset = end;
+    end += bytes.size();
+    live += bytes.size();
+    return offset;
+}
+
+/**
+ * @brief UndoJournal::read - Map a record into memory and copy it out
+ */
+QByteArray UndoJournal::read(qint64 offset, qint64 length)
+{
+    QMutexLocker lock(&mutex);
+    uchar *data = file.map(offset, length);
+    if(!data)
+        return QByteArray();
+
+    QByteArray bytes(reinterpret_cast<const char*>(data), int(length));
+    file.unmap(data);
+    return bytes;
+}
+
+/**
+ * @brief UndoJournal::release - Forget a record. With none left the file
+ *                               is emptied and written from the start.
+ */
+void UndoJournal::release(qint64 length)
+{
+    QMutexLocker lock(&mutex);
+    live -= length;
+    if(live == 0 && end > 0)
+    {
+        file.resize(0);
+        end = 0;
+    }
+}
+
+qint64 UndoJournal::size() const
+{
+    QMutexLocker lock(&mutex);
+    return end;
+}
+
+qint64 UndoJournal::liveSize() const
+{
+    QMutexLocker lock(&mutex);
+    return live;
+}
+
+/**
+ * @brief StoredTile::StoredTile - Compressed pixels owned by the deltas
+ *                                 sharing this tile
+ */
+StoredTile::StoredTile(const QSharedPointer<TileStore> &store, quint64 hash,
+                       const QSize &size, const QByteArray &bytes)
+{
+    this->store = store;
+    key = hash;
+    tileSize = size;
+    compressed = bytes;
+}
+
+StoredTile::~StoredTile()
+{
+    store->forget(this);
+}
+
+QImage StoredTile::image() const
+{
+    return decompressTile(tileSize, compressed);
+}
+
+/**
+ * @brief TileStore::intern - Look a tile up by its pixels
+ */
+QSharedPointer<StoredTile> TileStore::intern(const QImage &image)
+{
+    return intern(hashPixels(image), image.size(), compressTile(image));
+}
+
+/**
+ * @brief TileStore::intern - Look a tile up by its hash, the compressed
+ *                            bytes settle collisions since compressing
+ *                            the same pixels always gives the same bytes
+ */
+QSharedPointer<StoredTile> TileStore::intern(quint64 hash, const QSize &size,
+                                             const QByteArray &compressed)
+{
+    // released after the lock, the last ref may go away here
+    QList<QSharedPointer<StoredTile> > candidates;
+
+    QMutexLocker lock(&mutex);
+    QMultiHash<quint64, QWeakPointer<StoredTile> >::const_iterator it = tiles.constFind(hash);
+    for(; it != tiles.constEnd() && it.key() == hash; ++it)
+    {
+        QSharedPointer<StoredTile> tile = it.value().toStrongRef();
+        candidates.append(tile);
+        if(tile && tile->size() == size && tile->bytes() == compressed)
+            return tile;
+    }
+
+    QSharedPointer<StoredTile> tile(new StoredTile(sharedFromThis(), hash, size, compressed));
+    tiles.insert(hash, tile.toWeakRef());
+    bytes += compressed.size();
+    return tile;
+}
+
+qint64 TileStore::storedBytes() const
+{
+    QMutexLocker lock(&mutex);
+    return bytes;
+}
+
+/**
+ * @brief TileStore::forget - Drop a tile no delta refers to anymore
+ */
+void TileStore::forget(StoredTile *tile)
+{
+    QMutexLocker lock(&mutex);
+    QMultiHash<quint64, QWeakPointer<StoredTile> >::iterator it = tiles.find(tile->hash());
+    while(it != tiles.end() && it.key() == tile->hash())
+    {
+        if(it.value().isNull())
+            it = tiles.erase(it);
+        else
+            ++it;
+    }
+    bytes -= tile->bytes().size();
+}
+
+TileDelta::~TileDelta()
+{
+    if(journal && length > 0)
+        journal->release(length);
+}
+
+/**
+ * @brief TileDelta::append - Add a changed tile, only while building
+ */
+void TileDelta::append(const DeltaTile &tile)
+{
+    QMutexLocker lock(&mutex);
+    raw.append(tile);
+    cost += tile.before.byteCost() + tile.after.byteCost();
+    own = cost;
+}
+
+/**
+ * @brief TileDelta::tiles - The changed tiles, decompressing them or
+ *                           reading them back from disk first if needed
+ */
+QVector<DeltaTile> TileDelta::tiles()
+{
+    QMutexLocker lock(&mutex);
+    if(onDisk)
+    {
+        // the record holds the table and the pixels of its refs
+        QByteArray record = journal->read(offset, length);
+        QDataStream in(record);
+        QByteArray table;
+        qint32 count = 0;
+        in >> table >> count;
+
+        QVector<QImage> images;
+        images.reserve(count);
+        for(int i = 0; i < count; ++i)
+        {
+            QSize size;
+            QByteArray bytes;
+            in >> size >> bytes;
+            images.append(decompressTile(size, bytes));
+        }
+        unpack(table, images);
+        onDisk = false;
+    }
+    else if(!packed.isEmpty())
+    {
+        QVector<QImage> images;
+        images.reserve(refs.size());
+        foreach(const QSharedPointer<StoredTile> &ref, refs)
+            images.append(ref->image());
+        unpack(packed, images);
+        packed.clear();
+        refs.clear();
+    }
+    return raw;
+}
+
+/**
+ * @brief TileDelta::unpack - Rebuild the raw tiles from a packed table,
+ *                            the mutex must be held
+ */
+void TileDelta::unpack(const QByteArray &table, const QVector<QImage> &images)
+{
+    QDataStream in(table);
+    qint32 count = 0;
+    in >> count;
+
+    raw.clear();
+    raw.reserve(count);
+    cost = 0;
+    for(int i = 0; i < count; ++i)
+    {
+        DeltaTile tile;
+        in >> tile.pos;
+        tile.before = readTile(in, images);
+        tile.after = readTile(in, images);
+        raw.append(tile);
+        cost += tile.before.byteCost() + tile.after.byteCost();
+    }
+    own = cost;
+}
+
+bool TileDelta::isEmpty() const
+{
+    QMutexLocker lock(&mutex);
+    return raw.isEmpty() && packed.isEmpty() && !onDisk;
+}
+
+/**
+ * @brief TileDelta::pack - Move the pixels into the store, keeping just a
+ *                          table of positions and refs. The slow part
+ *                          runs without holding the lock.
+ */
+void TileDelta::pack(const QSharedPointer<TileStore> &store)
+{
+    QVector<DeltaTile> tiles;
+    {
+        QMutexLocker lock(&mutex);
+        if(raw.isEmpty())
+            return;
+        tiles = raw;
+    }
+
+    QByteArray table;
+    QVector<QSharedPointer<StoredTile> > stored;
+    QDataStream out(&table, QIODevice::WriteOnly);
+    out << qint32(tiles.size());
+    foreach(const DeltaTile &tile, tiles)
+    {
+        out << tile.pos;
+        writeTile(out, tile.before, store.data(), &stored);
+        writeTile(out, tile.after, store.data(), &stored);
+    }
+
+    QMutexLocker lock(&mutex);
+    if(raw.isEmpty())
+        return;
+    packed = table;
+    refs = stored;
+    raw.clear();
+    own = packed.size();
+    cost = own;
+    foreach(const QSharedPointer<StoredTile> &ref, refs)
+        cost += ref->bytes().size();
+}
 
+/**
+ * @brief TileDelta::spill - Move the packed tiles to the journal. Only
+ *                           the first spill writes anything, after that
+ *                           the in-memory copy is simply dropped.
+ */
+void TileDelta::spill(const QSharedPointer<UndoJournal> &journal,
+                      const QSharedPointer<TileStore> &store)
+{
+    {
+        QMutexLocker lock(&mutex);
+        if(onDisk)
+            return;
+        if(length == 0)
+        {
+            lock.unlock();
+            pack(store);
+        }
+    }
+
+    QMutexLocker lock(&mutex);
+    if(onDisk || (raw.isEmpty() && packed.isEmpty()))
+        return;
+
+    if(length == 0)
+    {
+        // unpacked again while we were packing, it is hot after all
+        if(packed.isEmpty())
+            return;
+
+        // on disk every record carries its own pixels
+        QByteArray record;
+        QDataStream out(&record, QIODevice::WriteOnly);
+        out << packed << qint32(refs.size());
+        foreach(const QSharedPointer<StoredTile> &ref, refs)
+            out << ref->size() << ref->bytes();
+
+        qint64 at = journal->append(record);
+        if(at < 0)
+            return;
+        this->journal = journal;
+        offset = at;
+        length = record.size();
+    }
+
+    raw.clear();
+    packed.clear();
+    refs.clear();
+    onDisk = true;
+    cost = 0;
+    own = 0;
+}
 
 /**
- * @brief DrawCommand::DrawCommand - A command that keeps a copy of the image
- *                                   before and after something is drawn
+ * @brief TileDelta::moveRecord - Copy the record written by spill to
+ *                                another journal, e.g. when the old one
+ *                                is compacted
  */
-DrawCommand::DrawCommand(const QPixmap &oldImage, QPixmap *image,
-                               QUndoCommand *parent)
-    : QUndoCommand(parent)
+void TileDelta::moveRecord(const QSharedPointer<UndoJournal> &target)
+{
+    QMutexLocker lock(&mutex);
+    if(length == 0 || journal == target)
+        return;
+
+    QByteArray record = journal->read(offset, length);
+    if(record.size() != length)
+        return;
+    qint64 at = target->append(record);
+    if(at < 0)
+        return;
+
+    journal->release(length);
+    journal = target;
+    offset = at;
+}
+
+TileDelta::State TileDelta::state() const
+{
+    QMutexLocker lock(&mutex);
+    if(onDisk)
+        return Spilled;
+    return packed.isEmpty() ? Raw : Packed;
+}
+
+qint64 TileDelta::byteCost() const
+{
+    QMutexLocker lock(&mutex);
+    return cost;
+}
+
+qint64 TileDelta::ownCost() const
 {
-    this->image = image;
-    this->oldImage = oldImage;
-    newImage = image->copy(QRect());
+    QMutexLocker lock(&mutex);
+    return own;
 }
 
 /**
- * @brief DrawCommand::undo - Undo a draw command, restoring the old image
+ * @brief DrawCommand::DrawCommand - A command that keeps the tiles of the
+ *                                   canvas that changed, before and after
+ *                                   something is drawn. Only the tiles
+ *                                   touching the dirty area are compared,
+ *                                   a null area means the whole canvas.
+ *                                   The tiles are shared with the canvases,
+ *                                   not copied.
+ */
+DrawCommand::DrawCommand(const Canvas &oldCanvas, Canvas *canvas,
+                         const QRect &dirty, QUndoCommand *parent)
+    : QUndoCommand(parent), delta(new TileDelta)
+{
+    this->canvas = canvas;
+    resized = oldCanvas.size() != canvas->size();
+    delta->setSizes(oldCanvas.size(), canvas->size());
+
+    if(resized)
+    {
+        // keep every tile of both grids, a position only one grid has
+        // gets a default tile on the other side that is never applied
+        int columns = qMax(oldCanvas.columns(), canvas->columns());
+        int rows = qMax(oldCanvas.rows(), canvas->rows());
+        for(int row = 0; row < rows; ++row)
+        {
+            for(int column = 0; column < columns; ++column)
+            {
+                DeltaTile tile;
+                tile.pos = QPoint(column * TILE_SIZE, row * TILE_SIZE);
+                if(column < oldCanvas.columns() && row < oldCanvas.rows())
+                    tile.before = oldCanvas.tileAt(column, row);
+                if(column < canvas->columns() && row < canvas->rows())
+                    tile.after = canvas->tileAt(column, row);
+                delta->append(tile);
+            }
+        }
+        return;
+    }
+
+    QRect area = (dirty.isNull() ? canvas->rect() : dirty) & canvas->rect();
+    if(area.isEmpty())
+        return;
+
+    // compare the tiles the draw touched, keeping only the ones that differ
+    for(int row = area.top() / TILE_SIZE; row <= area.bottom() / TILE_SIZE; ++row)
+    {
+        for(int column = area.left() / TILE_SIZE; column <= area.right() / TILE_SIZE; ++column)
+        {
+            const Tile &before = oldCanvas.tileAt(column, row);
+            const Tile &after = canvas->tileAt(column, row);
+            if(Canvas::sameTile(before, after))
+                continue;
+
+            DeltaTile tile;
+            tile.pos = QPoint(column * TILE_SIZE, row * TILE_SIZE);
+            tile.before = before;
+            tile.after = after;
+            delta->append(tile);
+        }
+    }
+}
+
+/**
+ * @brief DrawCommand::DrawCommand - A command for an edit the canvas kept
+ *                                   track of, see Canvas::beginEdit. Only
+ *                                   the tiles it touched are compared, no
+ *                                   snapshot of the whole canvas is needed.
+ */
+DrawCommand::DrawCommand(const QHash<int, Tile> &before, Canvas *canvas,
+                         QUndoCommand *parent)
+    : QUndoCommand(parent), delta(new TileDelta)
+{
+    this->canvas = canvas;
+    resized = false;
+    delta->setSizes(canvas->size(), canvas->size());
+
+    for(QHash<int, Tile>::const_iterator it = before.constBegin();
+        it != before.constEnd(); ++it)
+    {
+        int column = it.key() % canvas->columns();
+        int row = it.key() / canvas->columns();
+        const Tile &after = canvas->tileAt(column, row);
+        if(Canvas::sameTile(it.value(), after))
+            continue;
+
+        DeltaTile tile;
+        tile.pos = QPoint(column * TILE_SIZE, row * TILE_SIZE);
+        tile.before = it.value();
+        tile.after = after;
+        delta->append(tile);
+    }
+}
+
+/**
+ * @brief DrawCommand::DrawCommand - An empty command for subclasses that
+ *                                   keep the change some other way
+ */
+DrawCommand::DrawCommand(Canvas *canvas, QUndoCommand *parent)
+    : QUndoCommand(parent), delta(new TileDelta)
+{
+    this->canvas = canvas;
+    resized = false;
+    delta->setSizes(canvas->size(), canvas->size());
+}
+
+/**
+ * @brief DrawCommand::undo - Undo a draw command, restoring the old tiles,
+ *                            then those of the child commands
  */
 void DrawCommand::undo()
 {
-    *image = oldImage.copy(QRect());
+    applyTiles(delta->tiles(), false);
+    QUndoCommand::undo();
 }
 
 /**
- * @brief DrawCommand::redo - 'Undo' an undo, restoring the new image
+ * @brief DrawCommand::redo - 'Undo' an undo, restoring the new tiles,
+ *                            then those of the child commands
  */
 void DrawCommand::redo()
 {
-    *image = newImage.copy(QRect());
+    applyTiles(delta->tiles(), true);
+    QUndoCommand::redo();
+}
+
+/**
+ * @brief DrawCommand::byteCost - The pixel data of this command and of
+ *                                its child commands
+ */
+qint64 DrawCommand::byteCost() const
+{
+    qint64 cost = delta->byteCost();
+    for(int i = 0; i < childCount(); ++i)
+        cost += static_cast<const DrawCommand*>(child(i))->byteCost();
+    return cost;
+}
+
+/**
+ * @brief DrawCommand::ownCost - The part of byteCost not shared through
+ *                               the TileStore
+ */
+qint64 DrawCommand::ownCost() const
+{
+    qint64 cost = delta->ownCost();
+    for(int i = 0; i < childCount(); ++i)
+        cost += static_cast<const DrawCommand*>(child(i))->ownCost();
+    return cost;
+}
+
+/**
+ * @brief DrawCommand::allDeltas - Every delta the command holds, e.g. one
+ *                                 per layer of a resize
+ */
+QList<QSharedPointer<TileDelta> > DrawCommand::allDeltas() const
+{
+    QList<QSharedPointer<TileDelta> > deltas;
+    deltas.append(delta);
+    for(int i = 0; i < childCount(); ++i)
+        deltas += static_cast<const DrawCommand*>(child(i))->allDeltas();
+    return deltas;
+}
+
+/**
+ * @brief DrawCommand::applyTiles - Put the before/after state of every
+ *                                  changed tile back into the canvas
+ */
+void DrawCommand::applyTiles(const QVector<DeltaTile> &tiles, bool after)
+{
+    if(resized)
+    {
+        // a new grid, but the same swap
+        QSharedPointer<TileSwap> swap = canvas->swap();
+        qint64 budget = canvas->swapBudget();
+        *canvas = Canvas(after ? delta->sizeAfter() : delta->sizeBefore());
+        canvas->setSwap(swap, budget);
+    }
+
+    foreach(const DeltaTile &tile, tiles)
+    {
+        int column = tile.pos.x() / TILE_SIZE;
+        int row = tile.pos.y() / TILE_SIZE;
+        if(column < canvas->columns() && row < canvas->rows())
+            canvas->setTile(column, row, after ? tile.after : tile.before);
+    }
+}
+
+/**
+ * @brief ReplayCommand::ReplayCommand - A command for a line or shape that
+ *                                       was just drawn, keeping only the
+ *                                       operation. A new keyframe is made
+ *                                       whenever previous doesn't continue.
+ */
+ReplayCommand::ReplayCommand(const ToolOp &op, const QRect &dirty,
+                             const Canvas &before, DrawCommand *previous,
+                             Canvas *canvas, QUndoCommand *parent)
+    : DrawCommand(canvas, parent)
+{
+    if(continues(previous, canvas))
+    {
+        keyframe = static_cast<ReplayCommand*>(previous)->keyframe;
+    }
+    else
+    {
+        keyframe = QSharedPointer<Keyframe>(new Keyframe);
+        keyframe->canvas = before;
+        keyframe->users = 0;
+        keyframe->bytes = 0;
+        keyframe->pass = -1;
+    }
+
+    index = keyframe->ops.size();
+    keyframe->ops.append(op);
+    keyframe->users++;
+    area = dirty & canvas->rect();
+    share = 0;
+}
+
+ReplayCommand::~ReplayCommand()
+{
+    keyframe->users--;
+}
+
+/**
+ * @brief ReplayCommand::continues - The keyframe of previous can take one
+ *                                   more operation if previous is the last
+ *                                   one drawn on it, an undo and another
+ *                                   draw start a new keyframe, and so does
+ *                                   a draw on another layer
+ */
+bool ReplayCommand::continues(const DrawCommand *previous, const Canvas *canvas)
+{
+    const ReplayCommand *replay = dynamic_cast<const ReplayCommand*>(previous);
+    return replay && replay->canvas == canvas
+           && replay->index == replay->keyframe->ops.size() - 1
+           && replay->keyframe->ops.size() < UNDO_KEYFRAME_INTERVAL;
+}
+
+/**
+ * @brief ReplayCommand::undo - Replay the operations before this one on a
+ *                              copy of the keyframe, then put the tiles
+ *                              this one painted back from it
+ */
+void ReplayCommand::undo()
+{
+    if(area.isEmpty())
+        return;
+
+    Canvas state = keyframe->canvas;
+    for(int i = 0; i < index; ++i)
+        keyframe->ops.at(i).drawTo(&state);
+
+    for(int row = area.top() / TILE_SIZE; row <= area.bottom() / TILE_SIZE; ++row)
+    {
+        for(int column = area.left() / TILE_SIZE; column <= area.right() / TILE_SIZE; ++column)
+            canvas->setTile(column, row, state.tileAt(column, row));
+    }
+}
+
+/**
+ * @brief ReplayCommand::redo - Draw the operation again
+ */
+void ReplayCommand::redo()
+{
+    keyframe->ops.at(index).drawTo(canvas);
+}
+
+/**
+ * @brief ReplayCommand::byteCost - The operation, and a share of the
+ *                                  keyframe's pixels the canvas no longer
+ *                                  shares as of the last updateCost
+ */
+qint64 ReplayCommand::byteCost() const
+{
+    return qint64(sizeof(ToolOp)) + share;
+}
+
+/**
+ * @brief ReplayCommand::updateCost - Measure the keyframe if no command
+ *                                    sharing it did so this pass yet, it
+ *                                    walks every tile of the canvas
+ */
+void ReplayCommand::updateCost(int pass)
+{
+    if(keyframe->pass != pass)
+    {
+        keyframe->bytes = keyframe->canvas.unsharedUsage();
+        keyframe->pass = pass;
+    }
+    share = keyframe->bytes / keyframe->users;
+}
+
+/**
+ * @brief LayerCommand::LayerCommand - A command for a change of the layers
+ *                                     that was just made. The layers only
+ *                                     it holds on to are its bytes, their
+ *                                     tiles are counted once, here.
+ */
+LayerCommand::LayerCommand(const LayerStack::State &before, LayerStack *stack,
+                           QUndoCommand *parent)
+    : DrawCommand(&stack->current()->canvas, parent)
+{
+    this->stack = stack;
+    this->before = before;
+    after = stack->state();
+
+    cost = 0;
+    foreach(const QSharedPointer<Layer> &layer, before.layers)
+    {
+        if(!after.layers.contains(layer))
+            cost += layer->canvas.memoryUsage();
+    }
+    foreach(const QSharedPointer<Layer> &layer, after.layers)
+    {
+        if(!before.layers.contains(layer))
+            cost += layer->canvas.memoryUsage();
+    }
+}
+
+/**
+ * @brief LayerCommand::undo - Put back the layers it took off and take
+ *                            off the ones it added
+ */
+void LayerCommand::undo()
+{
+    stack->restore(after, before);
+}
+
+/**
+ * @brief LayerCommand::redo - Add and take off the layers again
+ */
+void LayerCommand::redo()
+{
+    stack->restore(before, after);
+}
+
+/**
+ * @brief UndoHistory::UndoHistory - An undo/redo history of DrawCommands
+ *                                   that can be bounded by memory use
+ */
+UndoHistory::UndoHistory(QObject *parent)
+    : QObject(parent)
+{
+    serial = 0;
+    root = new HistoryNode{nullptr, nullptr, QList<HistoryNode*>(), nullptr, serial++,
+                           nullptr, nullptr};
+    current = root;
+    newest = root;
+    limit = 0;
+    budget = 0;
+    usage = 0;
+    own = 0;
+    logical = 0;
+    spill = false;
+    diskLimit = 0;
+    costPass = 0;
+    store = QSharedPointer<TileStore>(new TileStore);
+
+    // one thread is plenty to keep up with the user
+    packer = new QThreadPool(this);
+    packer->setMaxThreadCount(1);
+}
+
+UndoHistory::~UndoHistory()
+{
+    packer->clear();
+    packer->waitForDone();
+    deleteTree(root);
+}
+
+/**
+ * @brief UndoHistory::push - Add an already applied command as a child of
+ *                            the current state. Whatever could have been
+ *                            redone stays, as another branch.
+ */
+void UndoHistory::push(DrawCommand *command)
+{
+    HistoryNode *node = new HistoryNode{command, current, QList<HistoryNode*>(),
+                                        nullptr, serial++, newest, nullptr};
+    newest->newer = node;
+    newest = node;
+    current->children.append(node);
+    current->redoChild = node;
+    current = node;
+    nodes.append(node);
+
+    command->updateCost(++costPass);
+    own += command->ownCost();
+    logical += command->byteCost();
+    usage = own + store->storedBytes();
+
+    trim();
+    packColdCommands();
+    emit memoryUsageChanged(usage);
+}
+
+/**
+ * @brief UndoHistory::undo - Go back to the parent state
+ */
+void UndoHistory::undo()
+{
+    if(!canUndo())
+        return;
+
+    current->command->undo();
+    current->parent->redoChild = current;
+    current = current->parent;
+    packColdCommands();
+    updateUsage();
+}
+
+/**
+ * @brief UndoHistory::redo - Go forward along the branch last undone
+ */
+void UndoHistory::redo()
+{
+    if(!canRedo())
+        return;
+
+    current = current->redoChild;
+    current->command->redo();
+    packColdCommands();
+    updateUsage();
+}
+
+/**
+ * @brief UndoHistory::stepOlder - Go to the state made before this one
+ */
+void UndoHistory::stepOlder()
+{
+    HistoryNode *node = neighbour(-1);
+    if(!node)
+        return;
+
+    jumpTo(node);
+    packColdCommands();
+    updateUsage();
+}
+
+/**
+ * @brief UndoHistory::stepNewer - Go to the state made after this one
+ */
+void UndoHistory::stepNewer()
+{
+    HistoryNode *node = neighbour(+1);
+    if(!node)
+        return;
+
+    jumpTo(node);
+    packColdCommands();
+    updateUsage();
+}
+
+/**
+ * @brief UndoHistory::branchCount - Tips of the tree, 1 for a plain
+ *                                   linear history
+ */
+int UndoHistory::branchCount() const
+{
+    int tips = root->children.isEmpty() ? 1 : 0;
+    foreach(HistoryNode *node, nodes)
+    {
+        if(node->children.isEmpty())
+            tips++;
+    }
+    return tips;
+}
+
+/**
+ * @brief UndoHistory::clear - Forget all commands
+ */
+void UndoHistory::clear()
+{
+    packer->clear();
+    deleteTree(root);
+    nodes.clear();
+    root = new HistoryNode{nullptr, nullptr, QList<HistoryNode*>(), nullptr, serial++,
+                           nullptr, nullptr};
+    current = root;
+    newest = root;
+    own = 0;
+    logical = 0;
+    usage = store->storedBytes();
+
+    // the old journal goes away with the last delta referencing it
+    if(spill)
+        journal.reset(new UndoJournal);
+    emit memoryUsageChanged(usage);
+}
+
+/**
+ * @brief UndoHistory::setUndoLimit - Max number of commands kept in count
+ *                                    mode, 0 means unlimited
+ */
+void UndoHistory::setUndoLimit(int limit)
+{
+    this->limit = qMax(0, limit);
+    trim();
+    emit memoryUsageChanged(usage);
+}
+
+/**
+ * @brief UndoHistory::setByteBudget - Max bytes the commands may hold,
+ *                                     0 goes back to count mode
+ */
+void UndoHistory::setByteBudget(qint64 bytes)
+{
+    budget = qMax(qint64(0), bytes);
+    trim();
+    emit memoryUsageChanged(usage);
+}
+
+/**
+ * @brief UndoHistory::setSpillEnabled - Turn spilling cold commands to a
+ *                                       journal on disk on or off
+ */
+void UndoHistory::setSpillEnabled(bool enabled)
+{
+    spill = enabled;
+    if(spill && !journal)
+        journal.reset(new UndoJournal);
+
+    trim();
+    packColdCommands();
+    emit memoryUsageChanged(usage);
+}
+
+/**
+ * @brief UndoHistory::dedupRatio - How much the store saves, 1 when no
+ *                                  tile is shared
+ */
+qreal UndoHistory::dedupRatio() const
+{
+    return usage > 0 ? qreal(logical) / usage : 1;
+}
+
+/**
+ * @brief UndoHistory::setDiskBudget - Max bytes spilled commands may keep
+ *                                     on disk, 0 means unbounded
+ */
+void UndoHistory::setDiskBudget(qint64 bytes)
+{
+    diskLimit = qMax(qint64(0), bytes);
+    trim();
+    emit memoryUsageChanged(usage);
+}
+
+/**
+ * @brief UndoHistory::diskUsage - The size of the journal files, released
+ *                                 records included
+ */
+qint64 UndoHistory::diskUsage() const
+{
+    QSharedPointer<UndoJournal> old = retired.toStrongRef();
+    return (journal ? journal->size() : 0) + (old ? old->size() : 0);
+}
+
+/**
+ * @brief UndoHistory::spilledBytes - The records still in use, in the
+ *                                    journal and in one being compacted
+ */
+qint64 UndoHistory::spilledBytes() const
+{
+    QSharedPointer<UndoJournal> old = retired.toStrongRef();
+    return (journal ? journal->liveSize() : 0) + (old ? old->liveSize() : 0);
+}
+
+/**
+ * @brief UndoHistory::updateUsage - Recount the bytes held by all commands
+ */
+void UndoHistory::updateUsage()
+{
+    qint64 ownBytes = 0;
+    qint64 logicalBytes = 0;
+    ++costPass;
+    foreach(HistoryNode *node, nodes)
+    {
+        node->command->updateCost(costPass);
+        ownBytes += node->command->ownCost();
+        logicalBytes += node->command->byteCost();
+    }
+
+    // shared tiles count once, in the store
+    qint64 bytes = ownBytes + store->storedBytes();
+    if(bytes == usage && logicalBytes == logical)
+        return;
+
+    own = ownBytes;
+    logical = logicalBytes;
+    usage = bytes;
+    trim();
+    emit memoryUsageChanged(usage);
+}
+
+/**
+ * @brief UndoHistory::jumpTo - Make node the current state. The tiles of
+ *                              every command on the way are folded into
+ *                              one final state per tile first, so each
+ *                              tile is set once however far apart the
+ *                              two states are.
+ */
+void UndoHistory::jumpTo(HistoryNode *target)
+{
+    // the way up from here to the common ancestor, and down to target
+    QSet<HistoryNode*> ancestors;
+    for(HistoryNode *node = current; node; node = node->parent)
+        ancestors.insert(node);
+
+    QList<HistoryNode*> down;
+    HistoryNode *common = target;
+    while(!ancestors.contains(common))
+    {
+        down.prepend(common);
+        common = common->parent;
+    }
+
+    QList<HistoryNode*> up;
+    for(HistoryNode *node = current; node != common; node = node->parent)
+        up.append(node);
+
+    bool stepwise = false;
+    foreach(HistoryNode *node, up + down)
+        stepwise = stepwise || !node->command->isFoldable();
+
+    if(stepwise)
+    {
+        // a different grid, a replayed operation or several layers
+        // resized at once on the way, tiles can't be folded across it
+        foreach(HistoryNode *node, up)
+            node->command->undo();
+        foreach(HistoryNode *node, down)
+            node->command->redo();
+    }
+    else if(!up.isEmpty() || !down.isEmpty())
+    {
+        // going up the state closest to the ancestor wins, going down
+        // the one closest to target. Each layer's tiles fold on their own.
+        QHash<Canvas*, QHash<quint64, DeltaTile> > states;
+        QHash<Canvas*, DrawCommand*> commands;
+        foreach(HistoryNode *node, up)
+        {
+            QHash<quint64, DeltaTile> &state = states[node->command->getCanvas()];
+            commands.insert(node->command->getCanvas(), node->command);
+            foreach(const DeltaTile &tile, node->command->getDelta()->tiles())
+            {
+                DeltaTile &last = state[quint64(quint32(tile.pos.x())) << 32 | quint32(tile.pos.y())];
+                last.pos = tile.pos;
+                last.after = tile.before;
+            }
+        }
+        foreach(HistoryNode *node, down)
+        {
+            QHash<quint64, DeltaTile> &state = states[node->command->getCanvas()];
+            commands.insert(node->command->getCanvas(), node->command);
+            foreach(const DeltaTile &tile, node->command->getDelta()->tiles())
+            {
+                DeltaTile &last = state[quint64(quint32(tile.pos.x())) << 32 | quint32(tile.pos.y())];
+                last.pos = tile.pos;
+                last.after = tile.after;
+            }
+        }
+
+        foreach(DrawCommand *command, commands)
+            command->restore(states.value(command->getCanvas()).values().toVector());
+    }
+
+    // redo follows the way just taken, like after plain undos/redos
+    foreach(HistoryNode *node, up + down)
+        node->parent->redoChild = node;
+    current = target;
+}
+
+/**
+ * @brief UndoHistory::neighbour - The state made right before (-1) or
+ *                                 after (+1) the current one
+ */
+HistoryNode* UndoHistory::neighbour(int direction) const
+{
+    return direction < 0 ? current->older : current->newer;
+}
+
+/**
+ * @brief UndoHistory::unlink - Close the gap a node leaves in the list of
+ *                              states by age
+ */
+void UndoHistory::unlink(HistoryNode *node)
+{
+    if(node->older)
+        node->older->newer = node->newer;
+    if(node->newer)
+        node->newer->older = node->older;
+    else
+        newest = node->older;
+    node->older = nullptr;
+    node->newer = nullptr;
+}
+
+/**
+ * @brief UndoHistory::evictOne - Drop the oldest of: a branch tip off the
+ *                                way from the root to the current state,
+ *                                or the root itself once it has just the
+ *                                one child. The current state stays.
+ */
+bool UndoHistory::evictOne()
+{
+    QSet<HistoryNode*> path;
+    for(HistoryNode *node = current; node; node = node->parent)
+        path.insert(node);
+
+    HistoryNode *leaf = nullptr;
+    foreach(HistoryNode *node, nodes)
+    {
+        if(node->children.isEmpty() && !path.contains(node))
+        {
+            leaf = node;
+            break;
+        }
+    }
+
+    bool canCollapse = current != root && root->children.size() == 1
+                                       && root->children.first() != current;
+    if(canCollapse && (!leaf || root->children.first()->serial < leaf->serial))
+    {
+        collapseRoot();
+        return true;
+    }
+    if(leaf)
+    {
+        removeLeaf(leaf);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief UndoHistory::removeLeaf - Delete a branch tip and its command
+ */
+void UndoHistory::removeLeaf(HistoryNode *leaf)
+{
+    HistoryNode *parent = leaf->parent;
+    parent->children.removeOne(leaf);
+    if(parent->redoChild == leaf)
+        parent->redoChild = parent->children.isEmpty() ? nullptr : parent->children.last();
+
+    nodes.removeOne(leaf);
+    unlink(leaf);
+    forget(leaf->command);
+    delete leaf;
+}
+
+/**
+ * @brief UndoHistory::collapseRoot - Make the root's only child the
+ *                                    oldest state, its command can't be
+ *                                    undone anymore
+ */
+void UndoHistory::collapseRoot()
+{
+    HistoryNode *child = root->children.first();
+    unlink(root);
+    delete root;
+
+    nodes.removeOne(child);
+    forget(child->command);
+    child->command = nullptr;
+    child->parent = nullptr;
+    root = child;
+}
+
+/**
+ * @brief UndoHistory::forget - Delete a command and its bytes
+ */
+void UndoHistory::forget(DrawCommand *command)
+{
+    own -= command->ownCost();
+    logical -= command->byteCost();
+    delete command;
+
+    // its tiles leave the store unless another command shares them
+    usage = own + store->storedBytes();
+}
+
+/**
+ * @brief UndoHistory::deleteTree - Delete a node with everything below it
+ */
+void UndoHistory::deleteTree(HistoryNode *node)
+{
+    foreach(HistoryNode *child, node->children)
+        deleteTree(child);
+    delete node->command;
+    delete node;
+}
+
+/**
+ * @brief UndoHistory::trim - Evict until the history fits its limit. The
+ *                            current state's command is always kept so
+ *                            the last action can be undone.
+ */
+void UndoHistory::trim()
+{
+    if(budget > 0)
+    {
+        while(usage > budget && nodes.size() > 1 && evictOne())
+            ;
+    }
+    else if(limit > 0 && !spill)
+    {
+        while(nodes.size() > limit && evictOne())
+            ;
+    }
+
+    // spilled commands take no RAM, they are bounded on disk instead
+    if(spill && diskLimit > 0)
+    {
+        while(spilledBytes() > diskLimit && nodes.size() > 1 && evictOne())
+            ;
+    }
+
+    // however little a command holds, every push and undo walks them all
+    while(nodes.size() > UNDO_MAX_COMMANDS && evictOne())
+        ;
+
+    compactJournal();
+}
+
+/**
+ * @brief UndoHistory::compactJournal - Once released records take more of
+ *                                      the journal than the live ones, and
+ *                                      more than UNDO_JOURNAL_SLACK, the
+ *                                      live ones are copied to a new journal
+ *                                      on the packer thread. New spills go
+ *                                      there right away, the old file goes
+ *                                      with its last record.
+ */
+void UndoHistory::compactJournal()
+{
+    if(!journal || !retired.isNull())
+        return;
+
+    qint64 dead = journal->size() - journal->liveSize();
+    if(dead <= journal->liveSize() || dead <= qint64(UNDO_JOURNAL_SLACK) * 1024 * 1024)
+        return;
+
+    QList<QSharedPointer<TileDelta> > deltas;
+    foreach(HistoryNode *node, nodes)
+        deltas += node->command->allDeltas();
+
+    retired = journal;
+    journal.reset(new UndoJournal);
+    packer->start(new CompactJob(deltas, journal));
+}
+
+/**
+ * @brief UndoHistory::packColdCommands - Hand every command that is more
+ *                                        than UNDO_HOT_COMMANDS undo/redo
+ *                                        steps away from the current state
+ *                                        to the background thread. Past
+ *                                        UNDO_RESIDENT_COMMANDS steps they
+ *                                        are spilled to disk if enabled.
+ */
+void UndoHistory::packColdCommands()
+{
+    // steps from the current state to every other one
+    QHash<HistoryNode*, int> steps;
+    QList<HistoryNode*> queue;
+    steps.insert(current, 0);
+    queue.append(current);
+    while(!queue.isEmpty())
+    {
+        HistoryNode *node = queue.takeFirst();
+        QList<HistoryNode*> next = node->children;
+        if(node->parent)
+            next.append(node->parent);
+        foreach(HistoryNode *other, next)
+        {
+            if(steps.contains(other))
+                continue;
+            steps.insert(other, steps.value(node) + 1);
+            queue.append(other);
+        }
+    }
+
+    foreach(HistoryNode *node, nodes)
+    {
+        // a command is used going to its node or coming from it
+        int distance = qMin(steps.value(node), steps.value(node->parent));
+        if(distance < UNDO_HOT_COMMANDS)
+            continue;
+
+        // a resize holds one delta per layer, each is packed on its own
+        bool toDisk = spill && distance >= UNDO_RESIDENT_COMMANDS;
+        foreach(const QSharedPointer<TileDelta> &delta, node->command->allDeltas())
+        {
+            TileDelta::State state = delta->state();
+            if(state == TileDelta::Spilled || (state == TileDelta::Packed && !toDisk))
+                continue;
+            if(delta->isEmpty() || !delta->queued.testAndSetOrdered(0, 1))
+                continue;
+
+            packer->start(new PackJob(delta, this, store,
+                                      toDisk ? journal : QSharedPointer<UndoJournal>()));
+        }
+    }
 }
@@ -1,21 +1,473 @@
 #ifndef COMMANDS_H
 #define COMMANDS_H
 
-#include <QPixmap>
+#include <QObject>
+#include <QImage>
+#include <QVector>
+#include <QList>
+#include <QMutex>
+#include <QMultiHash>
+#include <QAtomicInt>
+#include <QTemporaryFile>
+#include <QSharedPointer>
+#include <QEnableSharedFromThis>
 #include <QUndoCommand>
 
+#include "canvas.h"
+#include "tool.h"
+#include "layers.h"
+
+
+class QThreadPool;
+
+/** one tile of the canvas before and after a draw */
+struct DeltaTile
+{
+    QPoint pos;
+    Tile before;
+    Tile after;
+};
+
+/**
+ * An append-only temp file that cold undo data is spilled to. Records are
+ * never rewritten, they are read back by mapping them into memory. Once
+ * no record is in use the file is emptied, before that the space of
+ * released records is only won back by moving the live ones to a new
+ * journal, see UndoHistory::compactJournal.
+ */
+class UndoJournal
+{
+public:
+    UndoJournal();
+
+    /** returns the offset of the record, or -1 if writing failed */
+    qint64 append(const QByteArray&);
+    QByteArray read(qint64 offset, qint64 length);
+
+    /** a record of length bytes is no longer needed */
+    void release(qint64 length);
+
+    /** bytes of the file, and of the records still in use */
+    qint64 size() const;
+    qint64 liveSize() const;
+
+private:
+    mutable QMutex mutex;
+    QTemporaryFile file;
+    qint64 end;
+    qint64 live;
+
+    /** Don't allow copying */
+    UndoJournal(const UndoJournal&);
+    UndoJournal& operator=(const UndoJournal&);
+};
+
+class TileStore;
+
+/** one tile's pixels in a TileStore, compressed */
+class StoredTile
+{
+public:
+    StoredTile(const QSharedPointer<TileStore> &store, quint64 hash,
+               const QSize &size, const QByteArray &bytes);
+    ~StoredTile();
+
+    QImage image() const;
+    quint64 hash() const { return key; }
+    QSize size() const { return tileSize; }
+    QByteArray bytes() const { return compressed; }
+
+private:
+    QSharedPointer<TileStore> store;
+    quint64 key;
+    QSize tileSize;
+    QByteArray compressed;
+
+    /** Don't allow copying */
+    StoredTile(const StoredTile&);
+    StoredTile& operator=(const StoredTile&);
+};
+
+/**
+ * A content addressed pool of tile pixels shared by all packed undo
+ * deltas. Tiles are keyed by a hash of their pixels, identical tiles are
+ * kept once however many deltas refer to them, and go away with the
+ * last one. Used from the GUI and the packer thread.
+ */
+class TileStore : public QEnableSharedFromThis<TileStore>
+{
+public:
+    TileStore() : bytes(0) {}
+
+    /** the stored tile with these pixels, added if there is none yet */
+    QSharedPointer<StoredTile> intern(const QImage&);
+    QSharedPointer<StoredTile> intern(quint64 hash, const QSize&,
+                                      const QByteArray &compressed);
+
+    /** compressed bytes of the distinct tiles */
+    qint64 storedBytes() const;
+
+private:
+    friend class StoredTile;
+    void forget(StoredTile*);
+
+    mutable QMutex mutex;
+    QMultiHash<quint64, QWeakPointer<StoredTile> > tiles;
+    qint64 bytes;
+
+    /** Don't allow copying */
+    TileStore(const TileStore&);
+    TileStore& operator=(const TileStore&);
+};
+
+/**
+ * The changed tiles of a DrawCommand. Cold deltas are packed into a
+ * table referring to tiles in a TileStore, and the coldest spilled to
+ * an UndoJournal, by a
+ * background thread. They are brought back when undo/redo reaches them,
+ * so every access goes through the mutex.
+ */
+class TileDelta
+{
+public:
+    enum State {Raw, Packed, Spilled};
+
+    TileDelta() : queued(0), cost(0), own(0), onDisk(false), offset(0), length(0) {}
+    /** releases its record in the journal */
+    ~TileDelta();
+
+    void append(const DeltaTile&);
+
+    /** canvas size before/after, they only differ for a resize */
+    void setSizes(const QSize &before, const QSize &after)
+        { beforeSize = before; afterSize = after; }
+    QSize sizeBefore() const { return beforeSize; }
+    QSize sizeAfter() const { return afterSize; }
+    QVector<DeltaTile> tiles();
+    bool isEmpty() const;
+
+    /** compress the tiles into the store / move them to disk, safe
+     *  from any thread */
+    void pack(const QSharedPointer<TileStore>&);
+    void spill(const QSharedPointer<UndoJournal>&, const QSharedPointer<TileStore>&);
+    State state() const;
+
+    /** copy the record to another journal, releasing the old one */
+    void moveRecord(const QSharedPointer<UndoJournal>&);
+
+    /** bytes of the delta as if none of its tiles were shared */
+    qint64 byteCost() const;
+    /** bytes held by the delta itself, not counting the store */
+    qint64 ownCost() const;
+
+    /** a background job is pending for this delta */
+    QAtomicInt queued;
+
+private:
+    void unpack(const QByteArray &table, const QVector<QImage> &images);
+
+    mutable QMutex mutex;
+    QVector<DeltaTile> raw;
+
+    /** packed: positions and colors, pixels are refs[i] */
+    QByteArray packed;
+    QVector<QSharedPointer<StoredTile> > refs;
+    qint64 cost;
+    qint64 own;
+    QSize beforeSize;
+    QSize afterSize;
+
+    /** where the packed tiles were written, they never change once
+     *  written so the record stays valid after reading it back */
+    QSharedPointer<UndoJournal> journal;
+    bool onDisk;
+    qint64 offset;
+    qint64 length;
+};
 
 class DrawCommand : public QUndoCommand
 {
 public:
-    DrawCommand(const QPixmap &oldImage, QPixmap *image, QUndoCommand *parent = 0);
+    DrawCommand(const Canvas &oldCanvas, Canvas *canvas,
+                const QRect &dirty = QRect(), QUndoCommand *parent = 0);
+    DrawCommand(const QHash<int, Tile> &before, Canvas *canvas,
+                QUndoCommand *parent = 0);
 
     void undo() override;
     void redo() override;
+
+    /** put tiles of the same canvas size into the canvas, e.g. the
+     *  state a jump through the history tree ends up in */
+    void restore(const QVector<DeltaTile> &tiles) { applyTiles(tiles, true); }
+
+    /** false if the delta can't be folded with the ones of other
+     *  commands, they have to be undone/redone one by one instead.
+     *  Child commands, one per other layer, aren't folded either. */
+    virtual bool isFoldable() const { return !resized && childCount() == 0; }
+
+    /** true if the draw did not change a single pixel */
+    virtual bool isEmpty() const { return delta->isEmpty() && childCount() == 0; }
+
+    /** memory held by this command's pixel data, and the part of it
+     *  not shared through the TileStore, child commands included */
+    virtual qint64 byteCost() const;
+    virtual qint64 ownCost() const;
+
+    /** measure again a cost that depends on more than the command, e.g.
+     *  a keyframe it shares. Only the history calls it, right before it
+     *  counts the command, so the cost it adds is the one it takes off
+     *  again. Each recount has its own pass, shared state is measured
+     *  once per pass. */
+    virtual void updateCost(int pass) { Q_UNUSED(pass); }
+
+    QSharedPointer<TileDelta> getDelta() const { return delta; }
+
+    /** its delta and those of its child commands, for packing */
+    QList<QSharedPointer<TileDelta> > allDeltas() const;
+
+    /** the canvas (layer) the command changes */
+    Canvas* getCanvas() const { return canvas; }
+
+protected:
+    /** a command without tiles, the subclass keeps its own state */
+    DrawCommand(Canvas *canvas, QUndoCommand *parent = 0);
+
+    Canvas* canvas;
+
 private:
-    QPixmap* image;
-    QPixmap oldImage;
-    QPixmap newImage;
+    void applyTiles(const QVector<DeltaTile>&, bool after);
+
+    /** only the tiles that changed */
+    QSharedPointer<TileDelta> delta;
+
+    /** after a size change the delta holds every tile of both sizes */
+    bool resized;
+};
+
+/** a snapshot of the whole canvas, and the operations drawn on it since */
+struct Keyframe
+{
+    Canvas canvas;
+    QVector<ToolOp> ops;
+
+    /** commands replaying from it, they split its bytes */
+    int users;
+
+    /** the canvas's unshared bytes, as measured in pass */
+    qint64 bytes;
+    int pass;
+};
+
+/**
+ * A line or shape kept as the operation that drew it instead of as tiles.
+ * Up to UNDO_KEYFRAME_INTERVAL operations in a row share a keyframe taken
+ * before the first of them, undo rebuilds the state before this one by
+ * replaying the earlier ones onto a copy of it.
+ */
+class ReplayCommand : public DrawCommand
+{
+public:
+    /** op was just drawn into dirty. It replays from the keyframe of
+     *  previous if that one continues, else before is the new keyframe. */
+    ReplayCommand(const ToolOp &op, const QRect &dirty, const Canvas &before,
+                  DrawCommand *previous, Canvas *canvas,
+                  QUndoCommand *parent = 0);
+    ~ReplayCommand();
+
+    /** true if an operation drawn on canvas right after previous can go
+     *  on its keyframe, no snapshot is needed then */
+    static bool continues(const DrawCommand *previous, const Canvas *canvas);
+
+    void undo() override;
+    void redo() override;
+
+    bool isFoldable() const override { return false; }
+    bool isEmpty() const override { return false; }
+    qint64 byteCost() const override;
+    qint64 ownCost() const override { return byteCost(); }
+    void updateCost(int pass) override;
+
+private:
+    QSharedPointer<Keyframe> keyframe;
+
+    /** its part of the keyframe's bytes when last measured */
+    qint64 share;
+
+    /** this command's operation in the keyframe */
+    int index;
+    QRect area;
+};
+
+/**
+ * Layers added, removed or replaced, e.g. by a new image. Both lists of
+ * layers are kept, a layer off the stack stays alive with the command so
+ * undo can put it back, and goes away with the last command holding it.
+ */
+class LayerCommand : public DrawCommand
+{
+public:
+    /** the stack changed from before to how it is now */
+    LayerCommand(const LayerStack::State &before, LayerStack *stack,
+                 QUndoCommand *parent = 0);
+
+    void undo() override;
+    void redo() override;
+
+    bool isFoldable() const override { return false; }
+    bool isEmpty() const override { return false; }
+    qint64 byteCost() const override { return cost; }
+    qint64 ownCost() const override { return cost; }
+
+private:
+    LayerStack *stack;
+    LayerStack::State before;
+    LayerStack::State after;
+
+    /** the pixels of the layers only one side has, counted once */
+    qint64 cost;
+};
+
+/** one state in the history tree, reached from its parent by command */
+struct HistoryNode
+{
+    /** null for the root, the oldest state still kept */
+    DrawCommand* command;
+    HistoryNode* parent;
+    QList<HistoryNode*> children;
+
+    /** the branch redo follows, the one last left by undo */
+    HistoryNode* redoChild;
+
+    /** when it was made */
+    int serial;
+    /** the states made right before and after it, on any branch */
+    HistoryNode* older;
+    HistoryNode* newer;
+};
+
+/**
+ * The undo/redo history, a tree of states. Pushing after an undo starts
+ * a new branch instead of dropping the redo branch. Bounded either by a
+ * number of commands (count mode) or by the bytes the commands hold
+ * (budget mode), old branches and the oldest states go first.
+ */
+class UndoHistory : public QObject
+{
+    Q_OBJECT
+
+public:
+    UndoHistory(QObject *parent = nullptr);
+    ~UndoHistory();
+
+    void push(DrawCommand*);
+    void undo();
+    void redo();
+    void clear();
+
+    bool canUndo() const { return current != root; }
+    bool canRedo() const { return current->redoChild != nullptr; }
+    int count() const { return nodes.size(); }
+
+    /** the command that led to the current state, null at the root */
+    DrawCommand* currentCommand() const { return current->command; }
+
+    /** go to the state made just before/after the current one, on
+     *  whatever branch it is */
+    void stepOlder();
+    void stepNewer();
+    bool canStepOlder() const { return neighbour(-1) != nullptr; }
+    bool canStepNewer() const { return neighbour(+1) != nullptr; }
+
+    /** number of branch tips */
+    int branchCount() const;
+
+    /** count mode, used while no byte budget is set */
+    void setUndoLimit(int limit);
+    int undoLimit() const { return limit; }
+
+    /** budget mode, 0 switches back to count mode */
+    void setByteBudget(qint64 bytes);
+    qint64 byteBudget() const { return budget; }
+
+    qint64 memoryUsage() const { return usage; }
+
+    /** bytes the commands would take without sharing tiles, per byte
+     *  they do take */
+    qreal dedupRatio() const;
+
+    /** spill mode, cold commands go to a journal on disk and the count
+     *  limit no longer applies, the disk budget does instead */
+    void setSpillEnabled(bool enabled);
+    bool spillEnabled() const { return spill; }
+    qint64 diskUsage() const;
+
+    /** bytes of spilled commands kept on disk, 0 = unbounded */
+    void setDiskBudget(qint64 bytes);
+    qint64 diskBudget() const { return diskLimit; }
+
+signals:
+    void memoryUsageChanged(qint64 bytes);
+
+private slots:
+    /** recount the bytes after commands were packed or unpacked */
+    void updateUsage();
+
+private:
+    void jumpTo(HistoryNode*);
+    HistoryNode* neighbour(int direction) const;
+    /** take a node out of the older/newer list */
+    void unlink(HistoryNode*);
+
+    /** eviction, dropping a leaf off the current path or the root */
+    bool evictOne();
+    void removeLeaf(HistoryNode*);
+    void collapseRoot();
+    void forget(DrawCommand*);
+    void deleteTree(HistoryNode*);
+
+    void trim();
+    void packColdCommands();
+
+    /** bytes of the records spilled commands still use */
+    qint64 spilledBytes() const;
+
+    /** move the live records to a new journal once the old one is
+     *  mostly released space */
+    void compactJournal();
+
+    HistoryNode* root;
+    HistoryNode* current;
+    /** the end of the older/newer list */
+    HistoryNode* newest;
+
+    /** every node but the root, oldest first */
+    QList<HistoryNode*> nodes;
+    int serial;
+    int limit;
+    qint64 budget;
+    qint64 usage;
+    qint64 own;
+    qint64 logical;
+
+    /** the packed tiles of all commands */
+    QSharedPointer<TileStore> store;
+
+    /** background thread compressing cold commands */
+    QThreadPool* packer;
+
+    /** counts recounts, see DrawCommand::updateCost */
+    int costPass;
+
+    bool spill;
+    qint64 diskLimit;
+    QSharedPointer<UndoJournal> journal;
+
+    /** the journal being compacted, gone once its last record moved */
+    QWeakPointer<UndoJournal> retired;
+
+    /** Don't allow copying */
+    UndoHistory(const UndoHistory&);
+    UndoHistory& operator=(const UndoHistory&);
 };
 
 #endif // COMMANDS_H
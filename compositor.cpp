@@ -0,0 +1,827 @@
+#include <cstring>
+
+#include "compositor.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define COMPOSITOR_X86
+#include <immintrin.h>
+#endif
+
+
+namespace {
+
+/** x / 255 rounded, exact for every x up to 255 * 255 */
+inline uint div255(uint x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+/**
+ * One channel of a blend. s is the color at coverage a and b the pixel
+ * before, both premultiplied, sa and ba their alphas. Every mode but add
+ * keeps its alpha as sa + ba - sa * ba, the same formula does for all
+ * four channels except for difference, which has to know the alpha one.
+ * Results above 255 are clamped by the caller.
+ */
+template<BlendMode mode>
+inline uint blendChannel(uint s, uint b, uint sa, uint ba, uint a, bool alpha)
+{
+    switch(mode)
+    {
+        case multiply_blend: return div255(s * (255 - ba) + b * (255 - sa) + s * b);
+        case screen_blend:   return s + b - div255(s * b);
+        case darken_blend:   return s + b - div255(qMax(s * ba, b * sa));
+        case lighten_blend:  return s + b - div255(qMin(s * ba, b * sa));
+        case erase_blend:    return div255(b * (255 - a));
+        case overlay_blend:
+        {
+            uint t = 2 * b <= ba ? 2 * s * b : sa * ba - 2 * (ba - b) * (sa - s);
+            return div255(s * (255 - ba) + b * (255 - sa) + t);
+        }
+        case add_blend:      return s + b;
+        case difference_blend:
+            return alpha ? s + b - div255(s * b)
+                         : div255(255 * (s + b) - 2 * qMin(s * ba, b * sa));
+        default:             return s + div255(b * (255 - sa));
+    }
+}
+
+template<BlendMode mode>
+void dabRowScalar(uint *dst, const uint *before, uint beforeColor,
+                  quint8 *coverage, const quint8 *mask, int count,
+                  uint color, uint alpha)
+{
+    for(int i = 0; i < count; ++i)
+    {
+        uint c = qMax(coverage[i], mask[i]);
+        coverage[i] = quint8(c);
+        uint a = div255(c * alpha);
+
+        uint b = before ? before[i] : beforeColor;
+        uint s = 0;
+        for(int shift = 0; shift < 32; shift += 8)
+            s |= div255(((color >> shift) & 0xff) * a) << shift;
+
+        uint pixel = 0;
+        for(int shift = 0; shift < 32; shift += 8)
+        {
+            uint value = blendChannel<mode>((s >> shift) & 0xff, (b >> shift) & 0xff,
+                                            s >> 24, b >> 24, a, shift == 24);
+            pixel |= qMin(value, 255u) << shift;
+        }
+        dst[i] = pixel;
+    }
+}
+
+template<BlendMode mode>
+void layerRowScalar(uint *dst, const uint *src, int count, uint opacity)
+{
+    for(int i = 0; i < count; ++i)
+    {
+        uint s = src[i];
+        if(opacity < 255)
+        {
+            uint faded = 0;
+            for(int shift = 0; shift < 32; shift += 8)
+                faded |= div255(((s >> shift) & 0xff) * opacity) << shift;
+            s = faded;
+        }
+
+        uint b = dst[i];
+        uint pixel = 0;
+        for(int shift = 0; shift < 32; shift += 8)
+        {
+            uint value = blendChannel<mode>((s >> shift) & 0xff, (b >> shift) & 0xff,
+                                            s >> 24, b >> 24, s >> 24, shift == 24);
+            pixel |= qMin(value, 255u) << shift;
+        }
+        dst[i] = pixel;
+    }
+}
+
+int matchRunScalar(const uint *pixels, int count, uint color, uint tolerance,
+                   bool matching)
+{
+    int i = 0;
+    while(i < count && Compositor::matches(pixels[i], color, tolerance) == matching)
+        ++i;
+    return i;
+}
+
+int matchRunBackScalar(const uint *end, int count, uint color, uint tolerance)
+{
+    int i = 0;
+    while(i < count && Compositor::matches(end[-1 - i], color, tolerance))
+        ++i;
+    return i;
+}
+
+void blurRowScalar(quint16 *dst, const quint8 *src, int count,
+                   const quint16 *weights, int radius)
+{
+    for(int i = 0; i < count; ++i)
+    {
+        const quint8 *taps = src + i;
+        quint32 sum = quint32(weights[radius]) * taps[radius * 4];
+        for(int k = 0; k < radius; ++k)
+            sum += quint32(weights[k]) * quint32(taps[k * 4] + taps[(2 * radius - k) * 4]);
+        dst[i] = quint16((sum + 128) >> 8);
+    }
+}
+
+void blurColumnScalar(quint8 *dst, const quint16 *src, int stride, int count,
+                      const quint16 *weights, int radius)
+{
+    for(int i = 0; i < count; ++i)
+    {
+        const quint16 *taps = src + i;
+        quint32 sum = quint32(weights[radius]) * taps[radius * stride];
+        for(int k = 0; k < radius; ++k)
+            sum += quint32(weights[k]) * quint32(taps[k * stride] + taps[(2 * radius - k) * stride]);
+        dst[i] = quint8((sum + (1u << 21)) >> 22);
+    }
+}
+
+#ifdef COMPOSITOR_X86
+
+/*
+ * The vector paths work on two pixels per 128 bits, one channel per 16 bit
+ * lane, which leaves room for the products of two channels. AVX2 does the
+ * same per 128 bit half, every step stays within its half. Sums that only
+ * come back under 65536 once everything is added up wrap around on the
+ * way, that is fine, the final value is right.
+ */
+
+__attribute__((target("sse2")))
+inline __m128i div255Sse2(__m128i x)
+{
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+template<BlendMode mode>
+__attribute__((target("sse2")))
+inline __m128i blendSse2(__m128i s, __m128i b, __m128i a)
+{
+    const __m128i full = _mm_set1_epi16(255);
+    const __m128i sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)),
+                                           _MM_SHUFFLE(3, 3, 3, 3));
+    const __m128i ba = _mm_shufflehi_epi16(_mm_shufflelo_epi16(b, _MM_SHUFFLE(3, 3, 3, 3)),
+                                           _MM_SHUFFLE(3, 3, 3, 3));
+    switch(mode)
+    {
+        case multiply_blend:
+            return div255Sse2(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(s, _mm_sub_epi16(full, ba)),
+                                                          _mm_mullo_epi16(b, _mm_sub_epi16(full, sa))),
+                                            _mm_mullo_epi16(s, b)));
+        case screen_blend:
+            return _mm_sub_epi16(_mm_add_epi16(s, b), div255Sse2(_mm_mullo_epi16(s, b)));
+        case darken_blend:
+        case lighten_blend:
+        {
+            // SSE2 has no unsigned 16 bit max/min, saturated subtraction does
+            __m128i x = _mm_mullo_epi16(s, ba);
+            __m128i y = _mm_mullo_epi16(b, sa);
+            __m128i pick = mode == darken_blend ? _mm_add_epi16(_mm_subs_epu16(x, y), y)
+                                                : _mm_sub_epi16(x, _mm_subs_epu16(x, y));
+            return _mm_sub_epi16(_mm_add_epi16(s, b), div255Sse2(pick));
+        }
+        case erase_blend:
+            return div255Sse2(_mm_mullo_epi16(b, _mm_sub_epi16(full, a)));
+        case overlay_blend:
+        {
+            __m128i low = _mm_slli_epi16(_mm_mullo_epi16(s, b), 1);
+            __m128i high = _mm_sub_epi16(_mm_mullo_epi16(sa, ba),
+                                         _mm_slli_epi16(_mm_mullo_epi16(_mm_sub_epi16(ba, b),
+                                                                        _mm_sub_epi16(sa, s)), 1));
+            __m128i upper = _mm_cmpgt_epi16(_mm_add_epi16(b, b), ba);
+            __m128i t = _mm_or_si128(_mm_and_si128(upper, high), _mm_andnot_si128(upper, low));
+            return div255Sse2(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(s, _mm_sub_epi16(full, ba)),
+                                                          _mm_mullo_epi16(b, _mm_sub_epi16(full, sa))),
+                                            t));
+        }
+        case add_blend:
+            // the pack saturates
+            return _mm_add_epi16(s, b);
+        case difference_blend:
+        {
+            const __m128i alpha = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+            __m128i x = _mm_mullo_epi16(s, ba);
+            __m128i y = _mm_mullo_epi16(b, sa);
+            __m128i least = _mm_sub_epi16(x, _mm_subs_epu16(x, y));
+            __m128i t = _mm_or_si128(_mm_andnot_si128(alpha, _mm_add_epi16(least, least)),
+                                     _mm_and_si128(alpha, _mm_mullo_epi16(s, b)));
+            return div255Sse2(_mm_sub_epi16(_mm_mullo_epi16(_mm_add_epi16(s, b), full), t));
+        }
+        default:
+            return _mm_add_epi16(s, div255Sse2(_mm_mullo_epi16(b, _mm_sub_epi16(full, sa))));
+    }
+}
+
+template<BlendMode mode>
+__attribute__((target("sse2")))
+void dabRowSse2(uint *dst, const uint *before, uint beforeColor,
+                quint8 *coverage, const quint8 *mask, int count,
+                uint color, uint alpha)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alphaLanes = _mm_set1_epi16(short(alpha));
+    const __m128i colorLanes = _mm_unpacklo_epi8(_mm_set1_epi32(int(color)), zero);
+    const __m128i flat = _mm_set1_epi32(int(beforeColor));
+
+    int i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        int covered, masked;
+        memcpy(&covered, coverage + i, 4);
+        memcpy(&masked, mask + i, 4);
+        __m128i c = _mm_max_epu8(_mm_cvtsi32_si128(covered), _mm_cvtsi32_si128(masked));
+        covered = _mm_cvtsi128_si32(c);
+        memcpy(coverage + i, &covered, 4);
+
+        // coverage times alpha, spread over the four channels of each pixel
+        __m128i a = div255Sse2(_mm_mullo_epi16(_mm_unpacklo_epi8(c, zero), alphaLanes));
+        a = _mm_unpacklo_epi16(a, a);
+        const __m128i aLo = _mm_unpacklo_epi32(a, a);
+        const __m128i aHi = _mm_unpackhi_epi32(a, a);
+
+        const __m128i b = before ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(before + i))
+                                 : flat;
+        __m128i lo = blendSse2<mode>(div255Sse2(_mm_mullo_epi16(colorLanes, aLo)),
+                                     _mm_unpacklo_epi8(b, zero), aLo);
+        __m128i hi = blendSse2<mode>(div255Sse2(_mm_mullo_epi16(colorLanes, aHi)),
+                                     _mm_unpackhi_epi8(b, zero), aHi);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(lo, hi));
+    }
+
+    dabRowScalar<mode>(dst + i, before ? before + i : nullptr, beforeColor,
+                       coverage + i, mask + i, count - i, color, alpha);
+}
+
+/** the alpha of both pixels in all of their lanes */
+__attribute__((target("sse2")))
+inline __m128i alphaSse2(__m128i pixels)
+{
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3)),
+                               _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+template<BlendMode mode>
+__attribute__((target("sse2")))
+void layerRowSse2(uint *dst, const uint *src, int count, uint opacity)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i opacityLanes = _mm_set1_epi16(short(opacity));
+    const bool faded = opacity < 255;
+
+    int i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+        __m128i sLo = _mm_unpacklo_epi8(s, zero);
+        __m128i sHi = _mm_unpackhi_epi8(s, zero);
+        if(faded)
+        {
+            sLo = div255Sse2(_mm_mullo_epi16(sLo, opacityLanes));
+            sHi = div255Sse2(_mm_mullo_epi16(sHi, opacityLanes));
+        }
+
+        __m128i lo = blendSse2<mode>(sLo, _mm_unpacklo_epi8(b, zero), alphaSse2(sLo));
+        __m128i hi = blendSse2<mode>(sHi, _mm_unpackhi_epi8(b, zero), alphaSse2(sHi));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(lo, hi));
+    }
+
+    layerRowScalar<mode>(dst + i, src + i, count - i, opacity);
+}
+
+/** lo and hi, four channels each, plus weight times the 8 channels of x.
+ *  The sum of two taps fits 16 bit, the products take 32. */
+__attribute__((target("sse2")))
+inline void multiplyAddSse2(__m128i &lo, __m128i &hi, __m128i x, __m128i weight)
+{
+    const __m128i low = _mm_mullo_epi16(x, weight);
+    const __m128i high = _mm_mulhi_epu16(x, weight);
+    lo = _mm_add_epi32(lo, _mm_unpacklo_epi16(low, high));
+    hi = _mm_add_epi32(hi, _mm_unpackhi_epi16(low, high));
+}
+
+__attribute__((target("sse2")))
+void blurRowSse2(quint16 *dst, const quint8 *src, int count,
+                 const quint16 *weights, int radius)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi32(32768);
+
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        const quint8 *taps = src + i;
+        __m128i lo = _mm_set1_epi32(128);
+        __m128i hi = lo;
+        multiplyAddSse2(lo, hi, _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(taps + radius * 4)), zero),
+                        _mm_set1_epi16(short(weights[radius])));
+        for(int k = 0; k < radius; ++k)
+        {
+            const __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(taps + k * 4)), zero);
+            const __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(taps + (2 * radius - k) * 4)), zero);
+            multiplyAddSse2(lo, hi, _mm_add_epi16(a, b), _mm_set1_epi16(short(weights[k])));
+        }
+
+        // SSE2 only packs signed, so the sums are moved to around 0 and back
+        lo = _mm_sub_epi32(_mm_srli_epi32(lo, 8), bias);
+        hi = _mm_sub_epi32(_mm_srli_epi32(hi, 8), bias);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                         _mm_xor_si128(_mm_packs_epi32(lo, hi), _mm_set1_epi16(short(0x8000))));
+    }
+
+    blurRowScalar(dst + i, src + i, count - i, weights, radius);
+}
+
+__attribute__((target("sse2")))
+void blurColumnSse2(quint8 *dst, const quint16 *src, int stride, int count,
+                    const quint16 *weights, int radius)
+{
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        const quint16 *taps = src + i;
+        __m128i lo = _mm_set1_epi32(1 << 21);
+        __m128i hi = lo;
+        multiplyAddSse2(lo, hi, _mm_loadu_si128(reinterpret_cast<const __m128i*>(taps + radius * stride)),
+                        _mm_set1_epi16(short(weights[radius])));
+        for(int k = 0; k < radius; ++k)
+        {
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(taps + k * stride));
+            const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(taps + (2 * radius - k) * stride));
+            multiplyAddSse2(lo, hi, _mm_add_epi16(a, b), _mm_set1_epi16(short(weights[k])));
+        }
+
+        const __m128i words = _mm_packs_epi32(_mm_srli_epi32(lo, 22), _mm_srli_epi32(hi, 22));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(words, words));
+    }
+
+    blurColumnScalar(dst + i, src + i, stride, count - i, weights, radius);
+}
+
+__attribute__((target("avx2")))
+inline __m256i div255Avx2(__m256i x)
+{
+    x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+template<BlendMode mode>
+__attribute__((target("avx2")))
+inline __m256i blendAvx2(__m256i s, __m256i b, __m256i a)
+{
+    const __m256i full = _mm256_set1_epi16(255);
+    const __m256i sa = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)),
+                                              _MM_SHUFFLE(3, 3, 3, 3));
+    const __m256i ba = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(b, _MM_SHUFFLE(3, 3, 3, 3)),
+                                              _MM_SHUFFLE(3, 3, 3, 3));
+    switch(mode)
+    {
+        case multiply_blend:
+            return div255Avx2(_mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s, _mm256_sub_epi16(full, ba)),
+                                                                _mm256_mullo_epi16(b, _mm256_sub_epi16(full, sa))),
+                                               _mm256_mullo_epi16(s, b)));
+        case screen_blend:
+            return _mm256_sub_epi16(_mm256_add_epi16(s, b), div255Avx2(_mm256_mullo_epi16(s, b)));
+        case darken_blend:
+            return _mm256_sub_epi16(_mm256_add_epi16(s, b),
+                                    div255Avx2(_mm256_max_epu16(_mm256_mullo_epi16(s, ba),
+                                                                _mm256_mullo_epi16(b, sa))));
+        case lighten_blend:
+            return _mm256_sub_epi16(_mm256_add_epi16(s, b),
+                                    div255Avx2(_mm256_min_epu16(_mm256_mullo_epi16(s, ba),
+                                                                _mm256_mullo_epi16(b, sa))));
+        case erase_blend:
+            return div255Avx2(_mm256_mullo_epi16(b, _mm256_sub_epi16(full, a)));
+        case overlay_blend:
+        {
+            __m256i low = _mm256_slli_epi16(_mm256_mullo_epi16(s, b), 1);
+            __m256i high = _mm256_sub_epi16(_mm256_mullo_epi16(sa, ba),
+                                            _mm256_slli_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(ba, b),
+                                                                                 _mm256_sub_epi16(sa, s)), 1));
+            __m256i t = _mm256_blendv_epi8(low, high, _mm256_cmpgt_epi16(_mm256_add_epi16(b, b), ba));
+            return div255Avx2(_mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s, _mm256_sub_epi16(full, ba)),
+                                                                _mm256_mullo_epi16(b, _mm256_sub_epi16(full, sa))),
+                                               t));
+        }
+        case add_blend:
+            // the pack saturates
+            return _mm256_add_epi16(s, b);
+        case difference_blend:
+        {
+            const __m256i alpha = _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0,
+                                                   -1, 0, 0, 0, -1, 0, 0, 0);
+            __m256i least = _mm256_min_epu16(_mm256_mullo_epi16(s, ba), _mm256_mullo_epi16(b, sa));
+            __m256i t = _mm256_blendv_epi8(_mm256_add_epi16(least, least), _mm256_mullo_epi16(s, b), alpha);
+            return div255Avx2(_mm256_sub_epi16(_mm256_mullo_epi16(_mm256_add_epi16(s, b), full), t));
+        }
+        default:
+            return _mm256_add_epi16(s, div255Avx2(_mm256_mullo_epi16(b, _mm256_sub_epi16(full, sa))));
+    }
+}
+
+template<BlendMode mode>
+__attribute__((target("avx2")))
+void dabRowAvx2(uint *dst, const uint *before, uint beforeColor,
+                quint8 *coverage, const quint8 *mask, int count,
+                uint color, uint alpha)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i alphaLanes = _mm256_set1_epi16(short(alpha));
+    const __m256i colorLanes = _mm256_unpacklo_epi8(_mm256_set1_epi32(int(color)), zero);
+    const __m256i flat = _mm256_set1_epi32(int(beforeColor));
+
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        __m128i c = _mm_max_epu8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(coverage + i)),
+                                 _mm_loadl_epi64(reinterpret_cast<const __m128i*>(mask + i)));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(coverage + i), c);
+
+        // pixels 0-3 in the low half and 4-7 in the high one, like the
+        // unpacks of the pixels below sort them
+        __m256i a = div255Avx2(_mm256_mullo_epi16(_mm256_cvtepu8_epi32(c), alphaLanes));
+        a = _mm256_or_si256(a, _mm256_slli_epi32(a, 16));
+        const __m256i aLo = _mm256_unpacklo_epi32(a, a);
+        const __m256i aHi = _mm256_unpackhi_epi32(a, a);
+
+        const __m256i b = before ? _mm256_loadu_si256(reinterpret_cast<const __m256i*>(before + i))
+                                 : flat;
+        __m256i lo = blendAvx2<mode>(div255Avx2(_mm256_mullo_epi16(colorLanes, aLo)),
+                                     _mm256_unpacklo_epi8(b, zero), aLo);
+        __m256i hi = blendAvx2<mode>(div255Avx2(_mm256_mullo_epi16(colorLanes, aHi)),
+                                     _mm256_unpackhi_epi8(b, zero), aHi);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_packus_epi16(lo, hi));
+    }
+
+    dabRowScalar<mode>(dst + i, before ? before + i : nullptr, beforeColor,
+                       coverage + i, mask + i, count - i, color, alpha);
+}
+
+__attribute__((target("avx2")))
+inline __m256i alphaAvx2(__m256i pixels)
+{
+    return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3)),
+                                  _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+template<BlendMode mode>
+__attribute__((target("avx2")))
+void layerRowAvx2(uint *dst, const uint *src, int count, uint opacity)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i opacityLanes = _mm256_set1_epi16(short(opacity));
+    const bool faded = opacity < 255;
+
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        const __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+        __m256i sLo = _mm256_unpacklo_epi8(s, zero);
+        __m256i sHi = _mm256_unpackhi_epi8(s, zero);
+        if(faded)
+        {
+            sLo = div255Avx2(_mm256_mullo_epi16(sLo, opacityLanes));
+            sHi = div255Avx2(_mm256_mullo_epi16(sHi, opacityLanes));
+        }
+
+        // unpack and pack both work per half, the pixels end up in place
+        __m256i lo = blendAvx2<mode>(sLo, _mm256_unpacklo_epi8(b, zero), alphaAvx2(sLo));
+        __m256i hi = blendAvx2<mode>(sHi, _mm256_unpackhi_epi8(b, zero), alphaAvx2(sHi));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_packus_epi16(lo, hi));
+    }
+
+    layerRowScalar<mode>(dst + i, src + i, count - i, opacity);
+}
+
+/*
+ * The match kernels take the per channel difference both ways with
+ * saturation, a pixel matches if no channel is left over after taking
+ * off the tolerance. movemask then has one bit per pixel.
+ */
+
+__attribute__((target("sse2")))
+inline int matchBitsSse2(const uint *pixels, __m128i color, __m128i tolerance)
+{
+    const __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels));
+    const __m128i difference = _mm_or_si128(_mm_subs_epu8(p, color), _mm_subs_epu8(color, p));
+    const __m128i within = _mm_cmpeq_epi32(_mm_subs_epu8(difference, tolerance),
+                                           _mm_setzero_si128());
+    return _mm_movemask_ps(_mm_castsi128_ps(within));
+}
+
+__attribute__((target("sse2")))
+int matchRunSse2(const uint *pixels, int count, uint color, uint tolerance,
+                 bool matching)
+{
+    const __m128i colorLanes = _mm_set1_epi32(int(color));
+    const __m128i toleranceLanes = _mm_set1_epi8(char(tolerance));
+    const int all = matching ? 0xf : 0;
+
+    int i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        int bits = matchBitsSse2(pixels + i, colorLanes, toleranceLanes);
+        if(bits != all)
+            return i + __builtin_ctz(bits ^ all);
+    }
+    return i + matchRunScalar(pixels + i, count - i, color, tolerance, matching);
+}
+
+__attribute__((target("sse2")))
+int matchRunBackSse2(const uint *end, int count, uint color, uint tolerance)
+{
+    const __m128i colorLanes = _mm_set1_epi32(int(color));
+    const __m128i toleranceLanes = _mm_set1_epi8(char(tolerance));
+
+    int i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        int bits = matchBitsSse2(end - i - 4, colorLanes, toleranceLanes);
+        if(bits != 0xf)
+            return i + __builtin_clz(~bits & 0xf) - 28;
+    }
+    return i + matchRunBackScalar(end - i, count - i, color, tolerance);
+}
+
+__attribute__((target("avx2")))
+inline int matchBitsAvx2(const uint *pixels, __m256i color, __m256i tolerance)
+{
+    const __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels));
+    const __m256i difference = _mm256_or_si256(_mm256_subs_epu8(p, color),
+                                               _mm256_subs_epu8(color, p));
+    const __m256i within = _mm256_cmpeq_epi32(_mm256_subs_epu8(difference, tolerance),
+                                              _mm256_setzero_si256());
+    return _mm256_movemask_ps(_mm256_castsi256_ps(within));
+}
+
+__attribute__((target("avx2")))
+int matchRunAvx2(const uint *pixels, int count, uint color, uint tolerance,
+                 bool matching)
+{
+    const __m256i colorLanes = _mm256_set1_epi32(int(color));
+    const __m256i toleranceLanes = _mm256_set1_epi8(char(tolerance));
+    const int all = matching ? 0xff : 0;
+
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        int bits = matchBitsAvx2(pixels + i, colorLanes, toleranceLanes);
+        if(bits != all)
+            return i + __builtin_ctz(bits ^ all);
+    }
+    return i + matchRunScalar(pixels + i, count - i, color, tolerance, matching);
+}
+
+__attribute__((target("avx2")))
+int matchRunBackAvx2(const uint *end, int count, uint color, uint tolerance)
+{
+    const __m256i colorLanes = _mm256_set1_epi32(int(color));
+    const __m256i toleranceLanes = _mm256_set1_epi8(char(tolerance));
+
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        int bits = matchBitsAvx2(end - i - 8, colorLanes, toleranceLanes);
+        if(bits != 0xff)
+            return i + __builtin_clz(~bits & 0xff) - 24;
+    }
+    return i + matchRunBackScalar(end - i, count - i, color, tolerance);
+}
+
+__attribute__((target("avx2")))
+inline void multiplyAddAvx2(__m256i &lo, __m256i &hi, __m256i x, __m256i weight)
+{
+    const __m256i low = _mm256_mullo_epi16(x, weight);
+    const __m256i high = _mm256_mulhi_epu16(x, weight);
+    lo = _mm256_add_epi32(lo, _mm256_unpacklo_epi16(low, high));
+    hi = _mm256_add_epi32(hi, _mm256_unpackhi_epi16(low, high));
+}
+
+__attribute__((target("avx2")))
+void blurRowAvx2(quint16 *dst, const quint8 *src, int count,
+                 const quint16 *weights, int radius)
+{
+    int i = 0;
+    for(; i + 16 <= count; i += 16)
+    {
+        const quint8 *taps = src + i;
+        __m256i lo = _mm256_set1_epi32(128);
+        __m256i hi = lo;
+        multiplyAddAvx2(lo, hi, _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(taps + radius * 4))),
+                        _mm256_set1_epi16(short(weights[radius])));
+        for(int k = 0; k < radius; ++k)
+        {
+            const __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(taps + k * 4)));
+            const __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(taps + (2 * radius - k) * 4)));
+            multiplyAddAvx2(lo, hi, _mm256_add_epi16(a, b), _mm256_set1_epi16(short(weights[k])));
+        }
+
+        // the pack undoes the unpack's order within each half
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i),
+                            _mm256_packus_epi32(_mm256_srli_epi32(lo, 8), _mm256_srli_epi32(hi, 8)));
+    }
+
+    blurRowScalar(dst + i, src + i, count - i, weights, radius);
+}
+
+__attribute__((target("avx2")))
+void blurColumnAvx2(quint8 *dst, const quint16 *src, int stride, int count,
+                    const quint16 *weights, int radius)
+{
+    int i = 0;
+    for(; i + 16 <= count; i += 16)
+    {
+        const quint16 *taps = src + i;
+        __m256i lo = _mm256_set1_epi32(1 << 21);
+        __m256i hi = lo;
+        multiplyAddAvx2(lo, hi, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(taps + radius * stride)),
+                        _mm256_set1_epi16(short(weights[radius])));
+        for(int k = 0; k < radius; ++k)
+        {
+            const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(taps + k * stride));
+            const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(taps + (2 * radius - k) * stride));
+            multiplyAddAvx2(lo, hi, _mm256_add_epi16(a, b), _mm256_set1_epi16(short(weights[k])));
+        }
+
+        // both halves pack to their first 8 bytes, the permute joins them
+        const __m256i words = _mm256_packs_epi32(_mm256_srli_epi32(lo, 22), _mm256_srli_epi32(hi, 22));
+        const __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0x08);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm256_castsi256_si128(bytes));
+    }
+
+    blurColumnScalar(dst + i, src + i, stride, count - i, weights, radius);
+}
+
+#endif // COMPOSITOR_X86
+
+template<BlendMode mode>
+Compositor::DabRow dabKernel(Compositor::Path path)
+{
+#ifdef COMPOSITOR_X86
+    if(path == Compositor::avx2_path)
+        return &dabRowAvx2<mode>;
+    if(path == Compositor::sse2_path)
+        return &dabRowSse2<mode>;
+#else
+    Q_UNUSED(path);
+#endif
+    return &dabRowScalar<mode>;
+}
+
+template<BlendMode mode>
+Compositor::LayerRow layerKernel(Compositor::Path path)
+{
+#ifdef COMPOSITOR_X86
+    if(path == Compositor::avx2_path)
+        return &layerRowAvx2<mode>;
+    if(path == Compositor::sse2_path)
+        return &layerRowSse2<mode>;
+#else
+    Q_UNUSED(path);
+#endif
+    return &layerRowScalar<mode>;
+}
+
+} // namespace
+
+
+/**
+ * @brief Compositor::bestPath - The widest path the CPU runs, looked up once
+ */
+Compositor::Path Compositor::bestPath()
+{
+    static const Path best = isSupported(avx2_path) ? avx2_path
+                           : isSupported(sse2_path) ? sse2_path : scalar_path;
+    return best;
+}
+
+/**
+ * @brief Compositor::isSupported - Whether the CPU runs a path, and this
+ *                                  build has it at all
+ */
+bool Compositor::isSupported(Path path)
+{
+#ifdef COMPOSITOR_X86
+    __builtin_cpu_init();
+    switch(path)
+    {
+        case avx2_path: return __builtin_cpu_supports("avx2");
+        case sse2_path: return __builtin_cpu_supports("sse2");
+        default:        return true;
+    }
+#else
+    return path == scalar_path;
+#endif
+}
+
+const char* Compositor::pathName(Path path)
+{
+    switch(path)
+    {
+        case avx2_path: return "AVX2";
+        case sse2_path: return "SSE2";
+        default:        return "scalar";
+    }
+}
+
+/**
+ * @brief Compositor::dabRow - The dab kernel of a blend mode on a path
+ */
+Compositor::DabRow Compositor::dabRow(BlendMode mode, Path path)
+{
+    Q_ASSERT(isSupported(path));
+    switch(mode)
+    {
+        case multiply_blend:   return dabKernel<multiply_blend>(path);
+        case screen_blend:     return dabKernel<screen_blend>(path);
+        case darken_blend:     return dabKernel<darken_blend>(path);
+        case lighten_blend:    return dabKernel<lighten_blend>(path);
+        case erase_blend:      return dabKernel<erase_blend>(path);
+        case overlay_blend:    return dabKernel<overlay_blend>(path);
+        case add_blend:        return dabKernel<add_blend>(path);
+        case difference_blend: return dabKernel<difference_blend>(path);
+        default:               return dabKernel<normal_blend>(path);
+    }
+}
+
+/**
+ * @brief Compositor::layerRow - The layer kernel of a blend mode on a path
+ */
+Compositor::LayerRow Compositor::layerRow(BlendMode mode, Path path)
+{
+    Q_ASSERT(isSupported(path));
+    switch(mode)
+    {
+        case multiply_blend:   return layerKernel<multiply_blend>(path);
+        case screen_blend:     return layerKernel<screen_blend>(path);
+        case darken_blend:     return layerKernel<darken_blend>(path);
+        case lighten_blend:    return layerKernel<lighten_blend>(path);
+        case erase_blend:      return layerKernel<erase_blend>(path);
+        case overlay_blend:    return layerKernel<overlay_blend>(path);
+        case add_blend:        return layerKernel<add_blend>(path);
+        case difference_blend: return layerKernel<difference_blend>(path);
+        default:               return layerKernel<normal_blend>(path);
+    }
+}
+
+/**
+ * @brief Compositor::matchRun - The match kernel on a path
+ */
+Compositor::MatchRun Compositor::matchRun(Path path)
+{
+    Q_ASSERT(isSupported(path));
+#ifdef COMPOSITOR_X86
+    if(path == avx2_path)
+        return &matchRunAvx2;
+    if(path == sse2_path)
+        return &matchRunSse2;
+#endif
+    return &matchRunScalar;
+}
+
+Compositor::MatchRunBack Compositor::matchRunBack(Path path)
+{
+    Q_ASSERT(isSupported(path));
+#ifdef COMPOSITOR_X86
+    if(path == avx2_path)
+        return &matchRunBackAvx2;
+    if(path == sse2_path)
+        return &matchRunBackSse2;
+#endif
+    return &matchRunBackScalar;
+}
+
+/**
+ * @brief Compositor::blurRow - The blur kernels on a path
+ */
+Compositor::BlurRow Compositor::blurRow(Path path)
+{
+    Q_ASSERT(isSupported(path));
+#ifdef COMPOSITOR_X86
+    if(path == avx2_path)
+        return &blurRowAvx2;
+    if(path == sse2_path)
+        return &blurRowSse2;
+#endif
+    return &blurRowScalar;
+}
+
+Compositor::BlurColumn Compositor::blurColumn(Path path)
+{
+    Q_ASSERT(isSupported(path));
+#ifdef COMPOSITOR_X86
+    if(path == avx2_path)
+        return &blurColumnAvx2;
+    if(path == sse2_path)
+        return &blurColumnSse2;
+#endif
+    return &blurColumnScalar;
+}
@@ -0,0 +1,94 @@
+#ifndef COMPOSITOR_H
+#define COMPOSITOR_H
+
+#include <QtGlobal>
+
+#include "constants.h"
+
+
+/**
+ * The per-pixel loops of painting on CANVAS_FORMAT rows. Each comes in a
+ * scalar, an SSE2 and an AVX2 version, and all three give exactly the same
+ * pixels. The widest version the CPU runs is picked at first use. The
+ * others stay reachable, so the benchmark can compare them.
+ */
+class Compositor
+{
+public:
+    enum Path {scalar_path, sse2_path, avx2_path};
+
+    /** the widest path this CPU runs */
+    static Path bestPath();
+    static bool isSupported(Path);
+    static const char* pathName(Path);
+
+    /**
+     * One row under a brush dab. Raises the stroke's coverage to the mask
+     * where the mask is stronger. Then every pixel gets color at coverage
+     * times alpha / 255, blended onto the pixel as it was before the
+     * stroke. before is null for a row that was all beforeColor.
+     */
+    typedef void (*DabRow)(uint *dst, const uint *before, uint beforeColor,
+                           quint8 *coverage, const quint8 *mask, int count,
+                           uint color, uint alpha);
+
+    static DabRow dabRow(BlendMode, Path = bestPath());
+
+    /**
+     * One row of a layer onto the layers under it, both premultiplied.
+     * The layer's pixels are faded to opacity / 255 first. Each mode is
+     * the separable blend of the W3C compositing spec with source-over,
+     * worked out on premultiplied channels with one rounding, add is
+     * the channels added up to white.
+     */
+    typedef void (*LayerRow)(uint *dst, const uint *src, int count,
+                             uint opacity);
+
+    static LayerRow layerRow(BlendMode, Path = bestPath());
+
+    /**
+     * How many pixels from the start of a row, at most count, all are
+     * (matching) or all aren't (!matching) within tolerance of color in
+     * every channel. MatchRunBack counts back from end[-1] instead and
+     * only counts matching pixels.
+     */
+    typedef int (*MatchRun)(const uint *pixels, int count, uint color,
+                            uint tolerance, bool matching);
+    typedef int (*MatchRunBack)(const uint *end, int count, uint color,
+                                uint tolerance);
+
+    static MatchRun matchRun(Path = bestPath());
+    static MatchRunBack matchRunBack(Path = bestPath());
+
+    /**
+     * One row of a symmetric blur of 2 * radius + 1 taps, with 16 bit
+     * weights summing to 32768. Each of count channels of dst is the sum
+     * of the weights times the channels from radius taps back to radius
+     * taps on, src points at the first tap. BlurRow takes 8 bit channels
+     * with the taps a pixel apart and gives them times 128, BlurColumn
+     * takes those with the taps stride apart back to 8 bit.
+     */
+    typedef void (*BlurRow)(quint16 *dst, const quint8 *src, int count,
+                            const quint16 *weights, int radius);
+    typedef void (*BlurColumn)(quint8 *dst, const quint16 *src, int stride,
+                               int count, const quint16 *weights, int radius);
+
+    static BlurRow blurRow(Path = bestPath());
+    static BlurColumn blurColumn(Path = bestPath());
+
+    /** the test both match kernels do for each pixel */
+    static bool matches(uint pixel, uint color, uint tolerance);
+};
+
+inline bool Compositor::matches(uint pixel, uint color, uint tolerance)
+{
+    for(int shift = 0; shift < 32; shift += 8)
+    {
+        int difference = int((pixel >> shift) & 0xff) - int((color >> shift) & 0xff);
+        if(uint(qAbs(difference)) > tolerance)
+            return false;
+    }
+    return true;
+}
+
+#endif // COMPOSITOR_H
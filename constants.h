@@ -1,6 +1,8 @@
 #ifndef CONSTANTS_H
 #define CONSTANTS_H
 
+#include <QImage>
+
 
 /** defaults */
 const int DEFAULT_IMG_WIDTH = 640;
@@ -8,28 +10,111 @@ const int DEFAULT_IMG_HEIGHT = 480;
 const int DEFAULT_PEN_THICKNESS = 1;
 const int DEFAULT_ERASER_THICKNESS = 10;
 const int DEFAULT_RECT_CURVE = 10;
+const int DEFAULT_BRUSH_HARDNESS = 100;
+const int DEFAULT_BRUSH_SPACING = 10;
+const int DEFAULT_BRUSH_OPACITY = 100;
+const int DEFAULT_FILL_TOLERANCE = 0;
 
 /** slider ranges */
 const int MIN_PEN_SIZE = 1;
-const int MAX_PEN_SIZE = 50;
+const int MAX_PEN_SIZE = 300;
+const int MIN_BRUSH_SPACING = 1;
+const int MAX_BRUSH_SPACING = 200;
 const int MIN_RECT_CURVE = 0;
 const int MAX_RECT_CURVE = 100;
+const int MIN_FILL_TOLERANCE = 0;
+const int MAX_FILL_TOLERANCE = 100;
 
 /** spinbox ranges */
 const int MIN_IMG_WIDTH = 1;
-const int MAX_IMG_WIDTH = 2560; // 2560x1440 limit due to undo/redo limitations
-const int MIN_IMG_HEIGHT = 1;
-const int MAX_IMG_HEIGHT = 1440;
+const int MAX_IMG_WIDTH = 16384; // tiles only get pixels once painted on,
+const int MIN_IMG_HEIGHT = 1;     // saving still flattens to one QImage
+const int MAX_IMG_HEIGHT = 16384;
+
+/** the one pixel format the canvas is kept in, tools paint straight into
+ *  it and only the display blit may convert */
+const QImage::Format CANVAS_FORMAT = QImage::Format_ARGB32_Premultiplied;
+
+/** brush dab masks kept for reuse, one per size and hardness */
+const int BRUSH_MASK_CACHE = 32;
+
+/** rasterize pen strokes on a worker thread instead of the GUI thread */
+const bool THREADED_STROKES = false;
+
+/** bucket fills that grow past this many pixels start over on every
+ *  core, smaller ones stay on the GUI thread */
+const bool PARALLEL_FILL = true;
+const int PARALLEL_FILL_PIXELS = 4 * 1024 * 1024;
 
-/** max number of undo commands */
+/** a parallel fill cuts the canvas into this many bands per thread, so
+ *  the cores stay busy until the end */
+const int PARALLEL_FILL_BANDS_PER_THREAD = 4;
+
+/** filters work on blocks this many pixels square, a multiple of
+ *  TILE_SIZE. With the halo around it a block's passes stay in cache. */
+const int FILTER_BLOCK_SIZE = 256;
+
+/** a filter hands out its blocks in this many batches per thread */
+const int FILTER_BATCHES_PER_THREAD = 4;
+
+/** filter radius in pixels, and the unsharp mask's amount in percent */
+const int MIN_FILTER_RADIUS = 1;
+const int MAX_FILTER_RADIUS = 100;
+const int DEFAULT_FILTER_RADIUS = 5;
+const int MAX_SHARPEN_AMOUNT = 500;
+const int DEFAULT_SHARPEN_AMOUNT = 100;
+
+/** max number of undo commands, used when there is no memory budget
+ *  and undo isn't spilled to disk */
 const int UNDO_LIMIT = 100;
 
-enum ToolType {pen, line, eraser, rect_tool};
+/** default memory budget of the undo history in MB, 0 = count mode */
+const int UNDO_MEMORY_BUDGET = 512;
+
+/** edge length of the squares undo/redo stores changes in */
+const int TILE_SIZE = 64;
+
+/** RAM the canvas tiles may take in MB before the least recently used
+ *  ones are paged out to a scratch file, 0 = keep every tile in RAM */
+const int CANVAS_MEMORY_BUDGET = 0;
+
+/** free tile buffers kept for reuse, 1024 tiles are 16 MB */
+const int TILE_POOL_FREE = 1024;
+
+/** tiles the scratch file grows by at once, 1024 tiles are 16 MB */
+const int TILE_SWAP_CHUNK = 1024;
+
+/** undo commands this close to the current one are never compressed */
+const int UNDO_HOT_COMMANDS = 4;
+
+/** undo commands further away than this are spilled to disk */
+const int UNDO_RESIDENT_COMMANDS = 32;
+const bool UNDO_SPILL_TO_DISK = true;
+
+/** default disk budget of spilled undo commands in MB, 0 = unbounded */
+const int UNDO_DISK_BUDGET = 4096;
+
+/** released MB the undo journal may hold before it is compacted */
+const int UNDO_JOURNAL_SLACK = 64;
+
+/** commands kept in any mode, however little each holds */
+const int UNDO_MAX_COMMANDS = 10000;
+
+/** keep lines and shapes in the history as the operation that drew
+ *  them, with a snapshot of the canvas only every this many of them */
+const bool UNDO_REPLAY_OPERATIONS = false;
+const int UNDO_KEYFRAME_INTERVAL = 16;
+
+enum ToolType {pen, line, eraser, rect_tool, bucket};
 enum LineStyle {solid, dashed, dotted, dash_dotted, dash_dot_dotted};
 enum CapStyle {flat, square, round_cap};
 enum DrawType {single, poly};
 enum ShapeType {rectangle, rounded_rectangle, ellipse};
 enum FillColor {foreground, background, no_fill};
 enum BoundaryType {miter_join, bevel_join, round_join};
+enum BlendMode {normal_blend, multiply_blend, screen_blend, darken_blend,
+                lighten_blend, erase_blend, overlay_blend, add_blend,
+                difference_blend};
+enum FilterType {gaussian_filter, box_filter, sharpen_filter};
 
 #endif // CONSTANTS_H
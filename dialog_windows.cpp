@@ -64,11 +64,15 @@ QGroupBox* CanvasSizeDialog::createSpinBoxes(int width, int height)
 }
 
 /**
- * @brief PenDialog::PenDialog - Dialogue for selecting pen size and cap style
+ * @brief PenDialog::PenDialog - Dialogue for selecting pen size, cap style
+ *                               and the brush's hardness, spacing, opacity
+ *                               and blend mode
  *
  */
 PenDialog::PenDialog(QWidget* parent, DrawArea* drawArea,
-                                      CapStyle capStyle, int size)
+                                      CapStyle capStyle, int size,
+                                      int hardness, int spacing, int opacity,
+                                      BlendMode blendMode)
     :QDialog(parent)
 {
     setWindowTitle(tr("Pen Dialog"));
@@ -84,10 +88,44 @@ PenDialog::PenDialog(QWidget* parent, DrawArea* drawArea,
     connect(penSizeSlider, SIGNAL(valueChanged(int)),
             drawArea, SLOT(OnPenSizeConfig(int)));
 
+    QLabel *hardnessLabel = new QLabel(tr("Hardness"), this);
+    hardnessSlider = new QSlider(Qt::Horizontal, this);
+    hardnessSlider->setMinimum(0);
+    hardnessSlider->setMaximum(100);
+    hardnessSlider->setSliderPosition(hardness);
+    hardnessSlider->setTracking(false);
+    connect(hardnessSlider, SIGNAL(valueChanged(int)),
+            drawArea, SLOT(OnPenHardnessConfig(int)));
+
+    QLabel *spacingLabel = new QLabel(tr("Spacing"), this);
+    spacingSlider = new QSlider(Qt::Horizontal, this);
+    spacingSlider->setMinimum(MIN_BRUSH_SPACING);
+    spacingSlider->setMaximum(MAX_BRUSH_SPACING);
+    spacingSlider->setSliderPosition(spacing);
+    spacingSlider->setTracking(false);
+    connect(spacingSlider, SIGNAL(valueChanged(int)),
+            drawArea, SLOT(OnPenSpacingConfig(int)));
+
+    QLabel *opacityLabel = new QLabel(tr("Opacity"), this);
+    opacitySlider = new QSlider(Qt::Horizontal, this);
+    opacitySlider->setMinimum(0);
+    opacitySlider->setMaximum(100);
+    opacitySlider->setSliderPosition(opacity);
+    opacitySlider->setTracking(false);
+    connect(opacitySlider, SIGNAL(valueChanged(int)),
+            drawArea, SLOT(OnPenOpacityConfig(int)));
+
     QVBoxLayout *vbox = new QVBoxLayout(this);
     vbox->addWidget(createCapStyle(capStyle));
+    vbox->addWidget(createBlendMode(blendMode));
     vbox->addWidget(penSizeLabel);
     vbox->addWidget(penSizeSlider);
+    vbox->addWidget(hardnessLabel);
+    vbox->addWidget(hardnessSlider);
+    vbox->addWidget(spacingLabel);
+    vbox->addWidget(spacingSlider);
+    vbox->addWidget(opacityLabel);
+    vbox->addWidget(opacitySlider);
     setLayout(vbox);
 }
 
@@ -123,6 +161,45 @@ QGroupBox* PenDialog::createCapStyle(CapStyle capStyle)
     return capStyles;
 }
 
+QGroupBox* PenDialog::createBlendMode(BlendMode blendMode)
+{
+    QGroupBox *blendModes = new QGroupBox(tr("Blend Mode"), this);
+    QRadioButton *normalButton = new QRadioButton(tr("Normal"), this);
+    QRadioButton *multiplyButton = new QRadioButton(tr("Multiply"), this);
+    QRadioButton *screenButton = new QRadioButton(tr("Screen"), this);
+    QRadioButton *darkenButton = new QRadioButton(tr("Darken"), this);
+    QRadioButton *lightenButton = new QRadioButton(tr("Lighten"), this);
+
+    blendModeG = new QButtonGroup(this);
+    blendModeG->addButton(normalButton, normal_blend);
+    blendModeG->addButton(multiplyButton, multiply_blend);
+    blendModeG->addButton(screenButton, screen_blend);
+    blendModeG->addButton(darkenButton, darken_blend);
+    blendModeG->addButton(lightenButton, lighten_blend);
+
+    connect(blendModeG, SIGNAL(buttonClicked(int)),
+            drawArea, SLOT(OnPenBlendConfig(int)));
+
+    switch(blendMode)
+    {
+        case multiply_blend: multiplyButton->setChecked(true); break;
+        case screen_blend: screenButton->setChecked(true);     break;
+        case darken_blend: darkenButton->setChecked(true);     break;
+        case lighten_blend: lightenButton->setChecked(true);   break;
+        default: normalButton->setChecked(true);               break;
+    }
+
+    QHBoxLayout *hbox = new QHBoxLayout(blendModes);
+    hbox->addWidget(normalButton);
+    hbox->addWidget(multiplyButton);
+    hbox->addWidget(screenButton);
+    hbox->addWidget(darkenButton);
+    hbox->addWidget(lightenButton);
+    blendModes->setLayout(hbox);
+
+    return blendModes;
+}
+
 /**
  * @brief LineDialog::LineSizeDialog - Dialogue for selecting what kind of
  *                                     line to draw
@@ -266,10 +343,14 @@ QGroupBox* LineDialog::createDrawType(DrawType drawType)
 }
 
 /**
- * @brief EraserDialog::EraserDialog - Dialogue for choosing eraser thickness.
+ * @brief EraserDialog::EraserDialog - Dialogue for choosing eraser thickness,
+ *                                     hardness, opacity and whether it
+ *                                     paints the background color or
+ *                                     erases to transparency.
  *
  */
-EraserDialog::EraserDialog(QWidget* parent, DrawArea* drawArea, int thickness)
+EraserDialog::EraserDialog(QWidget* parent, DrawArea* drawArea, int thickness,
+                           int hardness, int opacity, BlendMode eraseMode)
     :QDialog(parent)
 {
     setWindowTitle(tr("Eraser Dialog"));
@@ -284,12 +365,59 @@ EraserDialog::EraserDialog(QWidget* parent, DrawArea* drawArea, int thickness)
     eraserThicknessSlider->setTracking(false);
     connect(eraserThicknessSlider, SIGNAL(valueChanged(int)), drawArea, SLOT(OnEraserConfig(int)));
 
+    QLabel *hardnessLabel = new QLabel(tr("Hardness"), this);
+    hardnessSlider = new QSlider(Qt::Horizontal, this);
+    hardnessSlider->setMinimum(0);
+    hardnessSlider->setMaximum(100);
+    hardnessSlider->setSliderPosition(hardness);
+    hardnessSlider->setTracking(false);
+    connect(hardnessSlider, SIGNAL(valueChanged(int)), drawArea, SLOT(OnEraserHardnessConfig(int)));
+
+    QLabel *opacityLabel = new QLabel(tr("Opacity"), this);
+    opacitySlider = new QSlider(Qt::Horizontal, this);
+    opacitySlider->setMinimum(0);
+    opacitySlider->setMaximum(100);
+    opacitySlider->setSliderPosition(opacity);
+    opacitySlider->setTracking(false);
+    connect(opacitySlider, SIGNAL(valueChanged(int)), drawArea, SLOT(OnEraserOpacityConfig(int)));
+
     QVBoxLayout *vbox = new QVBoxLayout(this);
+    vbox->addWidget(createEraseMode(eraseMode));
     vbox->addWidget(eraserThicknessLabel);
     vbox->addWidget(eraserThicknessSlider);
+    vbox->addWidget(hardnessLabel);
+    vbox->addWidget(hardnessSlider);
+    vbox->addWidget(opacityLabel);
+    vbox->addWidget(opacitySlider);
     setLayout(vbox);
 }
 
+QGroupBox* EraserDialog::createEraseMode(BlendMode eraseMode)
+{
+    QGroupBox *eraseModes = new QGroupBox(tr("Erase To"), this);
+    QRadioButton *backgroundButton = new QRadioButton(tr("Background Color"), this);
+    QRadioButton *transparentButton = new QRadioButton(tr("Transparency"), this);
+
+    eraseModeG = new QButtonGroup(this);
+    eraseModeG->addButton(backgroundButton, normal_blend);
+    eraseModeG->addButton(transparentButton, erase_blend);
+
+    connect(eraseModeG, SIGNAL(buttonClicked(int)),
+            drawArea, SLOT(OnEraserModeConfig(int)));
+
+    if(eraseMode == erase_blend)
+        transparentButton->setChecked(true);
+    else
+        backgroundButton->setChecked(true);
+
+    QHBoxLayout *hbox = new QHBoxLayout(eraseModes);
+    hbox->addWidget(backgroundButton);
+    hbox->addWidget(transparentButton);
+    eraseModes->setLayout(hbox);
+
+    return eraseModes;
+}
+
 /**
  * @brief RectDialog::RectDialog - Dialogue for selecting what kind of rectangle to draw.
  *
@@ -477,3 +605,273 @@ QGroupBox* RectDialog::createBoundaryType(BoundaryType boundaryType)
 
     return boundaryTypes;
 }
+
+/**
+ * @brief BucketDialog::BucketDialog - Dialogue for choosing how far a color
+ *                                     may be from the clicked one and still
+ *                                     be filled.
+ *
+ */
+BucketDialog::BucketDialog(QWidget* parent, DrawArea* drawArea, int tolerance)
+    :QDialog(parent)
+{
+    setWindowTitle(tr("Bucket Dialog"));
+
+    this->drawArea = drawArea;
+
+    QLabel *toleranceLabel = new QLabel(tr("Tolerance"), this);
+    toleranceSlider = new QSlider(Qt::Horizontal, this);
+    toleranceSlider->setMinimum(MIN_FILL_TOLERANCE);
+    toleranceSlider->setMaximum(MAX_FILL_TOLERANCE);
+    toleranceSlider->setSliderPosition(tolerance);
+    toleranceSlider->setTracking(false);
+    connect(toleranceSlider, SIGNAL(valueChanged(int)), drawArea, SLOT(OnBucketToleranceConfig(int)));
+
+    QVBoxLayout *vbox = new QVBoxLayout(this);
+    vbox->addWidget(toleranceLabel);
+    vbox->addWidget(toleranceSlider);
+    setLayout(vbox);
+}
+
+/**
+ * @brief FilterDialog::FilterDialog - Dialogue for the radius of a filter,
+ *                                     and for the unsharp mask how much it
+ *                                     sharpens. While it is open the image
+ *                                     shows a preview of the filter.
+ *
+ */
+FilterDialog::FilterDialog(QWidget* parent, DrawArea* drawArea, FilterType type,
+                           int radius, int amount)
+    :QDialog(parent)
+{
+    this->drawArea = drawArea;
+    this->type = type;
+
+    switch(type)
+    {
+        case box_filter:     setWindowTitle(tr("Box Blur")); break;
+        case sharpen_filter: setWindowTitle(tr("Unsharp Mask")); break;
+        default:             setWindowTitle(tr("Gaussian Blur")); break;
+    }
+
+    QFormLayout *form = new QFormLayout;
+    radiusSlider = addSlider(form, tr("Radius: "), MIN_FILTER_RADIUS, MAX_FILTER_RADIUS,
+                             radius, tr("px"));
+    amountSlider = addSlider(form, tr("Amount: "), 0, MAX_SHARPEN_AMOUNT, amount, tr("%"));
+    if(type != sharpen_filter)
+    {
+        form->labelForField(amountSlider->parentWidget())->hide();
+        amountSlider->parentWidget()->hide();
+    }
+
+    previewBox = new QCheckBox(tr("Preview"), this);
+    previewBox->setChecked(true);
+    form->addRow(previewBox);
+
+    connect(radiusSlider, SIGNAL(valueChanged(int)), this, SLOT(OnSettingsChanged()));
+    connect(amountSlider, SIGNAL(valueChanged(int)), this, SLOT(OnSettingsChanged()));
+    connect(previewBox, SIGNAL(toggled(bool)), this, SLOT(OnSettingsChanged()));
+
+    // the buttons
+    QPushButton *okButton = new QPushButton(tr("OK"), this);
+    QPushButton *cancelButton = new QPushButton(tr("Cancel"), this);
+    okButton->setDefault(true);
+    connect(okButton, SIGNAL(clicked()), this, SLOT(accept()));
+    connect(cancelButton, SIGNAL(clicked()), this, SLOT(reject()));
+
+    QHBoxLayout *buttons = new QHBoxLayout;
+    buttons->addStretch();
+    buttons->addWidget(okButton);
+    buttons->addWidget(cancelButton);
+
+    QVBoxLayout *vbox = new QVBoxLayout(this);
+    vbox->addLayout(form);
+    vbox->addLayout(buttons);
+    setLayout(vbox);
+
+    OnSettingsChanged();
+}
+
+/**
+ * @brief FilterDialog::done - Drop the preview whichever button closed the
+ *                             dialog, OK filters the whole layer afresh
+ */
+void FilterDialog::done(int result)
+{
+    drawArea->endFilterPreview();
+    QDialog::done(result);
+}
+
+/**
+ * @brief FilterDialog::OnSettingsChanged - Preview the filter with the new
+ *                                          settings, the drawArea drops
+ *                                          what it still filters for the
+ *                                          old ones
+ */
+void FilterDialog::OnSettingsChanged()
+{
+    if(previewBox->isChecked())
+        drawArea->previewFilter(type, getRadius(), getAmount());
+    else
+        drawArea->endFilterPreview();
+}
+
+/**
+ * @brief FilterDialog::addSlider - A slider and a spin box kept at the
+ *                                  same value, on one row of the form
+ */
+QSlider* FilterDialog::addSlider(QFormLayout* layout, const QString &label,
+                                 int minimum, int maximum, int value,
+                                 const QString &suffix)
+{
+    QWidget *row = new QWidget(this);
+
+    QSlider *slider = new QSlider(Qt::Horizontal, row);
+    slider->setRange(minimum, maximum);
+    slider->setValue(value);
+
+    QSpinBox *spinBox = new QSpinBox(row);
+    spinBox->setRange(minimum, maximum);
+    spinBox->setValue(value);
+    spinBox->setSuffix(suffix);
+
+    connect(slider, SIGNAL(valueChanged(int)), spinBox, SLOT(setValue(int)));
+    connect(spinBox, SIGNAL(valueChanged(int)), slider, SLOT(setValue(int)));
+
+    QHBoxLayout *hbox = new QHBoxLayout(row);
+    hbox->setContentsMargins(0, 0, 0, 0);
+    hbox->addWidget(slider);
+    hbox->addWidget(spinBox);
+
+    layout->addRow(label, row);
+    return slider;
+}
+
+/**
+ * @brief LayerDialog::LayerDialog - Dialogue listing the layers, top one
+ *                                   first. The checkbox shows or hides a
+ *                                   layer, the selected one is painted on.
+ *
+ */
+LayerDialog::LayerDialog(QWidget* parent, DrawArea* drawArea)
+    :QDialog(parent)
+{
+    setWindowTitle(tr("Layers"));
+
+    this->drawArea = drawArea;
+
+    layerList = new QListWidget(this);
+    connect(layerList, SIGNAL(currentRowChanged(int)), this, SLOT(OnRowChanged(int)));
+    connect(layerList, SIGNAL(itemChanged(QListWidgetItem*)), this, SLOT(OnItemChanged(QListWidgetItem*)));
+
+    QPushButton *addButton = new QPushButton(tr("Add"), this);
+    removeButton = new QPushButton(tr("Remove"), this);
+    raiseButton = new QPushButton(tr("Up"), this);
+    lowerButton = new QPushButton(tr("Down"), this);
+    connect(addButton, SIGNAL(clicked()), drawArea, SLOT(OnAddLayer()));
+    connect(removeButton, SIGNAL(clicked()), drawArea, SLOT(OnRemoveLayer()));
+    connect(raiseButton, SIGNAL(clicked()), drawArea, SLOT(OnRaiseLayer()));
+    connect(lowerButton, SIGNAL(clicked()), drawArea, SLOT(OnLowerLayer()));
+
+    QHBoxLayout *buttons = new QHBoxLayout;
+    buttons->addWidget(addButton);
+    buttons->addWidget(removeButton);
+    buttons->addWidget(raiseButton);
+    buttons->addWidget(lowerButton);
+
+    QLabel *opacityLabel = new QLabel(tr("Opacity"), this);
+    opacitySlider = new QSlider(Qt::Horizontal, this);
+    opacitySlider->setMinimum(0);
+    opacitySlider->setMaximum(100);
+    opacitySlider->setTracking(false);
+    connect(opacitySlider, SIGNAL(valueChanged(int)), drawArea, SLOT(OnLayerOpacityConfig(int)));
+
+    QLabel *modeLabel = new QLabel(tr("Blend mode"), this);
+    modeBox = new QComboBox(this);
+    modeBox->addItem(tr("Normal"), normal_blend);
+    modeBox->addItem(tr("Multiply"), multiply_blend);
+    modeBox->addItem(tr("Screen"), screen_blend);
+    modeBox->addItem(tr("Overlay"), overlay_blend);
+    modeBox->addItem(tr("Darken"), darken_blend);
+    modeBox->addItem(tr("Lighten"), lighten_blend);
+    modeBox->addItem(tr("Add"), add_blend);
+    modeBox->addItem(tr("Difference"), difference_blend);
+    connect(modeBox, SIGNAL(activated(int)), this, SLOT(OnModeChanged(int)));
+
+    QVBoxLayout *vbox = new QVBoxLayout(this);
+    vbox->addWidget(layerList);
+    vbox->addLayout(buttons);
+    vbox->addWidget(opacityLabel);
+    vbox->addWidget(opacitySlider);
+    vbox->addWidget(modeLabel);
+    vbox->addWidget(modeBox);
+    setLayout(vbox);
+
+    // queued, the list may be in the middle of a signal of its own
+    connect(drawArea, SIGNAL(layersChanged()), this, SLOT(refresh()), Qt::QueuedConnection);
+    refresh();
+}
+
+/**
+ * @brief LayerDialog::refresh - Fill the list and the slider from the
+ *                               layer stack, without echoing it back
+ *
+ */
+void LayerDialog::refresh()
+{
+    LayerStack *layers = drawArea->getLayers();
+
+    layerList->blockSignals(true);
+    layerList->clear();
+    for(int i = layers->count() - 1; i >= 0; --i)
+    {
+        QListWidgetItem *item = new QListWidgetItem(layers->layer(i)->name, layerList);
+        item->setFlags(item->flags() | Qt::ItemIsUserCheckable);
+        item->setCheckState(layers->layer(i)->visible ? Qt::Checked : Qt::Unchecked);
+    }
+    layerList->setCurrentRow(layers->count() - 1 - layers->currentIndex());
+    layerList->blockSignals(false);
+
+    opacitySlider->blockSignals(true);
+    opacitySlider->setSliderPosition(layers->current()->opacity);
+    opacitySlider->blockSignals(false);
+
+    modeBox->setCurrentIndex(modeBox->findData(layers->current()->mode));
+
+    removeButton->setEnabled(layers->count() > 1);
+    raiseButton->setEnabled(layers->currentIndex() + 1 < layers->count());
+    lowerButton->setEnabled(layers->currentIndex() > 0);
+}
+
+/**
+ * @brief LayerDialog::OnRowChanged - Paint on the layer picked in the list
+ *
+ */
+void LayerDialog::OnRowChanged(int row)
+{
+    if(row < 0)
+        return;
+
+    drawArea->OnCurrentLayer(layerList->count() - 1 - row);
+}
+
+/**
+ * @brief LayerDialog::OnItemChanged - Show or hide the layer whose box was
+ *                                     ticked
+ *
+ */
+void LayerDialog::OnItemChanged(QListWidgetItem *item)
+{
+    int row = layerList->row(item);
+    drawArea->OnLayerVisibility(layerList->count() - 1 - row, item->checkState() == Qt::Checked);
+}
+
+/**
+ * @brief LayerDialog::OnModeChanged - Blend the current layer in the mode
+ *                                     picked
+ *
+ */
+void LayerDialog::OnModeChanged(int index)
+{
+    drawArea->OnLayerModeConfig(modeBox->itemData(index).toInt());
+}
@@ -6,6 +6,11 @@
 #include <QDialog>
 #include <QSlider>
 #include <QButtonGroup>
+#include <QListWidget>
+#include <QPushButton>
+#include <QComboBox>
+#include <QFormLayout>
+#include <QCheckBox>
 
 #include "constants.h"
 #include "tool.h"
@@ -39,14 +44,23 @@ class PenDialog : public QDialog
 
 public:
     PenDialog(QWidget* parent, DrawArea* drawArea, CapStyle = round_cap,
-              int size = DEFAULT_PEN_THICKNESS);
+              int size = DEFAULT_PEN_THICKNESS,
+              int hardness = DEFAULT_BRUSH_HARDNESS,
+              int spacing = DEFAULT_BRUSH_SPACING,
+              int opacity = DEFAULT_BRUSH_OPACITY,
+              BlendMode = normal_blend);
 
 private:
     QGroupBox* createCapStyle(CapStyle);
+    QGroupBox* createBlendMode(BlendMode);
 
     DrawArea* drawArea;
     QButtonGroup* capStyleG;
+    QButtonGroup* blendModeG;
     QSlider* penSizeSlider;
+    QSlider* hardnessSlider;
+    QSlider* spacingSlider;
+    QSlider* opacitySlider;
 };
 
 class LineDialog : public QDialog
@@ -78,11 +92,19 @@ class EraserDialog : public QDialog
 
 public:
     EraserDialog(QWidget* parent, DrawArea* drawArea,
-                 int thickness = DEFAULT_ERASER_THICKNESS);
+                 int thickness = DEFAULT_ERASER_THICKNESS,
+                 int hardness = DEFAULT_BRUSH_HARDNESS,
+                 int opacity = DEFAULT_BRUSH_OPACITY,
+                 BlendMode = normal_blend);
 
 private:
+    QGroupBox* createEraseMode(BlendMode);
+
     DrawArea* drawArea;
+    QButtonGroup* eraseModeG;
     QSlider* eraserThicknessSlider;
+    QSlider* hardnessSlider;
+    QSlider* opacitySlider;
 };
 
 class RectDialog : public QDialog
@@ -111,4 +133,73 @@ private:
     QSlider* rRectCurveSlider;
 };
 
+class BucketDialog : public QDialog
+{
+    Q_OBJECT
+
+public:
+    BucketDialog(QWidget* parent, DrawArea* drawArea,
+                 int tolerance = DEFAULT_FILL_TOLERANCE);
+
+private:
+    DrawArea* drawArea;
+    QSlider* toleranceSlider;
+};
+
+class FilterDialog : public QDialog
+{
+    Q_OBJECT
+
+public:
+    FilterDialog(QWidget* parent, DrawArea* drawArea, FilterType type,
+                 int radius = DEFAULT_FILTER_RADIUS,
+                 int amount = DEFAULT_SHARPEN_AMOUNT);
+
+    int getRadius() const { return radiusSlider->value(); }
+    int getAmount() const { return amountSlider->value(); }
+
+    /** the preview ends with the dialog, before the filter is applied */
+    void virtual done(int result) override;
+
+private slots:
+    /** preview the filter as it is set now */
+    void OnSettingsChanged();
+
+private:
+    /** a slider with a spin box showing its value, on a row of layout */
+    QSlider* addSlider(QFormLayout* layout, const QString &label,
+                       int minimum, int maximum, int value,
+                       const QString &suffix);
+
+    DrawArea* drawArea;
+    FilterType type;
+    QSlider* radiusSlider;
+    QSlider* amountSlider;
+    QCheckBox* previewBox;
+};
+
+class LayerDialog : public QDialog
+{
+    Q_OBJECT
+
+public:
+    LayerDialog(QWidget* parent, DrawArea* drawArea);
+
+private slots:
+    /** show the layers as they are now, top layer first */
+    void refresh();
+    void OnRowChanged(int);
+    void OnItemChanged(QListWidgetItem*);
+    void OnModeChanged(int);
+
+private:
+    DrawArea* drawArea;
+    QListWidget* layerList;
+    QSlider* opacitySlider;
+    QComboBox* modeBox;
+    QPushButton* removeButton;
+    QPushButton* raiseButton;
+    QPushButton* lowerButton;
+};
+
 #endif // DIALOGS_H
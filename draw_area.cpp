@@ -1,7 +1,10 @@
 #include <QPainter>
 #include <QPaintEvent>
+#include <QResizeEvent>
+#include <QGuiApplication>
+#include <QScreen>
+#include <QMutexLocker>
 
-#include "commands.h"
 #include "draw_area.h"
 #include "Paint.h"
 
@@ -9,24 +12,48 @@
 /**
  * @brief DrawArea::DrawArea - constructor for our Draw Area.
  *                             Pointers to the MainWindow's
- *                             tools and image are mandatory
+ *                             tools and canvas are mandatory
  *
  */
 DrawArea::DrawArea(QWidget *parent)
     : QGraphicsView(parent)
 
 {
-    // set scene
+    // set scene, it only holds overlays which paintEvent renders itself
     setScene(&szene);
-
-    // initialize the undo stack
-    undoStack = new QUndoStack(this);
-    undoStack->setUndoLimit(UNDO_LIMIT);
-
-    // initialize image
-    image = new QPixmap();
-
-    //create the pen, line, eraser, & rect tools
+    setViewportUpdateMode(QGraphicsView::NoViewportUpdate);
+    setAlignment(Qt::AlignLeft | Qt::AlignTop);
+    preview = szene.addPath(QPainterPath());
+    preview->setVisible(false);
+
+    // initialize the undo history
+    history = new UndoHistory(this);
+    history->setUndoLimit(UNDO_LIMIT);
+    history->setByteBudget(qint64(UNDO_MEMORY_BUDGET) * 1024 * 1024);
+    history->setSpillEnabled(UNDO_SPILL_TO_DISK);
+    history->setDiskBudget(qint64(UNDO_DISK_BUDGET) * 1024 * 1024);
+    replayOperations = UNDO_REPLAY_OPERATIONS;
+
+    // initialize the layers, tools paint on the current one
+    layers = new LayerStack();
+    canvas = &layers->current()->canvas;
+    canvasBudget = 0;
+    conversionsBefore = 0;
+    strokeConversions = 0;
+    allocationsBefore = 0;
+    strokeAllocations = 0;
+    strokeWorker = nullptr;
+    filterPreview = nullptr;
+
+    // pen strokes are drawn once per display frame, not per mouse event
+    qreal refreshRate = 60;
+    if(QGuiApplication::primaryScreen())
+        refreshRate = QGuiApplication::primaryScreen()->refreshRate();
+    frameTimer.setTimerType(Qt::PreciseTimer);
+    frameTimer.setInterval(qMax(1, int(1000 / qMax(refreshRate, qreal(1)))));
+    connect(&frameTimer, &QTimer::timeout, this, &DrawArea::OnFrame);
+
+    //create the pen, line, eraser, rect & bucket tools
     createTools();
 
     // initialize colors
@@ -45,11 +72,14 @@ DrawArea::DrawArea(QWidget *parent)
 
 DrawArea::~DrawArea()
 {
-    delete image;
+    delete filterPreview;
+    delete strokeWorker;
+    delete layers;
     delete penTool;
     delete lineTool;
     delete eraserTool;
     delete rectTool;
+    delete bucketTool;
 }
 
 
@@ -62,9 +92,68 @@ void DrawArea::paintEvent(QPaintEvent *e)
 
 {
     QPainter painter(viewport());
-    painter.setRenderHint(QPainter::Antialiasing);
-    QRect modifiedArea = e->rect(); // only need to redraw a small area
-    painter.drawPixmap(modifiedArea, *image, modifiedArea);
+
+    // paint in canvas coordinates
+    const QPoint offset = canvasOffset();
+    painter.translate(-offset);
+
+    // the stroke worker may be drawing right now
+    QMutexLocker locker(strokeWorker ? strokeWorker->canvasLock() : nullptr);
+
+    // only need to redraw the damaged rects, not their bounding rect,
+    // and of the composite only the tiles inside them
+    for(const QRect &modifiedArea : e->region())
+    {
+        QRect area = modifiedArea.translated(offset);
+        for(const QRect &outside : QRegion(area) - layers->rect())
+            painter.fillRect(outside, palette().dark());
+        // any layer may have holes, the eraser, a loaded image or a
+        // filter can make pixels transparent, so always back them
+        painter.fillRect(area & layers->rect(), Qt::white);
+        layers->draw(&painter, area);
+
+        // the line/rect being dragged sits on top, the canvas is untouched
+        if(preview->isVisible())
+            szene.render(&painter, area, area);
+    }
+}
+
+/**
+ * @brief DrawArea::scrollContentsBy - NoViewportUpdate leaves scrolling
+ *                                     to us, move the pixels already on
+ *                                     screen and repaint the rest
+ *
+ */
+void DrawArea::scrollContentsBy(int dx, int dy)
+{
+    QGraphicsView::scrollContentsBy(dx, dy);
+    viewport()->scroll(dx, dy);
+
+    if(filterPreview)
+        filterPreview->request(visibleArea());
+}
+
+/**
+ * @brief DrawArea::resizeEvent - A bigger view shows more of the filter
+ *                                preview, have it filtered
+ *
+ */
+void DrawArea::resizeEvent(QResizeEvent *e)
+{
+    QGraphicsView::resizeEvent(e);
+
+    if(filterPreview)
+        filterPreview->request(visibleArea());
+}
+
+/**
+ * @brief DrawArea::visibleArea - The canvas rect the viewport shows, one
+ *                                canvas pixel per screen pixel
+ *
+ */
+QRect DrawArea::visibleArea() const
+{
+    return viewport()->rect().translated(canvasOffset()) & canvas->rect();
 }
 
 /**
@@ -84,16 +173,40 @@ void DrawArea::mousePressEvent(QMouseEvent *e)
     }
     else if (e->button() == Qt::LeftButton)
     {
-        if(image->isNull())
+        if(canvas->isNull())
             return;
 
         drawing = true;
+        QPoint pos = mapToScene(e->pos()).toPoint();
 
         if(!drawingPoly)
-            currentTool->setStartPoint(e->pos());
+            currentTool->setStartPoint(pos);
 
-        // save a copy of the old image
-        oldImage = image->copy(QRect());
+        // the canvas keeps the tiles the stroke touches as they were,
+        // nothing is copied up front however big the canvas is
+        canvas->beginEdit();
+        conversionsBefore = Canvas::conversions();
+        allocationsBefore = TilePool::instance()->heapAllocations();
+
+        ToolType type = currentTool->getType();
+        if(type == pen || type == eraser)
+        {
+            PenTool *penLike = static_cast<PenTool*>(currentTool);
+            if(strokeWorker)
+            {
+                strokeWorker->beginStroke(penLike, pos);
+            }
+            else
+            {
+                penLike->beginStroke();
+                frameTimer.start();
+            }
+        }
+        else if(type == bucket)
+        {
+            // one click fills, release only records it for undo
+            updateCanvas(currentTool->drawTo(pos, canvas));
+        }
     }
 }
 
@@ -105,19 +218,33 @@ void DrawArea::mouseMoveEvent(QMouseEvent *e)
 {
     if (e->buttons() & Qt::LeftButton && drawing)
     {
-        if(image->isNull())
+        if(canvas->isNull())
             return;
 
+        QPoint pos = mapToScene(e->pos()).toPoint();
         ToolType type = currentTool->getType();
         if(type == line || type == rect_tool)
         {
-            *image = oldImage;
             if(type == line && currentLineMode == poly)
             {
                 drawingPoly = true;
             }
+            // only preview, the shape is drawn on release
+            updatePreview(pos);
+            return;
         }
-        currentTool->drawTo(e->pos(), viewport(), image);
+        if(type == pen || type == eraser)
+        {
+            // drawn with the next frame, or by the worker
+            if(strokeWorker)
+                strokeWorker->addPoint(pos);
+            else
+                static_cast<PenTool*>(currentTool)->addPoint(pos);
+            return;
+        }
+        if(type == bucket)
+            return;
+        updateCanvas(currentTool->drawTo(pos, canvas));
     }
 }
 
@@ -131,21 +258,52 @@ void DrawArea::mouseReleaseEvent(QMouseEvent *e)
     {
         drawing = false;
 
-        if(image->isNull())
+        if(canvas->isNull())
             return;
 
+        QPoint pos = mapToScene(e->pos()).toPoint();
+
+        // commit the previewed line/rect to the canvas
+        if(preview->isVisible())
+        {
+            preview->setVisible(false);
+            updateCanvas(previewDamage);
+            if(replayOperations)
+                drawReplayed(pos);
+            else
+                updateCanvas(currentTool->drawTo(pos, canvas));
+        }
+
         if(drawingPoly)
         {
-            currentTool->setStartPoint(e->pos());
+            currentTool->setStartPoint(pos);
             //return;
         }
-        if(currentTool->getType() == pen)
-            currentTool->drawTo(e->pos(), viewport(), image);
+        ToolType type = currentTool->getType();
+        if((type == pen || type == eraser) && strokeWorker)
+        {
+            // wait for the worker to draw the rest of the stroke
+            if(type == pen)
+                strokeWorker->addPoint(pos);
+            updateCanvas(strokeWorker->finishStroke());
+        }
+        else if(type == pen || type == eraser)
+        {
+            // draw whatever is still buffered right away
+            frameTimer.stop();
+            PenTool *penLike = static_cast<PenTool*>(currentTool);
+            if(type == pen)
+                penLike->addPoint(pos);
+            updateCanvas(penLike->flush(canvas));
+        }
+
+        // for undo/redo - only the tiles the stroke touched can have
+        // changed (and none did if drawing began off-image)
+        saveDrawCommand(canvas->endEdit());
 
-        // for undo/redo - make sure there was a change
-        // (in case drawing began off-image)
-        if(oldImage.toImage() != image->toImage())
-            saveDrawCommand(oldImage);
+        strokeConversions = Canvas::conversions() - conversionsBefore;
+        strokeAllocations = TilePool::instance()->heapAllocations() - allocationsBefore;
+        emit strokeFinished(strokeConversions);
     }
 }
 
@@ -162,17 +320,52 @@ void DrawArea::mouseDoubleClickEvent(QMouseEvent *e)
     }
 }
 
+/**
+ * @brief DrawArea::OnFrame - draw the points the pen/eraser buffered
+ *                            since the last frame as one polyline
+ *
+ */
+void DrawArea::OnFrame()
+{
+    ToolType type = currentTool->getType();
+    if(!drawing || (type != pen && type != eraser))
+    {
+        frameTimer.stop();
+        return;
+    }
+
+    PenTool *penLike = static_cast<PenTool*>(currentTool);
+    if(!penLike->hasPending())
+        return;
+
+    updateCanvas(penLike->flush(canvas));
+}
+
+/**
+ * @brief DrawArea::updateCanvas - repaint a rect of the canvas, wherever
+ *                                 it is scrolled to. The current layer
+ *                                 changed there, only that part of the
+ *                                 composite is composed again.
+ *
+ */
+void DrawArea::updateCanvas(const QRect &area)
+{
+    layers->changed(layers->currentIndex(), area);
+    viewport()->update(area.translated(-canvasOffset()));
+}
+
 /**
  * @brief DrawArea::OnSaveImage - Undo a previous action
  *
  */
 void DrawArea::OnUndo()
 {
-    if(!undoStack->canUndo())
+    if(!history->canUndo())
         return;
 
-    undoStack->undo();
-    update();
+    // a layer may have come back or gone, the current one with it
+    history->undo();
+    layerSwitched();
 }
 
 /**
@@ -181,11 +374,39 @@ void DrawArea::OnUndo()
  */
 void DrawArea::OnRedo()
 {
-    if(!undoStack->canRedo())
+    if(!history->canRedo())
+        return;
+
+    history->redo();
+    layerSwitched();
+}
+
+/**
+ * @brief DrawArea::OnOlderState - Go to the state made before the
+ *                                 current one, on any branch
+ *
+ */
+void DrawArea::OnOlderState()
+{
+    if(!history->canStepOlder())
         return;
 
-    undoStack->redo();
-    update();
+    history->stepOlder();
+    layerSwitched();
+}
+
+/**
+ * @brief DrawArea::OnNewerState - Go to the state made after the
+ *                                 current one, on any branch
+ *
+ */
+void DrawArea::OnNewerState()
+{
+    if(!history->canStepNewer())
+        return;
+
+    history->stepNewer();
+    layerSwitched();
 }
 
 /**
@@ -194,7 +415,7 @@ void DrawArea::OnRedo()
  */
 void DrawArea::OnClearAll()
 {
-    if(image->isNull())
+    if(canvas->isNull())
         return;
 
     clearImage();
@@ -224,6 +445,43 @@ void DrawArea::OnPenSizeConfig(int value)
     penTool->setWidth(value);
 }
 
+/**
+ * @brief DrawArea::OnPenHardnessConfig - Update how soft the pen's edge is
+ *
+ */
+void DrawArea::OnPenHardnessConfig(int value)
+{
+    penTool->getBrush().setHardness(value);
+}
+
+/**
+ * @brief DrawArea::OnPenSpacingConfig - Update the distance between dabs
+ *
+ */
+void DrawArea::OnPenSpacingConfig(int value)
+{
+    penTool->getBrush().setSpacing(value);
+}
+
+/**
+ * @brief DrawArea::OnPenOpacityConfig - Update pen opacity
+ *
+ */
+void DrawArea::OnPenOpacityConfig(int value)
+{
+    penTool->getBrush().setOpacity(value);
+}
+
+/**
+ * @brief DrawArea::OnPenBlendConfig - Update how the pen's color goes onto
+ *                                     the canvas
+ *
+ */
+void DrawArea::OnPenBlendConfig(int blendMode)
+{
+    penTool->getBrush().setBlendMode(BlendMode(blendMode));
+}
+
 /**
  * @brief DrawArea::OnEraserConfig - Update eraser thickness
  *
@@ -233,6 +491,35 @@ void DrawArea::OnEraserConfig(int value)
     eraserTool->setWidth(value);
 }
 
+/**
+ * @brief DrawArea::OnEraserHardnessConfig - Update how soft the eraser's
+ *                                           edge is
+ *
+ */
+void DrawArea::OnEraserHardnessConfig(int value)
+{
+    eraserTool->getBrush().setHardness(value);
+}
+
+/**
+ * @brief DrawArea::OnEraserOpacityConfig - Update eraser strength
+ *
+ */
+void DrawArea::OnEraserOpacityConfig(int value)
+{
+    eraserTool->getBrush().setOpacity(value);
+}
+
+/**
+ * @brief DrawArea::OnEraserModeConfig - Paint the background color, or
+ *                                       erase to transparency
+ *
+ */
+void DrawArea::OnEraserModeConfig(int eraseMode)
+{
+    eraserTool->getBrush().setBlendMode(BlendMode(eraseMode));
+}
+
 /**
  * @brief DrawArea::OnLineStyleConfig - Update line style for line tool
  *
@@ -371,6 +658,129 @@ void DrawArea::OnRectCurveConfig(int value)
     rectTool->setCurve(value);
 }
 
+/**
+ * @brief DrawArea::OnBucketToleranceConfig - Update how close a color has
+ *                                            to be to the clicked one to
+ *                                            be filled
+ *
+ */
+void DrawArea::OnBucketToleranceConfig(int value)
+{
+    bucketTool->setTolerance(value);
+}
+
+/**
+ * @brief DrawArea::OnAddLayer - Add a transparent layer over the current
+ *                               one and paint on it
+ *
+ */
+void DrawArea::OnAddLayer()
+{
+    if(drawing || canvas->isNull())
+        return;
+
+    LayerStack::State before = layers->state();
+    layers->insert(layers->currentIndex(), tr("Layer %1").arg(layers->count()));
+    layerSwitched();
+    history->push(new LayerCommand(before, layers));
+}
+
+/**
+ * @brief DrawArea::OnRemoveLayer - Remove the current layer, the one under
+ *                                  it becomes the current one
+ *
+ */
+void DrawArea::OnRemoveLayer()
+{
+    if(drawing || layers->count() < 2)
+        return;
+
+    LayerStack::State before = layers->state();
+    layers->remove(layers->currentIndex());
+    layerSwitched();
+
+    // undo puts the layer back, it lives on in the command till then
+    history->push(new LayerCommand(before, layers));
+}
+
+/**
+ * @brief DrawArea::OnRaiseLayer - Move the current layer one up
+ *
+ */
+void DrawArea::OnRaiseLayer()
+{
+    if(drawing || layers->currentIndex() + 1 >= layers->count())
+        return;
+
+    layers->move(layers->currentIndex(), layers->currentIndex() + 1);
+    viewport()->update();
+    emit layersChanged();
+}
+
+/**
+ * @brief DrawArea::OnLowerLayer - Move the current layer one down
+ *
+ */
+void DrawArea::OnLowerLayer()
+{
+    if(drawing || layers->currentIndex() == 0)
+        return;
+
+    layers->move(layers->currentIndex(), layers->currentIndex() - 1);
+    viewport()->update();
+    emit layersChanged();
+}
+
+/**
+ * @brief DrawArea::OnCurrentLayer - Paint on another layer
+ *
+ */
+void DrawArea::OnCurrentLayer(int index)
+{
+    if(drawing || index == layers->currentIndex())
+        return;
+
+    layers->setCurrent(index);
+    layerSwitched();
+}
+
+/**
+ * @brief DrawArea::OnLayerOpacityConfig - Update the current layer's opacity
+ *
+ */
+void DrawArea::OnLayerOpacityConfig(int value)
+{
+    layers->setOpacity(layers->currentIndex(), value);
+    viewport()->update();
+    emit layersChanged();
+}
+
+/**
+ * @brief DrawArea::OnLayerModeConfig - Update how the current layer blends
+ *                                      with the ones under it
+ *
+ */
+void DrawArea::OnLayerModeConfig(int mode)
+{
+    layers->setMode(layers->currentIndex(), BlendMode(mode));
+    viewport()->update();
+    emit layersChanged();
+}
+
+/**
+ * @brief DrawArea::OnLayerVisibility - Show or hide a layer
+ *
+ */
+void DrawArea::OnLayerVisibility(int index, bool visible)
+{
+    if(index < 0 || index >= layers->count())
+        return;
+
+    layers->setVisible(index, visible);
+    viewport()->update();
+    emit layersChanged();
+}
+
 /**
  * @brief DrawArea::createNewImage - creates a new image of
  *                                   user-specified dimensions
@@ -378,17 +788,14 @@ void DrawArea::OnRectCurveConfig(int value)
  */
 void DrawArea::createNewImage(const QSize &size)
 {
-    // save a copy of the old image
-    oldImage = image->copy();
-
-    *image = QPixmap(size);
-    image->fill(backgroundColor);
-    update();
-    setBackgroundBrush(QBrush(Qt::white));
-
-    // for undo/redo
-    if(!imagesEqual(oldImage, *image))
-        saveDrawCommand(oldImage);
+    // a new image has one layer, one color, no tile has pixels yet
+    // however big it is
+    LayerStack::State before = layers->state();
+    layers->reset(Canvas(size, backgroundColor));
+    layerSwitched();
+
+    // for undo/redo, the old layers live on in the command
+    history->push(new LayerCommand(before, layers));
 }
 
 /**
@@ -397,15 +804,17 @@ void DrawArea::createNewImage(const QSize &size)
  */
 void DrawArea::loadImage(const QString &fileName)
 {
-    // save a copy of the old image
-    oldImage = image->copy();
+    QImage loaded(fileName);
+    if(loaded.isNull())
+        return;
 
-    image->load(fileName);
-    update();
+    // a loaded image has one layer
+    LayerStack::State before = layers->state();
+    layers->reset(Canvas(toCanvasFormat(loaded)));
+    layerSwitched();
 
-    // for undo/redo
-    if(!imagesEqual(oldImage, *image))
-        saveDrawCommand(oldImage);
+    // for undo/redo, the old layers live on in the command
+    history->push(new LayerCommand(before, layers));
 }
 
 /**
@@ -414,7 +823,7 @@ void DrawArea::loadImage(const QString &fileName)
  */
 void DrawArea::saveImage(const QString &fileName, const QString format)
 {
-    image->save(fileName, format.toStdString().c_str());
+    layers->toImage().save(fileName, format.toStdString().c_str());
 }
 
 /**
@@ -423,21 +832,32 @@ void DrawArea::saveImage(const QString &fileName, const QString format)
  */
 void DrawArea::resizeImage(const QSize &size)
 {
-    // save a copy of the old image
-    oldImage = image->copy();
-
     // if no change, do nothing
-    if(image->size() == size)
+    if(canvas->size() == size)
     {
         return;
     }
 
-    // else re-scale the image
-    *image = image->scaled(size, Qt::IgnoreAspectRatio);
-    update();
+    // else re-scale every layer, one command with a child per layer
+    // undoes them all at once
+    DrawCommand *command = nullptr;
+    for(int i = 0; i < layers->count(); ++i)
+    {
+        // keep the old canvas, it is replaced rather than painted on
+        Canvas *layerCanvas = &layers->layer(i)->canvas;
+        Canvas oldCanvas = *layerCanvas;
+
+        QImage scaled = layerCanvas->toImage().scaled(size, Qt::IgnoreAspectRatio);
+        *layerCanvas = Canvas(toCanvasFormat(scaled));
+
+        DrawCommand *layerCommand = new DrawCommand(oldCanvas, layerCanvas, QRect(), command);
+        if(!command)
+            command = layerCommand;
+    }
+    canvasChanged();
 
     // for undo/redo
-    saveDrawCommand(oldImage);
+    history->push(command);
 }
 
 /**
@@ -447,15 +867,79 @@ void DrawArea::resizeImage(const QSize &size)
  */
 void DrawArea::clearImage()
 {
-    // save a copy of the old image
-    oldImage = image->copy();
+    // keep the old canvas, filling replaces every tile with one color
+    Canvas oldCanvas = *canvas;
 
-    image->fill(backgroundColor);
-    update(image->rect());
+    // only the bottom layer is the background, the others clear to
+    // transparent
+    canvas->fill(layers->currentIndex() == 0 ? backgroundColor : QColor(Qt::transparent));
+    layers->changed(layers->currentIndex(), canvas->rect());
+    viewport()->update();
 
-    // for undo/redo
-    if(!imagesEqual(oldImage, *image))
-        saveDrawCommand(oldImage);
+    // for undo/redo, dropped again if nothing changed
+    saveDrawCommand(oldCanvas);
+}
+
+/**
+ * @brief DrawArea::applyFilter - Filter the current layer on every core.
+ *                                Only the tiles that came out different
+ *                                go into the undo history.
+ *
+ */
+void DrawArea::applyFilter(FilterType type, int radius, int amount)
+{
+    Filter filter(type, radius, amount);
+
+    canvas->beginEdit();
+    updateCanvas(filter.apply(canvas, canvas->rect()));
+
+    // for undo/redo, dropped again if nothing changed
+    saveDrawCommand(canvas->endEdit());
+}
+
+/**
+ * @brief DrawArea::previewFilter - Show the filter on the current layer in
+ *                                  place of its pixels. Only the tiles in
+ *                                  view are filtered, in the background,
+ *                                  and a call with new settings drops
+ *                                  whatever the last one has left to do.
+ *
+ */
+void DrawArea::previewFilter(FilterType type, int radius, int amount)
+{
+    if(!filterPreview)
+    {
+        filterPreview = new FilterPreview(this);
+        connect(filterPreview, &FilterPreview::updated, this, &DrawArea::OnFilterPreviewUpdated);
+    }
+
+    filterPreview->setFilter(*canvas, type, radius, amount);
+    filterPreview->request(visibleArea());
+}
+
+/**
+ * @brief DrawArea::endFilterPreview - Show the current layer as it is again
+ *
+ */
+void DrawArea::endFilterPreview()
+{
+    if(!filterPreview)
+        return;
+
+    layers->setPreview(nullptr);
+    delete filterPreview;
+    filterPreview = nullptr;
+    viewport()->update();
+}
+
+/**
+ * @brief DrawArea::OnFilterPreviewUpdated - Show the preview's new tiles
+ *
+ */
+void DrawArea::OnFilterPreviewUpdated(const QRect &area)
+{
+    layers->setPreview(&filterPreview->result());
+    updateCanvas(area);
 }
 
 /**
@@ -471,6 +955,7 @@ void DrawArea::updateColorConfig(const QColor &color, int which)
          penTool->setColor(foregroundColor);
          lineTool->setColor(foregroundColor);
          rectTool->setColor(foregroundColor);
+         bucketTool->setColor(foregroundColor);
 
          if(rectTool->getFillMode() == foreground)
              rectTool->setFillColor(foregroundColor);
@@ -508,11 +993,53 @@ Tool* DrawArea::setCurrentTool(int newType)
         case line: currentTool = lineTool;      break;
         case eraser: currentTool = eraserTool;  break;
         case rect_tool: currentTool = rectTool; break;
+        case bucket: currentTool = bucketTool;  break;
         default:                                break;
     }
     return currentTool;
 }
 
+/**
+ * @brief DrawArea::setThreadedStrokes - Turn rasterizing pen/eraser strokes
+ *                                       on a worker thread on or off
+ *
+ */
+void DrawArea::setThreadedStrokes(bool enabled)
+{
+    if(enabled == threadedStrokes() || drawing)
+        return;
+
+    if(!enabled)
+    {
+        delete strokeWorker;
+        strokeWorker = nullptr;
+        return;
+    }
+
+    strokeWorker = new StrokeWorker(canvas);
+    connect(strokeWorker, &StrokeWorker::damaged, this, &DrawArea::updateCanvas);
+}
+
+/**
+ * @brief DrawArea::setCanvasBudget - Run the canvas out of core once its
+ *                                    tiles take more than bytes of RAM,
+ *                                    or keep them all in RAM for 0
+ *
+ */
+void DrawArea::setCanvasBudget(qint64 bytes)
+{
+    canvasBudget = qMax(qint64(0), bytes);
+    if(canvasBudget == 0)
+        tileSwap.clear();
+    else if(!tileSwap)
+        tileSwap = QSharedPointer<TileSwap>(new TileSwap);
+
+    // the stroke worker may be drawing right now
+    QMutexLocker locker(strokeWorker ? strokeWorker->canvasLock() : nullptr);
+    for(int i = 0; i < layers->count(); ++i)
+        layers->layer(i)->canvas.setSwap(tileSwap, canvasBudget);
+}
+
 /**
  * @brief DrawArea::setLineMode - Sets the current line draw mode,
  *                                unsetting poly mode if necessary
@@ -531,11 +1058,131 @@ void DrawArea::setLineMode(const DrawType mode)
  *                                  and save it on the undo/redo stack.
  *
  */
-void DrawArea::saveDrawCommand(const QPixmap &old_image)
+void DrawArea::saveDrawCommand(const Canvas &old_canvas, const QRect &dirty)
+{
+    // put the changed tiles on the stack for undo/redo
+    DrawCommand *drawCommand = new DrawCommand(old_canvas, canvas, dirty);
+    if(drawCommand->isEmpty())
+    {
+        delete drawCommand;
+        return;
+    }
+    history->push(drawCommand);
+}
+
+/**
+ * @brief DrawArea::saveDrawCommand - Save the tiles an edit touched on
+ *                                    the undo/redo stack, if any changed
+ *
+ */
+void DrawArea::saveDrawCommand(const QHash<int, Tile> &before)
+{
+    if(before.isEmpty())
+        return;
+
+    DrawCommand *drawCommand = new DrawCommand(before, canvas);
+    if(drawCommand->isEmpty())
+    {
+        delete drawCommand;
+        return;
+    }
+    history->push(drawCommand);
+}
+
+/**
+ * @brief DrawArea::drawReplayed - Draw the line/rect and save it as the
+ *                                 operation, snapshotting the canvas first
+ *                                 only if a new keyframe is due
+ *
+ */
+void DrawArea::drawReplayed(const QPoint &endPoint)
 {
-    // put the old and new image on the stack for undo/redo
-    QUndoCommand *drawCommand = new DrawCommand(old_image, image);
-    undoStack->push(drawCommand);
+    ToolOp op = ToolOp::record(*currentTool, endPoint);
+    DrawCommand *previous = history->currentCommand();
+
+    // nothing was drawn since the press, the operation stands for the edit
+    canvas->endEdit();
+
+    Canvas before;
+    if(!ReplayCommand::continues(previous, canvas))
+        before = *canvas;
+
+    QRect dirty = op.drawTo(canvas) & canvas->rect();
+    updateCanvas(dirty);
+    if(dirty.isEmpty())
+        return;
+    history->push(new ReplayCommand(op, dirty, before, previous, canvas));
+}
+
+/**
+ * @brief DrawArea::updatePreview - Move the overlay to the current tool's
+ *                                  shape and repaint where it was and is
+ *
+ */
+void DrawArea::updatePreview(const QPoint &endPoint)
+{
+    QRect old = preview->isVisible() ? previewDamage : QRect();
+
+    preview->setPen(static_cast<QPen>(*currentTool));
+    preview->setBrush(currentTool->fillBrush());
+    preview->setPath(currentTool->outline(endPoint));
+    preview->setVisible(true);
+
+    // the old and the new shape as a region, so two far apart shapes
+    // don't repaint everything between them
+    previewDamage = currentTool->bounds(endPoint);
+    QRegion damage(old);
+    damage += previewDamage;
+    viewport()->update(damage.translated(-canvasOffset()));
+}
+
+/**
+ * @brief DrawArea::canvasChanged - the scene covers exactly the canvas,
+ *                                  so the scroll bars match its size.
+ *                                  Any layer may have changed anywhere.
+ *
+ */
+void DrawArea::canvasChanged()
+{
+    for(int i = 0; i < layers->count(); ++i)
+    {
+        Canvas &layerCanvas = layers->layer(i)->canvas;
+        if(layerCanvas.swap() != tileSwap)
+            layerCanvas.setSwap(tileSwap, canvasBudget);
+    }
+
+    layers->changedAll();
+    szene.setSceneRect(canvas->rect());
+    viewport()->update();
+}
+
+/**
+ * @brief DrawArea::layerSwitched - point the tools and the stroke worker
+ *                                  at the current layer's canvas
+ *
+ */
+void DrawArea::layerSwitched()
+{
+    canvas = &layers->current()->canvas;
+    if(strokeWorker)
+        strokeWorker->setCanvas(canvas);
+
+    canvasChanged();
+    emit layersChanged();
+}
+
+/**
+ * @brief DrawArea::toCanvasFormat - Bring an image into CANVAS_FORMAT,
+ *                                   counting it if that took a conversion
+ *
+ */
+QImage DrawArea::toCanvasFormat(const QImage &source)
+{
+    if(source.format() == CANVAS_FORMAT)
+        return source;
+
+    Canvas::countConversion();
+    return source.convertToFormat(CANVAS_FORMAT);
 }
 
 /**
@@ -549,16 +1196,8 @@ void DrawArea::createTools()
     lineTool = new LineTool(QBrush(Qt::black), DEFAULT_PEN_THICKNESS);
     eraserTool = new EraserTool(QBrush(Qt::white), DEFAULT_ERASER_THICKNESS);
     rectTool = new RectTool(QBrush(Qt::black), DEFAULT_PEN_THICKNESS);
+    bucketTool = new BucketTool(QBrush(Qt::black));
 
     // set default tool
     currentTool = static_cast<Tool*>(penTool);
 }
-
-/**
- * @brief imagesEqual - returns true if the two images are the same
- *
- */
-bool imagesEqual(const QPixmap &image1, const QPixmap &image2)
-{
-    return image1.toImage() == image2.toImage();
-}
@@ -1,13 +1,18 @@
 #ifndef DRAW_AREA_H
 #define DRAW_AREA_H
 
-#include <QUndoStack>
 #include <QGraphicsView>
 #include <QGraphicsScene>
+#include <QGraphicsPathItem>
+#include <QTimer>
 
 
 #include "constants.h"
+#include "commands.h"
 #include "tool.h"
+#include "stroke_worker.h"
+#include "layers.h"
+#include "filter.h"
 
 
 class DrawArea : public QGraphicsView
@@ -18,7 +23,10 @@ public:
     DrawArea(QWidget *parent);
     ~DrawArea();
 
-    QPixmap* getImage() { return image; }
+    /** the current layer's canvas, the one tools paint on */
+    Canvas* getCanvas() { return canvas; }
+    LayerStack* getLayers() const { return layers; }
+    UndoHistory* getHistory() const { return history; }
     Tool* getCurrentTool() const { return currentTool; }
     QColor getForegroundColor() { return foregroundColor; }
     QColor getBackgroundColor() { return backgroundColor; }
@@ -26,29 +34,83 @@ public:
     Tool* setCurrentTool(int);
     void setLineMode(const DrawType mode);
 
+    /** page canvas tiles out to a scratch file beyond this many bytes,
+     *  0 keeps them all in RAM */
+    void setCanvasBudget(qint64);
+    qint64 getCanvasBudget() const { return canvasBudget; }
+    QSharedPointer<TileSwap> getTileSwap() const { return tileSwap; }
+
+    /** keep lines and shapes in the history as operations to replay
+     *  instead of as tiles */
+    void setReplayOperations(bool enabled) { replayOperations = enabled; }
+    bool getReplayOperations() const { return replayOperations; }
+
+    /** fill regions too big for the GUI thread on every core */
+    void setParallelFill(bool enabled) { bucketTool->setParallel(enabled); }
+    bool getParallelFill() const { return bucketTool->isParallel(); }
+
+    /** draw pen/eraser strokes on a worker thread */
+    void setThreadedStrokes(bool);
+    bool threadedStrokes() const { return strokeWorker != nullptr; }
+
     /** image edit functions */
     void createNewImage(const QSize&);
     void loadImage(const QString&);
     void saveImage(const QString& filename, const QString format="PNG");
     void resizeImage(const QSize&);
     void clearImage();
+    /** run a filter over the current layer, one undo step */
+    void applyFilter(FilterType, int radius, int amount = DEFAULT_SHARPEN_AMOUNT);
+
+    /** show a filter on the current layer without applying it, only
+     *  where it is in view. Each call cancels what is left of the last. */
+    void previewFilter(FilterType, int radius, int amount = DEFAULT_SHARPEN_AMOUNT);
+    void endFilterPreview();
     void updateColorConfig(const QColor&, int);
 
-    /** save a command to the undo stack */
-    void saveDrawCommand(const QPixmap&);
+    /** save a command to the undo stack, only looking at the dirty area */
+    void saveDrawCommand(const Canvas&, const QRect &dirty = QRect());
+    void saveDrawCommand(const QHash<int, Tile>&);
+
+    /** draw the current line/rect ending at a point, kept in the
+     *  history as a ReplayCommand */
+    void drawReplayed(const QPoint&);
+
+    /** pixel format conversions during the last stroke, in the tool
+     *  paints, the blits to the screen and the undo diff */
+    int getStrokeConversions() const { return strokeConversions; }
+
+    /** tile buffers the last stroke had to take from the heap rather
+     *  than from the TilePool */
+    qint64 getStrokeAllocations() const { return strokeAllocations; }
+
+signals:
+    void strokeFinished(int conversions);
+
+    /** a layer was added, removed, moved, picked or changed */
+    void layersChanged();
 
 public slots:
     /** toolbar actions */
     void OnUndo();
     void OnRedo();
+    void OnOlderState();
+    void OnNewerState();
     void OnClearAll();
 
     /** pen tool */
     void OnPenCapConfig(int);
     void OnPenSizeConfig(int);
+    void OnPenHardnessConfig(int);
+    void OnPenSpacingConfig(int);
+    void OnPenOpacityConfig(int);
+    void OnPenBlendConfig(int);
 
     /** eraser tool */
     void OnEraserConfig(int);
+    void OnEraserHardnessConfig(int);
+    void OnEraserOpacityConfig(int);
+    void OnEraserModeConfig(int);
 
     /** line tool */
     void OnLineStyleConfig(int);
@@ -64,6 +126,30 @@ public slots:
     void OnRectLineConfig(int);
     void OnRectCurveConfig(int);
 
+    /** bucket tool */
+    void OnBucketToleranceConfig(int);
+
+    /** layers, adding and removing them is kept in the undo history,
+     *  the rest isn't and survives undoing an add or remove */
+    void OnAddLayer();
+    void OnRemoveLayer();
+    void OnRaiseLayer();
+    void OnLowerLayer();
+    void OnCurrentLayer(int);
+    void OnLayerOpacityConfig(int);
+    void OnLayerModeConfig(int);
+    void OnLayerVisibility(int, bool);
+
+private slots:
+    /** draw what the pen buffered since the last frame */
+    void OnFrame();
+
+    /** repaint a rect given in canvas coordinates */
+    void updateCanvas(const QRect&);
+
+    /** more of the filter preview is ready */
+    void OnFilterPreviewUpdated(const QRect&);
+
 protected:
     /** mouse event handler */
     void virtual mousePressEvent(QMouseEvent *event) override;
@@ -74,19 +160,62 @@ protected:
     /** paint event handler */
     void virtual paintEvent(QPaintEvent *event) override;
 
+    /** scroll what is already on screen, only paint what scrolled in */
+    void virtual scrollContentsBy(int dx, int dy) override;
+
+    /** the filter preview follows what is in view */
+    void virtual resizeEvent(QResizeEvent *event) override;
+
 private:
     void createTools();
+    void updatePreview(const QPoint&);
+    QImage toCanvasFormat(const QImage&);
+
+    /** the canvas point shown at the viewport's top left */
+    QPoint canvasOffset() const { return mapToScene(0, 0).toPoint(); }
+
+    /** the part of the canvas in view */
+    QRect visibleArea() const;
 
-    /** undo stack */
-    QUndoStack* undoStack;
+    /** the canvas was replaced or resized, fit the scroll area to it */
+    void canvasChanged();
+
+    /** tools paint on the current layer, follow it */
+    void layerSwitched();
+
+    /** undo history */
+    UndoHistory* history;
+    bool replayOperations;
 
     /** reference to current tool & line mode */
     Tool* currentTool;
     DrawType currentLineMode;
 
-    /** reference to image */
-    QPixmap* image;
-    QPixmap oldImage;
+    /** the layers and their cached composite, and the tiled image of
+     *  the current layer being drawn on */
+    LayerStack* layers;
+    Canvas* canvas;
+
+    /** set while the canvas runs out of core */
+    QSharedPointer<TileSwap> tileSwap;
+    qint64 canvasBudget;
+
+    /** fires once per display frame while the pen is down */
+    QTimer frameTimer;
+
+    /** set in threaded mode, then it draws pen strokes instead */
+    StrokeWorker* strokeWorker;
+
+    /** set while a filter is previewed, layers show its result */
+    FilterPreview* filterPreview;
+
+    /** Canvas::conversions, at mouse press and then for the stroke */
+    int conversionsBefore;
+    int strokeConversions;
+
+    /** TilePool heap allocations, at mouse press and then for the stroke */
+    qint64 allocationsBefore;
+    qint64 strokeAllocations;
 
     /** background/foreground color */
     QColor foregroundColor;
@@ -97,6 +226,7 @@ private:
     LineTool* lineTool;
     EraserTool* eraserTool;
     RectTool* rectTool;
+    BucketTool* bucketTool;
 
     /** state variables */
     bool drawing;
@@ -108,9 +238,10 @@ private:
 
     /** Scene for draw rect, line, etc */
     QGraphicsScene szene;
-};
 
-/** defined in draw_area.cpp */
-extern bool imagesEqual(const QPixmap& image1, const QPixmap& image2);
+    /** overlay showing the line/rect until the mouse is released */
+    QGraphicsPathItem* preview;
+    QRect previewDamage;
+};
 
 #endif // DRAW_AREA_H
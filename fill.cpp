@@ -0,0 +1,656 @@
+#include <cstring>
+#include <QRunnable>
+
+#include "fill.h"
+#include "constants.h"
+#include "tile_pool.h"
+
+
+namespace {
+
+/** the color over every marked pixel of a tile's image */
+void writeMarked(QImage &image, const quint8 *done, uint pixel)
+{
+    for(int y = 0; y < image.height(); ++y)
+    {
+        const quint8 *marks = done + y * TILE_SIZE;
+        uint *dst = reinterpret_cast<uint*>(image.scanLine(y));
+        for(int x = 0; x < image.width(); ++x)
+        {
+            if(marks[x])
+                dst[x] = pixel;
+        }
+    }
+}
+
+/** one step of a ParallelFill for one band, on the pool */
+template<typename Step>
+class BandJob : public QRunnable
+{
+public:
+    BandJob(Step step, int band) : step(step), band(band) {}
+
+    void run() override { step(band); }
+
+private:
+    Step step;
+    int band;
+};
+
+} // namespace
+
+
+FloodFill::FloodFill(Canvas *canvas, uint tolerance, Compositor::Path path)
+{
+    this->canvas = canvas;
+    this->tolerance = qMin(tolerance, 255u);
+    seedColor = 0;
+    matchRun = Compositor::matchRun(path);
+    matchRunBack = Compositor::matchRunBack(path);
+    filled = 0;
+    limit = 0;
+}
+
+/**
+ * @brief FloodFill::fill - Pop a seed, grow it to the whole span of its
+ *                          row, and push the runs of fillable pixels
+ *                          right above and below the span as new seeds.
+ *                          Then paint every pixel marked on the way.
+ */
+QRect FloodFill::fill(const QPoint &seed, const QColor &color)
+{
+    tiles.clear();
+    touched.clear();
+    dirty = QRect();
+    filled = 0;
+    if(!canvas->rect().contains(seed))
+        return QRect();
+
+    tiles.resize(canvas->columns() * canvas->rows());
+    FillTile &first = tileAt(seed.x(), seed.y());
+    seedColor = first.uniform ? first.color
+        : reinterpret_cast<const uint*>(first.image.constScanLine(seed.y() % TILE_SIZE))[seed.x() % TILE_SIZE];
+
+    const uint pixel = qPremultiply(color.rgba());
+    if(tolerance == 0 && seedColor == pixel)
+        return QRect();
+
+    const int lastColumn = canvas->width() - 1;
+    seeds.clear();
+    findSeeds(seed.x(), seed.x(), seed.y(), -1, 0, -1);
+    while(!seeds.isEmpty())
+    {
+        const Seed at = seeds.takeLast();
+        int right = at.x + spanRight(at.x, at.y, lastColumn, true) - 1;
+        if(right < at.x)
+            continue; // reached from another side meanwhile
+        int left = at.x - spanLeft(at.x, at.y);
+        mark(left, right, at.y);
+        if(overLimit())
+            return QRect();
+
+        // the row it came from only needs looking at past that span
+        for(int y = at.y - 1; y <= at.y + 1; y += 2)
+        {
+            if(y < 0 || y >= canvas->height())
+                continue;
+            if(y != at.fromY)
+            {
+                findSeeds(left, right, y, at.y, left, right);
+            }
+            else
+            {
+                findSeeds(left, qMin(right, at.fromLeft - 1), y, at.y, left, right);
+                findSeeds(qMax(left, at.fromRight + 1), right, y, at.y, left, right);
+            }
+        }
+    }
+
+    paint(pixel);
+    return dirty;
+}
+
+void FloodFill::findSeeds(int left, int right, int y, int fromY, int fromLeft, int fromRight)
+{
+    int x = left;
+    while(x <= right)
+    {
+        int count = spanRight(x, y, right, true);
+        if(count > 0)
+        {
+            Seed next = {x, y, fromY, fromLeft, fromRight};
+            seeds.append(next);
+        }
+        x += count;
+        x += spanRight(x, y, right, false);
+    }
+}
+
+/**
+ * @brief FloodFill::tileAt - The tile holding a pixel, looked at the first
+ *                            time the fill gets to it. A paged out tile
+ *                            is read from swap but not paged in.
+ */
+FloodFill::FillTile& FloodFill::tileAt(int x, int y)
+{
+    const int column = x / TILE_SIZE;
+    const int row = y / TILE_SIZE;
+    FillTile &tile = tiles[row * canvas->columns() + column];
+    if(!tile.ready)
+    {
+        const Tile &source = canvas->tileAt(column, row);
+        tile.ready = true;
+        tile.uniform = source.isUniform();
+        tile.color = source.color;
+        if(!tile.uniform)
+            tile.image = source.pixels();
+    }
+    return tile;
+}
+
+bool FloodFill::fillable(uint pixel) const
+{
+    return Compositor::matches(pixel, seedColor, tolerance);
+}
+
+/**
+ * @brief FloodFill::run - The run at x, cut short where the marks change.
+ *                         Marked pixels never count as fillable.
+ */
+int FloodFill::run(int x, int y, int count, bool &isFillable)
+{
+    FillTile &tile = tileAt(x, y);
+    const int tileX = x % TILE_SIZE;
+    const int tileY = y % TILE_SIZE;
+    const quint8 *done = tile.done.isEmpty() ? nullptr
+                       : tile.done.constData() + tileY * TILE_SIZE + tileX;
+
+    if(done && done[0])
+    {
+        isFillable = false;
+        const void *open = memchr(done, 0, size_t(count));
+        return open ? int(static_cast<const quint8*>(open) - done) : count;
+    }
+
+    int length = count;
+    if(tile.uniform)
+    {
+        isFillable = fillable(tile.color);
+    }
+    else
+    {
+        const uint *pixels = reinterpret_cast<const uint*>(tile.image.constScanLine(tileY)) + tileX;
+        isFillable = fillable(pixels[0]);
+        length = matchRun(pixels, count, seedColor, tolerance, isFillable);
+    }
+
+    if(isFillable && done)
+    {
+        const void *closed = memchr(done, 1, size_t(length));
+        if(closed)
+            length = int(static_cast<const quint8*>(closed) - done);
+    }
+    return length;
+}
+
+int FloodFill::spanRight(int x, int y, int limit, bool isFillable)
+{
+    const int start = x;
+    while(x <= limit)
+    {
+        const int tileEnd = qMin(limit, (x / TILE_SIZE + 1) * TILE_SIZE - 1);
+        bool is;
+        int length = run(x, y, tileEnd - x + 1, is);
+        if(is != isFillable)
+            break;
+        x += length;
+    }
+    return x - start;
+}
+
+int FloodFill::spanLeft(int x, int y)
+{
+    const int end = x;
+    while(x > 0)
+    {
+        FillTile &tile = tileAt(x - 1, y);
+        const int tileStart = (x - 1) / TILE_SIZE * TILE_SIZE;
+        const int tileY = y % TILE_SIZE;
+        const int count = x - tileStart;
+
+        int length;
+        if(tile.uniform)
+            length = fillable(tile.color) ? count : 0;
+        else
+            length = matchRunBack(reinterpret_cast<const uint*>(tile.image.constScanLine(tileY)) + count,
+                                  count, seedColor, tolerance);
+
+        if(!tile.done.isEmpty())
+        {
+            const quint8 *done = tile.done.constData() + tileY * TILE_SIZE + count;
+            for(int i = 0; i < length; ++i)
+            {
+                if(done[-1 - i])
+                {
+                    length = i;
+                    break;
+                }
+            }
+        }
+
+        x -= length;
+        if(length < count)
+            break;
+    }
+    return end - x;
+}
+
+/**
+ * @brief FloodFill::mark - Mark a span of a row as filled
+ */
+void FloodFill::mark(int left, int right, int y)
+{
+    for(int x = left; x <= right;)
+    {
+        FillTile &tile = tileAt(x, y);
+        if(tile.done.isEmpty())
+        {
+            tile.done.fill(0, TILE_SIZE * TILE_SIZE);
+            touched.append(y / TILE_SIZE * canvas->columns() + x / TILE_SIZE);
+        }
+        const int tileEnd = qMin(right, (x / TILE_SIZE + 1) * TILE_SIZE - 1);
+        const int length = tileEnd - x + 1;
+        memset(tile.done.data() + y % TILE_SIZE * TILE_SIZE + x % TILE_SIZE, 1, size_t(length));
+        tile.count += length;
+        x += length;
+    }
+
+    filled += right - left + 1;
+    dirty |= QRect(left, y, right - left + 1, 1);
+}
+
+/**
+ * @brief FloodFill::paint - Write the color over the marked pixels, a
+ *                           tile marked all over just becomes uniform
+ */
+void FloodFill::paint(uint pixel)
+{
+    foreach(int index, touched)
+    {
+        const int column = index % canvas->columns();
+        const int row = index / canvas->columns();
+        const QRect bounds = canvas->tileRect(column, row);
+        const FillTile &tile = tiles.at(index);
+
+        if(tile.count == bounds.width() * bounds.height())
+        {
+            Tile uniform;
+            uniform.color = pixel;
+            canvas->replaceTile(column, row, uniform);
+            continue;
+        }
+
+        canvas->paintPixels(bounds, [&](QImage &image, const QRect&) {
+            writeMarked(image, tile.done.constData(), pixel);
+        });
+    }
+}
+
+ParallelFill::ParallelFill(Canvas *canvas, uint tolerance, int threads,
+                           Compositor::Path path)
+{
+    this->canvas = canvas;
+    this->tolerance = qMin(tolerance, 255u);
+    this->threads = qMax(1, threads);
+    seedColor = 0;
+    pixel = 0;
+    matchRun = Compositor::matchRun(path);
+    seedRoot = -1;
+    filled = 0;
+    pool.setMaxThreadCount(this->threads);
+}
+
+/**
+ * @brief ParallelFill::forEachBand - Run a step on every band, each on a
+ *                                    thread of the pool
+ */
+template<typename Step>
+void ParallelFill::forEachBand(Step step)
+{
+    if(threads == 1)
+    {
+        for(int band = 0; band < bands.size(); ++band)
+            step(band);
+        return;
+    }
+
+    for(int band = 0; band < bands.size(); ++band)
+        pool.start(new BandJob<Step>(step, band));
+    pool.waitForDone();
+}
+
+/**
+ * @brief ParallelFill::fill - Find every band's runs, join them across
+ *                             the band borders, then paint the seed's
+ */
+QRect ParallelFill::fill(const QPoint &seed, const QColor &color)
+{
+    bands.clear();
+    links.clear();
+    seedRoot = -1;
+    filled = 0;
+    if(!canvas->rect().contains(seed))
+        return QRect();
+
+    const Tile &first = canvas->tileAt(seed.x() / TILE_SIZE, seed.y() / TILE_SIZE);
+    seedColor = first.isUniform() ? first.color
+        : reinterpret_cast<const uint*>(first.pixels().constScanLine(seed.y() % TILE_SIZE))[seed.x() % TILE_SIZE];
+    pixel = qPremultiply(color.rgba());
+    if(tolerance == 0 && seedColor == pixel)
+        return QRect();
+
+    // bands of whole tile rows, so no tile is painted by two bands
+    const int count = qMin(canvas->rows(), threads * PARALLEL_FILL_BANDS_PER_THREAD);
+    for(int i = 0; i < count; ++i)
+    {
+        Band band;
+        band.top = canvas->rows() * i / count * TILE_SIZE;
+        band.bottom = qMin(canvas->height(), canvas->rows() * (i + 1) / count * TILE_SIZE);
+        band.base = 0;
+        band.filled = 0;
+        bands.append(band);
+    }
+
+    Band *all = bands.data();
+    forEachBand([this, all](int band) { findRuns(all[band]); });
+
+    int base = 0;
+    for(int b = 0; b < bands.size(); ++b)
+    {
+        bands[b].base = base;
+        base += bands[b].runs.size();
+    }
+
+    // the last row of each band against the first row of the next
+    for(int b = 1; b < bands.size(); ++b)
+    {
+        const Band &above = bands.at(b - 1);
+        const Band &below = bands.at(b);
+        int i = above.rowStart.at(above.rowStart.size() - 2);
+        int j = 0;
+        const int aboveEnd = above.runs.size();
+        const int belowEnd = below.rowStart.at(1);
+        while(i < aboveEnd && j < belowEnd)
+        {
+            const Run &a = above.runs.at(i);
+            const Run &c = below.runs.at(j);
+            if(a.right < c.left)
+            {
+                ++i;
+            }
+            else if(c.right < a.left)
+            {
+                ++j;
+            }
+            else
+            {
+                join(above.base + above.parent.at(i), below.base + below.parent.at(j));
+                if(a.right < c.right)
+                    ++i;
+                else
+                    ++j;
+            }
+        }
+    }
+
+    // the run the seed is in, it is fillable so there is one
+    foreach(const Band &band, bands)
+    {
+        if(seed.y() < band.top || seed.y() >= band.bottom)
+            continue;
+        const int row = seed.y() - band.top;
+        for(int i = band.rowStart.at(row); i < band.rowStart.at(row + 1); ++i)
+        {
+            if(band.runs.at(i).left <= seed.x() && seed.x() <= band.runs.at(i).right)
+                seedRoot = root(band.base + band.parent.at(i));
+        }
+    }
+
+    all = bands.data();
+    forEachBand([this, all](int band) { paintBand(all[band]); });
+
+    QRect dirty;
+    foreach(const Band &band, bands)
+    {
+        typedef QPair<int, Tile> NewTile;
+        foreach(const NewTile &tile, band.tiles)
+            canvas->replaceTile(tile.first % canvas->columns(), tile.first / canvas->columns(), tile.second);
+        dirty |= band.dirty;
+        filled += band.filled;
+    }
+    bands.clear();
+    return dirty;
+}
+
+/**
+ * @brief ParallelFill::findRuns - Every run of the band, each joined to
+ *                                 the runs it touches in the row above.
+ *                                 Only reads the canvas, so the bands
+ *                                 all do this at once.
+ */
+void ParallelFill::findRuns(Band &band)
+{
+    QVector<QImage> images(canvas->columns());
+    for(int y = band.top; y < band.bottom; ++y)
+    {
+        // a paged out tile is read from swap once, not for every row
+        if(y % TILE_SIZE == 0)
+        {
+            for(int column = 0; column < canvas->columns(); ++column)
+                images[column] = canvas->tileAt(column, y / TILE_SIZE).pixels();
+        }
+
+        const int previous = band.rowStart.isEmpty() ? 0 : band.rowStart.last();
+        band.rowStart.append(band.runs.size());
+        findRowRuns(band, y, images);
+        for(int i = band.rowStart.last(); i < band.runs.size(); ++i)
+            band.parent.append(i);
+        if(y == band.top)
+            continue;
+
+        // union-find where a root is the smallest run of its set, so a
+        // run's parent never comes after it
+        QVector<int> &parent = band.parent;
+        int i = previous;
+        int j = band.rowStart.last();
+        const int current = j;
+        while(i < current && j < band.runs.size())
+        {
+            const Run &a = band.runs.at(i);
+            const Run &c = band.runs.at(j);
+            if(a.right < c.left)
+            {
+                ++i;
+                continue;
+            }
+            if(c.right < a.left)
+            {
+                ++j;
+                continue;
+            }
+
+            int ra = i;
+            while(parent.at(ra) != ra)
+                ra = parent[ra] = parent.at(parent.at(ra));
+            int rc = j;
+            while(parent.at(rc) != rc)
+                rc = parent[rc] = parent.at(parent.at(rc));
+            if(ra < rc)
+                parent[rc] = ra;
+            else
+                parent[ra] = rc;
+
+            if(a.right < c.right)
+                ++i;
+            else
+                ++j;
+        }
+    }
+    band.rowStart.append(band.runs.size());
+
+    // parents come first, so one pass points every run at its root
+    for(int i = 0; i < band.parent.size(); ++i)
+        band.parent[i] = band.parent.at(band.parent.at(i));
+}
+
+/**
+ * @brief ParallelFill::findRowRuns - The runs of one row, going over it
+ *                                    a tile at a time with the match
+ *                                    kernel, uniform tiles at once
+ */
+void ParallelFill::findRowRuns(Band &band, int y, const QVector<QImage> &images)
+{
+    int start = -1;
+    for(int column = 0; column < canvas->columns(); ++column)
+    {
+        const int left = column * TILE_SIZE;
+        const int width = qMin(TILE_SIZE, canvas->width() - left);
+        const QImage &image = images.at(column);
+
+        if(image.isNull())
+        {
+            const bool fillable = Compositor::matches(canvas->tileAt(column, y / TILE_SIZE).color,
+                                                      seedColor, tolerance);
+            if(fillable && start < 0)
+            {
+                start = left;
+            }
+            else if(!fillable && start >= 0)
+            {
+                Run run = {start, left - 1};
+                band.runs.append(run);
+                start = -1;
+            }
+            continue;
+        }
+
+        const uint *pixels = reinterpret_cast<const uint*>(image.constScanLine(y % TILE_SIZE));
+        for(int x = 0; x < width;)
+        {
+            const bool fillable = Compositor::matches(pixels[x], seedColor, tolerance);
+            if(fillable && start < 0)
+            {
+                start = left + x;
+            }
+            else if(!fillable && start >= 0)
+            {
+                Run run = {start, left + x - 1};
+                band.runs.append(run);
+                start = -1;
+            }
+            x += matchRun(pixels + x, width - x, seedColor, tolerance, fillable);
+        }
+    }
+
+    if(start >= 0)
+    {
+        Run run = {start, canvas->width() - 1};
+        band.runs.append(run);
+    }
+}
+
+/**
+ * @brief ParallelFill::paintBand - Mark the band's runs of the seed's
+ *                                  set, and make the new tiles for them.
+ *                                  Tiles are only made here, the canvas
+ *                                  takes them afterwards on its thread.
+ */
+void ParallelFill::paintBand(Band &band)
+{
+    // whether each band root belongs to the seed's set, -1 not looked up yet
+    QVector<qint8> inSeed(band.runs.size(), -1);
+
+    // marks and marked pixels of the band's tiles
+    const int firstTile = band.top / TILE_SIZE * canvas->columns();
+    const int tiles = (band.bottom - 1) / TILE_SIZE * canvas->columns() + canvas->columns() - firstTile;
+    QVector<QVector<quint8> > marks(tiles);
+    QVector<int> counts(tiles);
+
+    for(int y = band.top; y < band.bottom; ++y)
+    {
+        const int row = y - band.top;
+        for(int i = band.rowStart.at(row); i < band.rowStart.at(row + 1); ++i)
+        {
+            const int local = band.parent.at(i);
+            if(inSeed.at(local) < 0)
+                inSeed[local] = root(band.base + local) == seedRoot;
+            if(!inSeed.at(local))
+                continue;
+
+            const Run &run = band.runs.at(i);
+            for(int x = run.left; x <= run.right;)
+            {
+                const int index = y / TILE_SIZE * canvas->columns() + x / TILE_SIZE - firstTile;
+                QVector<quint8> &done = marks[index];
+                if(done.isEmpty())
+                    done.fill(0, TILE_SIZE * TILE_SIZE);
+                const int length = qMin(run.right, (x / TILE_SIZE + 1) * TILE_SIZE - 1) - x + 1;
+                memset(done.data() + y % TILE_SIZE * TILE_SIZE + x % TILE_SIZE, 1, size_t(length));
+                counts[index] += length;
+                x += length;
+            }
+            band.filled += run.right - run.left + 1;
+            band.dirty |= QRect(run.left, y, run.right - run.left + 1, 1);
+        }
+    }
+
+    for(int index = 0; index < tiles; ++index)
+    {
+        if(marks.at(index).isEmpty())
+            continue;
+        const int column = (firstTile + index) % canvas->columns();
+        const int row = (firstTile + index) / canvas->columns();
+        const QRect bounds = canvas->tileRect(column, row);
+        const Tile &source = canvas->tileAt(column, row);
+
+        Tile tile;
+        tile.color = pixel;
+        if(counts.at(index) < bounds.width() * bounds.height())
+        {
+            if(source.isUniform())
+            {
+                tile.image = TilePool::instance()->create(bounds.size());
+                tile.image.fill(source.color);
+            }
+            else
+            {
+                tile.image = TilePool::instance()->copy(source.pixels());
+            }
+            writeMarked(tile.image, marks.at(index).constData(), pixel);
+        }
+        band.tiles.append(qMakePair(firstTile + index, tile));
+    }
+}
+
+/**
+ * @brief ParallelFill::root - Follow the links between bands from a band
+ *                             root. Only read while the bands paint.
+ */
+int ParallelFill::root(int run) const
+{
+    QHash<int, int>::const_iterator link = links.constFind(run);
+    while(link != links.constEnd())
+    {
+        run = link.value();
+        link = links.constFind(run);
+    }
+    return run;
+}
+
+void ParallelFill::join(int a, int b)
+{
+    a = root(a);
+    b = root(b);
+    if(a != b)
+        links.insert(qMax(a, b), qMin(a, b));
+}
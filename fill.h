@@ -0,0 +1,187 @@
+#ifndef FILL_H
+#define FILL_H
+
+#include <QVector>
+#include <QPoint>
+#include <QRect>
+#include <QColor>
+#include <QThread>
+#include <QThreadPool>
+#include <QPair>
+
+#include "canvas.h"
+#include "compositor.h"
+
+
+/**
+ * Bucket fill: every pixel 4-connected to the seed that is within
+ * tolerance of the seed's color in each channel becomes one color.
+ * Works a span of a row at a time off a stack, never pixel by pixel,
+ * and finds the ends of each span with the Compositor's match kernels
+ * straight on the tiles. Tiles the fill covers completely become
+ * uniform tiles, so a huge fill costs no pixels at all.
+ */
+class FloodFill
+{
+public:
+    /** tolerance 0-255 per channel */
+    FloodFill(Canvas *canvas, uint tolerance,
+              Compositor::Path path = Compositor::bestPath());
+
+    /** fill from seed, returns the area painted */
+    QRect fill(const QPoint &seed, const QColor&);
+
+    /** pixels the last fill changed */
+    qint64 filledPixels() const { return filled; }
+
+    /** give up, painting nothing, once a fill reaches more than pixels,
+     *  0 for no limit */
+    void setLimit(qint64 pixels) { limit = pixels; }
+    bool overLimit() const { return limit > 0 && filled > limit; }
+
+private:
+    /** a tile as the fill found it, and which of its pixels are filled */
+    struct FillTile
+    {
+        FillTile() : ready(false), uniform(true), color(0), count(0) {}
+
+        bool ready;
+        bool uniform;
+        uint color;
+        QImage image;
+        /** one byte per pixel, empty until the fill reaches the tile */
+        QVector<quint8> done;
+        int count;
+    };
+
+    /** where to grow the next span from, and the span of the row next
+     *  to it that found it, no need to look there again */
+    struct Seed
+    {
+        int x;
+        int y;
+        int fromY;
+        int fromLeft;
+        int fromRight;
+    };
+
+    FillTile& tileAt(int x, int y);
+    bool fillable(uint pixel) const;
+
+    /** how many pixels from x on, within the tile and at most count,
+     *  all are or all aren't fillable, and which */
+    int run(int x, int y, int count, bool &isFillable);
+
+    /** how many pixels from x to at most limit are (or aren't) fillable */
+    int spanRight(int x, int y, int limit, bool isFillable);
+    /** how many fillable pixels there are left of x */
+    int spanLeft(int x, int y);
+
+    /** push a seed for each fillable run of row y within left-right */
+    void findSeeds(int left, int right, int y, int fromY, int fromLeft, int fromRight);
+
+    void mark(int left, int right, int y);
+    void paint(uint pixel);
+
+    Canvas *canvas;
+    uint tolerance;
+    uint seedColor;
+    Compositor::MatchRun matchRun;
+    Compositor::MatchRunBack matchRunBack;
+
+    QVector<FillTile> tiles;
+    QVector<Seed> seeds;
+    QVector<int> touched;
+    QRect dirty;
+    qint64 filled;
+    qint64 limit;
+
+    /** Don't allow copying */
+    FloodFill(const FloodFill&);
+    FloodFill& operator=(const FloodFill&);
+};
+
+/**
+ * Bucket fill for huge regions, on every core. The canvas is cut into
+ * bands of whole tile rows. All bands at once find their runs of
+ * fillable pixels and join the runs touching across rows with a
+ * union-find. Joining the runs that touch across band borders is then
+ * quick and serial. Last, all bands at once make new tiles where the
+ * runs joined to the seed's are, and the canvas swaps them in.
+ * Gives exactly the pixels FloodFill does, but reads the whole canvas
+ * however small the region is.
+ */
+class ParallelFill
+{
+public:
+    /** tolerance 0-255 per channel */
+    ParallelFill(Canvas *canvas, uint tolerance,
+                 int threads = QThread::idealThreadCount(),
+                 Compositor::Path path = Compositor::bestPath());
+
+    /** fill from seed, returns the area painted */
+    QRect fill(const QPoint &seed, const QColor&);
+
+    /** pixels the last fill changed */
+    qint64 filledPixels() const { return filled; }
+
+private:
+    /** fillable pixels left to right on a row, both ends included */
+    struct Run
+    {
+        int left;
+        int right;
+    };
+
+    /** the pixel rows from top up to bottom, and what was found there */
+    struct Band
+    {
+        int top;
+        int bottom;
+        QVector<Run> runs;
+        /** where each row's runs start, one more for the end */
+        QVector<int> rowStart;
+        /** union-find over the runs, each points at its band root */
+        QVector<int> parent;
+        /** the index of the first run counting all bands */
+        int base;
+
+        /** the new tiles, by index */
+        QVector<QPair<int, Tile> > tiles;
+        QRect dirty;
+        qint64 filled;
+    };
+
+    /** run step(band) for every band, on the pool */
+    template<typename Step>
+    void forEachBand(Step step);
+
+    void findRuns(Band&);
+    void findRowRuns(Band&, int y, const QVector<QImage> &images);
+    void paintBand(Band&);
+
+    /** join runs of different bands, by index counting all bands */
+    int root(int run) const;
+    void join(int a, int b);
+
+    Canvas *canvas;
+    uint tolerance;
+    uint seedColor;
+    uint pixel;
+    int threads;
+    Compositor::MatchRun matchRun;
+
+    QVector<Band> bands;
+    /** root to root links between bands' runs */
+    QHash<int, int> links;
+    int seedRoot;
+    qint64 filled;
+
+    QThreadPool pool;
+
+    /** Don't allow copying */
+    ParallelFill(const ParallelFill&);
+    ParallelFill& operator=(const ParallelFill&);
+};
+
+#endif // FILL_H
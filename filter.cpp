@@ -0,0 +1,562 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <QRunnable>
+
+#include "filter.h"
+#include "constants.h"
+#include "tile_pool.h"
+
+
+namespace {
+
+/** one batch of blocks of a Filter, on the pool */
+template<typename Step>
+class BatchJob : public QRunnable
+{
+public:
+    BatchJob(Step step, int batch) : step(step), batch(batch) {}
+
+    void run() override { step(batch); }
+
+private:
+    Step step;
+    int batch;
+};
+
+/** one channel of a pixel, shift 0 for blue up to 24 for alpha */
+inline int channel(uint pixel, int shift)
+{
+    return int((pixel >> shift) & 0xff);
+}
+
+} // namespace
+
+
+Filter::Filter(FilterType type, int radius, int amount, int threads,
+               Compositor::Path path)
+{
+    this->type = type;
+    this->radius = qBound(MIN_FILTER_RADIUS, radius, MAX_FILTER_RADIUS);
+    this->amount = qBound(0, amount, MAX_SHARPEN_AMOUNT);
+    this->threads = qMax(1, threads);
+    blurRow = Compositor::blurRow(path);
+    blurColumn = Compositor::blurColumn(path);
+    canvas = 0;
+    cancelled = 0;
+    pool.setMaxThreadCount(this->threads);
+
+    // the kernel ends at 3 sigma, past that the weights round to nothing
+    const double sigma = this->radius / 3.0;
+    QVector<double> curve(2 * this->radius + 1);
+    double total = 0;
+    for(int k = 0; k < curve.size(); ++k)
+    {
+        const double d = k - this->radius;
+        curve[k] = std::exp(-d * d / (2 * sigma * sigma));
+        total += curve[k];
+    }
+
+    weights.resize(curve.size());
+    int sum = 0;
+    for(int k = 0; k < curve.size(); ++k)
+    {
+        weights[k] = quint16(curve[k] / total * 32768 + 0.5);
+        sum += weights[k];
+    }
+    // the middle weight takes the rounding, so flat areas stay flat
+    weights[this->radius] += 32768 - sum;
+}
+
+/**
+ * @brief Filter::forEachBatch - Run a step on every batch, each on a
+ *                               thread of the pool
+ */
+template<typename Step>
+void Filter::forEachBatch(Step step)
+{
+    if(threads == 1)
+    {
+        for(int batch = 0; batch < batches.size(); ++batch)
+            step(batch);
+        return;
+    }
+
+    for(int batch = 0; batch < batches.size(); ++batch)
+        pool.start(new BatchJob<Step>(step, batch));
+    pool.waitForDone();
+}
+
+/**
+ * @brief Filter::apply - Filter the tiles area touches, then swap the new
+ *                        tiles in
+ */
+QRect Filter::apply(Canvas *canvas, const QRect &area)
+{
+    QRect dirty;
+    typedef QPair<int, Tile> NewTile;
+    foreach(const NewTile &tile, filterTiles(*canvas, area))
+    {
+        const int column = tile.first % canvas->columns();
+        const int row = tile.first / canvas->columns();
+        canvas->replaceTile(column, row, tile.second);
+        dirty |= canvas->tileRect(column, row);
+    }
+    return dirty;
+}
+
+/**
+ * @brief Filter::filterTiles - Cut the tiles area touches into blocks and
+ *                              filter them all on the pool. Pixels of those
+ *                              tiles outside area keep their color, tiles
+ *                              that come out the same are left out. Once
+ *                              cancelled, blocks not started are skipped
+ *                              and nothing is returned.
+ */
+QVector<QPair<int, Tile> > Filter::filterTiles(const Canvas &canvas, const QRect &area,
+                                               const QAtomicInt *cancelled)
+{
+    this->canvas = &canvas;
+    this->area = area & canvas.rect();
+    this->cancelled = cancelled;
+    batches.clear();
+
+    QVector<QPair<int, Tile> > tiles;
+    if(this->area.isEmpty())
+        return tiles;
+
+    QVector<QRect> blocks;
+    const int left = this->area.left() / FILTER_BLOCK_SIZE * FILTER_BLOCK_SIZE;
+    const int top = this->area.top() / FILTER_BLOCK_SIZE * FILTER_BLOCK_SIZE;
+    for(int y = top; y <= this->area.bottom(); y += FILTER_BLOCK_SIZE)
+    {
+        for(int x = left; x <= this->area.right(); x += FILTER_BLOCK_SIZE)
+        {
+            // only the tiles area touches, and only inside the canvas
+            QRect block = QRect(x, y, FILTER_BLOCK_SIZE, FILTER_BLOCK_SIZE) & canvas.rect();
+            QRect touched = block & this->area;
+            block.setLeft(touched.left() / TILE_SIZE * TILE_SIZE);
+            block.setTop(touched.top() / TILE_SIZE * TILE_SIZE);
+            block.setRight(qMin(block.right(), (touched.right() / TILE_SIZE + 1) * TILE_SIZE - 1));
+            block.setBottom(qMin(block.bottom(), (touched.bottom() / TILE_SIZE + 1) * TILE_SIZE - 1));
+            blocks.append(block);
+        }
+    }
+
+    const int count = qMin(blocks.size(), threads * FILTER_BATCHES_PER_THREAD);
+    for(int i = 0; i < count; ++i)
+    {
+        Batch batch;
+        batch.blocks = blocks.mid(blocks.size() * i / count,
+                                  blocks.size() * (i + 1) / count - blocks.size() * i / count);
+        batches.append(batch);
+    }
+
+    Batch *all = batches.data();
+    forEachBatch([this, all](int batch) { filterBatch(all[batch]); });
+
+    if(!isCancelled())
+    {
+        foreach(const Batch &batch, batches)
+            tiles += batch.tiles;
+    }
+    batches.clear();
+    return tiles;
+}
+
+/**
+ * @brief Filter::filterBatch - Filter a batch's blocks one after the
+ *                              other, with the same buffers
+ */
+void Filter::filterBatch(Batch &batch)
+{
+    Scratch scratch;
+    foreach(const QRect &block, batch.blocks)
+    {
+        if(isCancelled())
+            return;
+        filterBlock(block, batch, scratch);
+    }
+}
+
+/**
+ * @brief Filter::filterBlock - Read the block with its halo, run both
+ *                              passes, and make the new tiles. Tiles are
+ *                              only made here, the canvas takes them
+ *                              afterwards on its thread.
+ */
+void Filter::filterBlock(const QRect &block, Batch &batch, Scratch &scratch)
+{
+    const QRect halo = block.adjusted(-radius, -radius, radius, radius);
+    const int width = block.width();
+    const int height = block.height();
+    const int count = width * 4;
+
+    scratch.source.resize(halo.width() * halo.height());
+    scratch.rows.resize(halo.height() * count);
+    scratch.sums.resize(count);
+    scratch.result.resize(width * height);
+    gather(halo, scratch.source.data());
+
+    const uint *source = scratch.source.constData();
+    quint16 *rows = scratch.rows.data();
+    uint *result = scratch.result.data();
+    if(type == box_filter)
+    {
+        boxRows(source, halo.width(), halo.height(), width, rows);
+        boxColumns(rows, width, height, result, scratch.sums.data());
+    }
+    else
+    {
+        // the Gaussian, a row at a time with the Compositor's kernels
+        for(int y = 0; y < halo.height(); ++y)
+            blurRow(rows + y * count, reinterpret_cast<const quint8*>(source + y * halo.width()),
+                    count, weights.constData(), radius);
+        for(int y = 0; y < height; ++y)
+            blurColumn(reinterpret_cast<quint8*>(result + y * width), rows + y * count,
+                       count, count, weights.constData(), radius);
+    }
+    if(type == sharpen_filter)
+        sharpen(source, halo.width(), width, height, result);
+
+    // outside area the tiles keep their pixels
+    if(!area.contains(block))
+    {
+        for(int y = 0; y < height; ++y)
+        {
+            const uint *in = source + (y + radius) * halo.width() + radius;
+            uint *out = result + y * width;
+            for(int x = 0; x < width; ++x)
+            {
+                if(!area.contains(block.left() + x, block.top() + y))
+                    out[x] = in[x];
+            }
+        }
+    }
+
+    for(int row = block.top() / TILE_SIZE; row <= block.bottom() / TILE_SIZE; ++row)
+    {
+        for(int column = block.left() / TILE_SIZE; column <= block.right() / TILE_SIZE; ++column)
+        {
+            const QRect bounds = canvas->tileRect(column, row);
+            const int x0 = bounds.left() - block.left();
+            const int y0 = bounds.top() - block.top();
+            const uint *first = result + y0 * width + x0;
+
+            bool uniform = true;
+            for(int y = 0; y < bounds.height() && uniform; ++y)
+            {
+                const uint *line = first + y * width;
+                uniform = std::all_of(line, line + bounds.width(),
+                                      [first](uint pixel) { return pixel == *first; });
+            }
+
+            const Tile &source = canvas->tileAt(column, row);
+            if(uniform && source.isUniform() && source.color == *first)
+                continue;
+
+            Tile tile;
+            tile.color = *first;
+            if(!uniform)
+            {
+                tile.image = TilePool::instance()->create(bounds.size());
+                for(int y = 0; y < bounds.height(); ++y)
+                    memcpy(tile.image.scanLine(y), first + y * width, size_t(bounds.width()) * 4);
+            }
+            batch.tiles.append(qMakePair(row * canvas->columns() + column, tile));
+        }
+    }
+}
+
+/**
+ * @brief Filter::gather - Copy the pixels of rect out of the tiles, and
+ *                         repeat the canvas' edge pixels where rect
+ *                         reaches past them. Only reads the canvas.
+ */
+void Filter::gather(const QRect &rect, uint *pixels) const
+{
+    const QRect inside = rect & canvas->rect();
+    const int stride = rect.width();
+
+    for(int row = inside.top() / TILE_SIZE; row <= inside.bottom() / TILE_SIZE; ++row)
+    {
+        for(int column = inside.left() / TILE_SIZE; column <= inside.right() / TILE_SIZE; ++column)
+        {
+            const QRect bounds = canvas->tileRect(column, row);
+            const QRect part = bounds & inside;
+            const Tile &tile = canvas->tileAt(column, row);
+            const QImage image = tile.pixels();
+
+            for(int y = part.top(); y <= part.bottom(); ++y)
+            {
+                uint *dst = pixels + (y - rect.top()) * stride + part.left() - rect.left();
+                if(image.isNull())
+                {
+                    std::fill(dst, dst + part.width(), tile.color);
+                    continue;
+                }
+                const uint *src = reinterpret_cast<const uint*>(image.constScanLine(y - bounds.top()));
+                memcpy(dst, src + part.left() - bounds.left(), size_t(part.width()) * 4);
+            }
+        }
+    }
+
+    const int left = inside.left() - rect.left();
+    const int right = inside.right() - rect.left();
+    for(int y = inside.top() - rect.top(); y <= inside.bottom() - rect.top(); ++y)
+    {
+        uint *line = pixels + y * stride;
+        std::fill(line, line + left, line[left]);
+        std::fill(line + right + 1, line + stride, line[right]);
+    }
+
+    const uint *top = pixels + (inside.top() - rect.top()) * stride;
+    const uint *bottom = pixels + (inside.bottom() - rect.top()) * stride;
+    for(int y = 0; y < rect.height(); ++y)
+    {
+        if(y < inside.top() - rect.top())
+            memcpy(pixels + y * stride, top, size_t(stride) * 4);
+        else if(y > inside.bottom() - rect.top())
+            memcpy(pixels + y * stride, bottom, size_t(stride) * 4);
+    }
+}
+
+/**
+ * @brief Filter::boxRows - The mean of each pixel's row neighbours, a
+ *                          running sum so any radius costs the same
+ */
+void Filter::boxRows(const uint *source, int sourceWidth, int height,
+                     int width, quint16 *rows) const
+{
+    const int taps = 2 * radius + 1;
+    const quint32 scale = ((1u << 24) + taps / 2) / taps;
+    for(int y = 0; y < height; ++y)
+    {
+        const quint8 *in = reinterpret_cast<const quint8*>(source + y * sourceWidth);
+        quint16 *out = rows + y * width * 4;
+
+        quint32 sums[4] = {0, 0, 0, 0};
+        for(int k = 0; k < taps; ++k)
+        {
+            for(int c = 0; c < 4; ++c)
+                sums[c] += in[k * 4 + c];
+        }
+
+        for(int x = 0; x < width; ++x)
+        {
+            for(int c = 0; c < 4; ++c)
+            {
+                out[x * 4 + c] = quint16((sums[c] * scale + (1u << 16)) >> 17);
+                if(x + 1 < width)
+                    sums[c] += in[(x + taps) * 4 + c] - in[x * 4 + c];
+            }
+        }
+    }
+}
+
+/**
+ * @brief Filter::boxColumns - The mean down the columns of rows, one sum
+ *                             per channel slid down a row at a time
+ */
+void Filter::boxColumns(const quint16 *rows, int width, int height,
+                        uint *result, quint32 *sums) const
+{
+    const int count = width * 4;
+    const int taps = 2 * radius + 1;
+    const quint64 scale = ((quint64(1) << 24) + taps / 2) / taps;
+
+    std::fill(sums, sums + count, 0);
+    for(int k = 0; k < taps; ++k)
+    {
+        const quint16 *in = rows + k * count;
+        for(int i = 0; i < count; ++i)
+            sums[i] += in[i];
+    }
+
+    for(int y = 0; y < height; ++y)
+    {
+        quint8 *out = reinterpret_cast<quint8*>(result + y * width);
+        for(int i = 0; i < count; ++i)
+            out[i] = quint8((sums[i] * scale + (quint64(1) << 30)) >> 31);
+
+        if(y + 1 == height)
+            break;
+        const quint16 *in = rows + (y + taps) * count;
+        const quint16 *gone = rows + y * count;
+        for(int i = 0; i < count; ++i)
+            sums[i] += in[i] - gone[i];
+    }
+}
+
+/**
+ * @brief Filter::sharpen - The unsharp mask, result holds the blur and
+ *                          becomes the source pushed away from it by
+ *                          amount. Colors stay within the alpha, the
+ *                          pixels stay premultiplied.
+ */
+void Filter::sharpen(const uint *source, int sourceWidth, int width,
+                     int height, uint *result) const
+{
+    for(int y = 0; y < height; ++y)
+    {
+        const uint *in = source + (y + radius) * sourceWidth + radius;
+        uint *out = result + y * width;
+        for(int x = 0; x < width; ++x)
+        {
+            const int alpha = qBound(0, channel(in[x], 24)
+                                     + (channel(in[x], 24) - channel(out[x], 24)) * amount / 100, 255);
+            uint pixel = uint(alpha) << 24;
+            for(int shift = 0; shift < 24; shift += 8)
+            {
+                const int value = channel(in[x], shift)
+                                + (channel(in[x], shift) - channel(out[x], shift)) * amount / 100;
+                pixel |= uint(qBound(0, value, alpha)) << shift;
+            }
+            out[x] = pixel;
+        }
+    }
+}
+
+
+/** filters the tiles of a FilterPreview asked for at once, on its runner */
+class FilterPreview::Run : public QRunnable
+{
+public:
+    Run(FilterPreview *preview, const QRegion &area)
+        : preview(preview), source(preview->source), cancelled(preview->cancelled)
+    {
+        result.generation = preview->generation;
+        result.area = area;
+        type = preview->type;
+        radius = preview->radius;
+        amount = preview->amount;
+    }
+
+    void run() override
+    {
+        // the region's rects are whole tiles, none is filtered twice
+        Filter filter(type, radius, amount);
+        for(const QRect &rect : result.area)
+            result.tiles += filter.filterTiles(source, rect, cancelled.data());
+        if(!cancelled->loadAcquire())
+            preview->post(result);
+    }
+
+private:
+    FilterPreview *preview;
+    Canvas source;
+    QSharedPointer<QAtomicInt> cancelled;
+    Result result;
+    FilterType type;
+    int radius;
+    int amount;
+};
+
+FilterPreview::FilterPreview(QObject *parent)
+    : QObject(parent)
+{
+    type = gaussian_filter;
+    radius = DEFAULT_FILTER_RADIUS;
+    amount = DEFAULT_SHARPEN_AMOUNT;
+    generation = 0;
+    cancelled = QSharedPointer<QAtomicInt>::create(0);
+    runner.setMaxThreadCount(1);
+}
+
+FilterPreview::~FilterPreview()
+{
+    cancelled->storeRelease(1);
+    runner.clear();
+    runner.waitForDone();
+}
+
+/**
+ * @brief FilterPreview::setFilter - Cancel what still runs for the old
+ *                                   settings and forget its tiles
+ */
+void FilterPreview::setFilter(const Canvas &source, FilterType type, int radius, int amount)
+{
+    cancelled->storeRelease(1);
+    runner.clear();
+    cancelled = QSharedPointer<QAtomicInt>::create(0);
+    ++generation;
+
+    this->source = source;
+    this->type = type;
+    this->radius = radius;
+    this->amount = amount;
+    preview = source;
+    states.fill(tile_waiting, source.columns() * source.rows());
+}
+
+/**
+ * @brief FilterPreview::request - Start a run for the tiles of area no run
+ *                                 has had yet, e.g. the ones a scroll
+ *                                 brought into view
+ */
+void FilterPreview::request(const QRect &area)
+{
+    const QRect bounds = area & source.rect();
+    if(bounds.isEmpty())
+        return;
+
+    QRegion waiting;
+    for(int row = bounds.top() / TILE_SIZE; row <= bounds.bottom() / TILE_SIZE; ++row)
+    {
+        for(int column = bounds.left() / TILE_SIZE; column <= bounds.right() / TILE_SIZE; ++column)
+        {
+            quint8 &state = states[row * source.columns() + column];
+            if(state != tile_waiting)
+                continue;
+            state = tile_running;
+            waiting += source.tileRect(column, row);
+        }
+    }
+    if(!waiting.isEmpty())
+        runner.start(new Run(this, waiting));
+}
+
+/**
+ * @brief FilterPreview::post - Hand a run's tiles over to the GUI thread
+ */
+void FilterPreview::post(const Result &result)
+{
+    QMutexLocker locker(&lock);
+    results.append(result);
+    QMetaObject::invokeMethod(this, "deliver", Qt::QueuedConnection);
+}
+
+/**
+ * @brief FilterPreview::deliver - Put the tiles of runs for the current
+ *                                 settings into the preview
+ */
+void FilterPreview::deliver()
+{
+    QVector<Result> done;
+    {
+        QMutexLocker locker(&lock);
+        done.swap(results);
+    }
+
+    foreach(const Result &result, done)
+    {
+        if(result.generation != generation)
+            continue;
+
+        typedef QPair<int, Tile> NewTile;
+        foreach(const NewTile &tile, result.tiles)
+            preview.setTile(tile.first % preview.columns(), tile.first / preview.columns(), tile.second);
+
+        // only the tiles the run was given, one that came out the same
+        // is done as well
+        for(const QRect &rect : result.area)
+        {
+            for(int row = rect.top() / TILE_SIZE; row <= rect.bottom() / TILE_SIZE; ++row)
+            {
+                for(int column = rect.left() / TILE_SIZE; column <= rect.right() / TILE_SIZE; ++column)
+                    states[row * preview.columns() + column] = tile_done;
+            }
+            emit updated(rect);
+        }
+    }
+}
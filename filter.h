@@ -0,0 +1,180 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <QVector>
+#include <QRect>
+#include <QRegion>
+#include <QThread>
+#include <QThreadPool>
+#include <QPair>
+#include <QAtomicInt>
+#include <QObject>
+#include <QMutex>
+#include <QSharedPointer>
+
+#include "canvas.h"
+#include "compositor.h"
+
+
+/**
+ * Image filters on the canvas: Gaussian blur, box blur and unsharp mask.
+ * Each blur is separable, a pass along the rows into 16 bit fixed point
+ * and one down the columns back to pixels, the Gaussian's with the
+ * Compositor's blur kernels. The canvas is cut into blocks
+ * of FILTER_BLOCK_SIZE square, read with a halo of radius pixels around
+ * them, so both passes of a block stay in cache. Batches of blocks are
+ * filtered on every core, and the new tiles only go into the canvas
+ * once all are done, no block reads pixels another one filtered. Past
+ * the edge of the canvas the edge pixels repeat.
+ */
+class Filter
+{
+public:
+    /** radius in pixels, amount in percent, for the unsharp mask only */
+    Filter(FilterType, int radius, int amount = DEFAULT_SHARPEN_AMOUNT,
+           int threads = QThread::idealThreadCount(),
+           Compositor::Path path = Compositor::bestPath());
+
+    /** filter the part of canvas inside area, returns the area of the
+     *  tiles that changed */
+    QRect apply(Canvas *canvas, const QRect &area);
+
+    /** the new tiles of the part of canvas inside area, by index, the
+     *  canvas is only read. Gives up, returning none, once cancelled is
+     *  set, e.g. from another thread. */
+    QVector<QPair<int, Tile> > filterTiles(const Canvas &canvas, const QRect &area,
+                                           const QAtomicInt *cancelled = 0);
+
+private:
+    /** blocks one job filters, and the tiles they made, by index */
+    struct Batch
+    {
+        QVector<QRect> blocks;
+        QVector<QPair<int, Tile> > tiles;
+    };
+
+    /** buffers for one block, kept for the whole batch */
+    struct Scratch
+    {
+        QVector<uint> source;
+        QVector<quint16> rows;
+        QVector<quint32> sums;
+        QVector<uint> result;
+    };
+
+    /** run step(batch) for every batch, on the pool */
+    template<typename Step>
+    void forEachBatch(Step step);
+
+    void filterBatch(Batch&);
+    bool isCancelled() const { return cancelled && cancelled->loadAcquire(); }
+    void filterBlock(const QRect &block, Batch&, Scratch&);
+
+    /** the pixels of rect, edge pixels repeated outside the canvas */
+    void gather(const QRect &rect, uint *pixels) const;
+
+    /** the box blur's passes, from source with the halo to result
+     *  without. In between are rows of channels times 128. */
+    void boxRows(const uint *source, int sourceWidth, int height,
+                 int width, quint16 *rows) const;
+    void boxColumns(const quint16 *rows, int width, int height,
+                    uint *result, quint32 *sums) const;
+    void sharpen(const uint *source, int sourceWidth, int width,
+                 int height, uint *result) const;
+
+    FilterType type;
+    int radius;
+    int amount;
+    int threads;
+
+    /** Gaussian weights summing to 32768, 2 * radius + 1 of them */
+    QVector<quint16> weights;
+    Compositor::BlurRow blurRow;
+    Compositor::BlurColumn blurColumn;
+
+    const Canvas *canvas;
+    QRect area;
+    const QAtomicInt *cancelled;
+    QVector<Batch> batches;
+
+    QThreadPool pool;
+
+    /** Don't allow copying */
+    Filter(const Filter&);
+    Filter& operator=(const Filter&);
+};
+
+/**
+ * A filter shown before it is applied, e.g. while its dialog is open.
+ * Only the tiles asked for, the ones in view, are filtered, in the
+ * background so the settings can keep changing. New settings cancel the
+ * runs still going, they stop after the block they are on and their
+ * tiles are dropped. The canvas itself is never touched, the result is
+ * a copy sharing every tile not filtered.
+ */
+class FilterPreview : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit FilterPreview(QObject *parent = nullptr);
+    /** cancels the runs and waits for them */
+    ~FilterPreview();
+
+    /** start over on source with these settings, nothing is filtered
+     *  until asked for */
+    void setFilter(const Canvas &source, FilterType, int radius, int amount);
+
+    /** filter the tiles area touches that aren't yet */
+    void request(const QRect &area);
+
+    /** source with the tiles filtered so far */
+    const Canvas& result() const { return preview; }
+
+signals:
+    /** the tiles inside area of result() are filtered now */
+    void updated(const QRect &area);
+
+private slots:
+    /** take in the tiles of the runs that are done */
+    void deliver();
+
+private:
+    class Run;
+
+    /** the tiles a run filtered, and the tiles it was asked for */
+    struct Result
+    {
+        int generation;
+        QRegion area;
+        QVector<QPair<int, Tile> > tiles;
+    };
+
+    /** from a run, on its thread */
+    void post(const Result&);
+
+    enum TileState {tile_waiting, tile_running, tile_done};
+
+    Canvas source;
+    Canvas preview;
+    FilterType type;
+    int radius;
+    int amount;
+
+    /** one per setFilter, runs of an older one are dropped */
+    int generation;
+    QSharedPointer<QAtomicInt> cancelled;
+    QVector<quint8> states;
+
+    QMutex lock;
+    QVector<Result> results;
+
+    /** one run at a time, each filters on every core */
+    QThreadPool runner;
+
+    /** Don't allow copying */
+    FilterPreview(const FilterPreview&);
+    FilterPreview& operator=(const FilterPreview&);
+};
+
+#endif // FILTER_H
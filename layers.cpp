@@ -0,0 +1,467 @@
+#include <algorithm>
+
+#include <QCoreApplication>
+
+#include "layers.h"
+
+
+/**
+ * @brief LayerStack::LayerStack - A stack of one layer, the background
+ */
+LayerStack::LayerStack(const QSize &size, const QColor &fill)
+{
+    layers.append(makeLayer(Canvas(size, fill),
+                            QCoreApplication::translate("LayerStack", "Background")));
+    currentLayer = 0;
+    preview = nullptr;
+    fit();
+}
+
+/**
+ * @brief LayerStack::setCurrent - Paint on another layer from now on, the
+ *                                 layers below and above it are flattened
+ *                                 again as their tiles are drawn
+ */
+void LayerStack::setCurrent(int index)
+{
+    if(index == currentLayer || index < 0 || index >= layers.size())
+        return;
+
+    currentLayer = index;
+    changedAll();
+}
+
+/**
+ * @brief LayerStack::state - The layers and the current one, sharing the
+ *                            layers themselves
+ */
+LayerStack::State LayerStack::state() const
+{
+    return State{layers, currentLayer};
+}
+
+/**
+ * @brief LayerStack::restore - Undo or redo the layers going from one state
+ *                              to another: the layers only from has are
+ *                              taken off, the ones only to has are put back
+ *                              over their nearest layer under them in to.
+ *                              The rest keep their order and settings, a
+ *                              move or setting made since isn't lost.
+ */
+void LayerStack::restore(const State &from, const State &to)
+{
+    QSharedPointer<Layer> current = layers.at(currentLayer);
+
+    foreach(const QSharedPointer<Layer> &layer, from.layers)
+    {
+        if(!to.layers.contains(layer))
+            layers.removeOne(layer);
+    }
+
+    for(int i = 0; i < to.layers.size(); ++i)
+    {
+        const QSharedPointer<Layer> &layer = to.layers.at(i);
+        if(layers.contains(layer))
+            continue;
+
+        int index = 0;
+        for(int below = i - 1; below >= 0; --below)
+        {
+            int at = layers.indexOf(to.layers.at(below));
+            if(at >= 0)
+            {
+                index = at + 1;
+                break;
+            }
+        }
+        layers.insert(index, layer);
+    }
+    Q_ASSERT(!layers.isEmpty());
+
+    // paint on the layer to paints on, else stay on the same one
+    int index = layers.indexOf(to.layers.value(to.current));
+    if(index < 0)
+        index = layers.indexOf(current);
+    currentLayer = index >= 0 ? index : qBound(0, to.current, layers.size() - 1);
+    changedAll();
+}
+
+/**
+ * @brief LayerStack::insert - Put a new transparent layer over index and
+ *                             make it the current one. Nothing changes on
+ *                             screen, only the caches are stale.
+ */
+Layer* LayerStack::insert(int index, const QString &name)
+{
+    QSharedPointer<Layer> layer = makeLayer(Canvas(size()), name);
+    layer->canvas.setSwap(current()->canvas.swap(), current()->canvas.swapBudget());
+
+    index = qBound(0, index + 1, layers.size());
+    layers.insert(index, layer);
+    currentLayer = index;
+    changedAll();
+    return layer.data();
+}
+
+/**
+ * @brief LayerStack::remove - Take a layer off the stack, the one under it
+ *                             becomes the current one
+ */
+void LayerStack::remove(int index)
+{
+    if(layers.size() < 2 || index < 0 || index >= layers.size())
+        return;
+
+    layers.removeAt(index);
+    if(currentLayer >= index)
+        currentLayer = qMax(0, currentLayer - 1);
+    changedAll();
+}
+
+/**
+ * @brief LayerStack::move - Move a layer to another place in the stack,
+ *                           the current layer stays the current one
+ */
+void LayerStack::move(int from, int to)
+{
+    if(from == to || from < 0 || from >= layers.size() || to < 0 || to >= layers.size())
+        return;
+
+    QSharedPointer<Layer> current = layers.at(currentLayer);
+    layers.move(from, to);
+    currentLayer = layers.indexOf(current);
+    changedAll();
+}
+
+/**
+ * @brief LayerStack::setOpacity - Change how much of a layer shows
+ */
+void LayerStack::setOpacity(int index, int percent)
+{
+    percent = qBound(0, percent, 100);
+    if(layers.at(index)->opacity == percent)
+        return;
+
+    layers.at(index)->opacity = percent;
+    changed(index, rect());
+}
+
+/**
+ * @brief LayerStack::setVisible - Show or hide a layer
+ */
+void LayerStack::setVisible(int index, bool visible)
+{
+    if(layers.at(index)->visible == visible)
+        return;
+
+    layers.at(index)->visible = visible;
+    changed(index, rect());
+}
+
+/**
+ * @brief LayerStack::setMode - Change how a layer blends with the ones
+ *                              under it. That may change which layers the
+ *                              cache above the current one holds, so all
+ *                              of it is stale.
+ */
+void LayerStack::setMode(int index, BlendMode mode)
+{
+    Q_ASSERT(mode != erase_blend);
+    if(layers.at(index)->mode == mode)
+        return;
+
+    layers.at(index)->mode = mode;
+    changedAll();
+}
+
+/**
+ * @brief LayerStack::reset - Make canvas the only layer, the background.
+ *                            The old layers go away unless an undo command
+ *                            still shares them.
+ */
+void LayerStack::reset(const Canvas &canvas)
+{
+    layers.clear();
+    layers.append(makeLayer(canvas, QCoreApplication::translate("LayerStack", "Background")));
+    currentLayer = 0;
+    changedAll();
+}
+
+/**
+ * @brief LayerStack::setPreview - Show other pixels for the current layer.
+ *                                 Only the composite changes, the caches
+ *                                 below and above it stay as they are.
+ */
+void LayerStack::setPreview(const Canvas *canvas)
+{
+    Q_ASSERT(!canvas || canvas->size() == size());
+    if(canvas == preview)
+        return;
+
+    preview = canvas;
+    changed(currentLayer, rect());
+}
+
+/**
+ * @brief LayerStack::changed - Mark the tiles area touches as stale, and
+ *                              the cached layers the changed one is in
+ */
+void LayerStack::changed(int index, const QRect &area)
+{
+    fit();
+    QRect bounds = area & composite.rect();
+    if(bounds.isEmpty())
+        return;
+
+    quint8 flags = composite_stale;
+    if(index < currentLayer)
+        flags |= below_stale;
+    else if(index > currentLayer)
+        flags |= above_stale;
+
+    for(int row = bounds.top() / TILE_SIZE; row <= bounds.bottom() / TILE_SIZE; ++row)
+    {
+        for(int column = bounds.left() / TILE_SIZE; column <= bounds.right() / TILE_SIZE; ++column)
+            stale[row * composite.columns() + column] |= flags;
+    }
+}
+
+/**
+ * @brief LayerStack::changedAll - Mark every cached tile as stale, they
+ *                                 are composed again when next drawn
+ */
+void LayerStack::changedAll()
+{
+    fit();
+    stale.fill(below_stale | above_stale | composite_stale);
+}
+
+/**
+ * @brief LayerStack::draw - Draw the composite inside area. Where only
+ *                           the current layer shows its tiles are drawn
+ *                           straight away, else stale tiles are composed
+ *                           first. Nothing outside area is composed.
+ */
+void LayerStack::draw(QPainter *painter, const QRect &area)
+{
+    fit();
+    QRect visible = area & composite.rect();
+    if(visible.isEmpty())
+        return;
+
+    const Canvas &canvas = shown(currentLayer);
+    for(int row = visible.top() / TILE_SIZE; row <= visible.bottom() / TILE_SIZE; ++row)
+    {
+        for(int column = visible.left() / TILE_SIZE; column <= visible.right() / TILE_SIZE; ++column)
+        {
+            QRect part = composite.tileRect(column, row) & visible;
+
+            // the composite tile would just copy the layer's, and keeping
+            // it would make every paint on the tile detach it again
+            compose(column, row, false);
+            if(isDirect(column, row))
+            {
+                canvas.draw(painter, part);
+                continue;
+            }
+
+            compose(column, row, true);
+            composite.draw(painter, part);
+        }
+    }
+}
+
+/**
+ * @brief LayerStack::toImage - Flatten every layer into one image, for
+ *                              saving. Each tile is blended bottom up from
+ *                              the layers themselves, the cached groups
+ *                              would round differently.
+ */
+QImage LayerStack::toImage() const
+{
+    Canvas flat(size());
+    for(int row = 0; row < flat.rows(); ++row)
+    {
+        for(int column = 0; column < flat.columns(); ++column)
+            flat.setTile(column, row, flatten(0, layers.size(), column, row));
+    }
+    return flat.toImage();
+}
+
+/**
+ * @brief LayerStack::makeLayer - A new layer holding canvas
+ */
+QSharedPointer<Layer> LayerStack::makeLayer(const Canvas &canvas, const QString &name)
+{
+    QSharedPointer<Layer> layer(new Layer);
+    layer->canvas = canvas;
+    layer->name = name;
+    layer->opacity = 100;
+    layer->visible = true;
+    layer->mode = normal_blend;
+    return layer;
+}
+
+/**
+ * @brief LayerStack::fit - Start the caches over if the image changed
+ *                          size, e.g. by a resize or its undo
+ */
+void LayerStack::fit()
+{
+    if(composite.size() == size() && stale.size() == composite.columns() * composite.rows())
+        return;
+
+    below = Canvas(size());
+    above = Canvas(size());
+    composite = Canvas(size());
+    stale.fill(below_stale | above_stale | composite_stale,
+               composite.columns() * composite.rows());
+}
+
+/**
+ * @brief LayerStack::shown - A layer's canvas, or the preview standing in
+ *                            for the current one
+ */
+const Canvas& LayerStack::shown(int index) const
+{
+    return index == currentLayer && preview ? *preview : layers.at(index)->canvas;
+}
+
+/**
+ * @brief LayerStack::compose - Flatten the layers below and above the
+ *                              current one for a tile if they are stale,
+ *                              and the composite too if full
+ */
+void LayerStack::compose(int column, int row, bool full)
+{
+    quint8 &flags = stale[row * composite.columns() + column];
+    if(flags & below_stale)
+        below.setTile(column, row, flatten(0, currentLayer, column, row));
+    if(flags & above_stale)
+        above.setTile(column, row, flatten(currentLayer + 1, aboveEnd(), column, row));
+    flags &= ~(below_stale | above_stale);
+
+    if(!full || !(flags & composite_stale))
+        return;
+
+    QVector<Part> parts;
+    if(!isClear(below.tileAt(column, row)))
+        parts.append(Part{below.tileAt(column, row), 100, normal_blend});
+    addParts(parts, currentLayer, currentLayer + 1, column, row);
+    if(!isClear(above.tileAt(column, row)))
+        parts.append(Part{above.tileAt(column, row), 100, normal_blend});
+    addParts(parts, aboveEnd(), layers.size(), column, row);
+
+    composite.setTile(column, row, blend(parts, composite.tileRect(column, row).size()));
+    flags &= ~composite_stale;
+}
+
+/**
+ * @brief LayerStack::aboveEnd - Normal layers over normal layers flatten
+ *                               to about the same in any grouping, other
+ *                               modes need the layers under them first
+ */
+int LayerStack::aboveEnd() const
+{
+    int end = currentLayer + 1;
+    while(end < layers.size() && layers.at(end)->mode == normal_blend)
+        ++end;
+    return end;
+}
+
+/**
+ * @brief LayerStack::addParts - The tiles of the layers from up to to that
+ *                               show at all, bottom first
+ */
+void LayerStack::addParts(QVector<Part> &parts, int from, int to, int column, int row) const
+{
+    for(int i = from; i < to; ++i)
+    {
+        const Layer *layer = layers.at(i).data();
+        const Canvas &canvas = shown(i);
+        if(!layer->visible || layer->opacity == 0 || canvas.size() != size()
+           || isClear(canvas.tileAt(column, row)))
+            continue;
+        parts.append(Part{canvas.tileAt(column, row), layer->opacity, layer->mode});
+    }
+}
+
+/**
+ * @brief LayerStack::flatten - The visible layers from up to to, one on
+ *                              top of the other, for one tile
+ */
+Tile LayerStack::flatten(int from, int to, int column, int row) const
+{
+    QVector<Part> parts;
+    addParts(parts, from, to, column, row);
+    QRect tile(column * TILE_SIZE, row * TILE_SIZE, TILE_SIZE, TILE_SIZE);
+    return blend(parts, (tile & rect()).size());
+}
+
+/**
+ * @brief LayerStack::blend - Put parts on top of each other, bottom first,
+ *                            a row at a time with the Compositor's layer
+ *                            kernels. One part fully shown is shared, not
+ *                            copied, and only uniform parts give a uniform
+ *                            tile.
+ */
+Tile LayerStack::blend(const QVector<Part> &parts, const QSize &size)
+{
+    if(parts.isEmpty())
+        return Tile();
+    if(parts.size() == 1 && parts.first().opacity == 100)
+        return parts.first().tile;
+
+    bool uniform = true;
+    foreach(const Part &part, parts)
+        uniform = uniform && part.tile.isUniform();
+
+    Tile tile;
+    if(uniform)
+    {
+        foreach(const Part &part, parts)
+            Compositor::layerRow(part.mode)(&tile.color, &part.tile.color, 1,
+                                            (part.opacity * 255 + 50) / 100);
+        return tile;
+    }
+
+    QImage image = TilePool::instance()->create(size);
+    image.fill(Qt::transparent);
+
+    uint flat[TILE_SIZE];
+    foreach(const Part &part, parts)
+    {
+        Compositor::LayerRow kernel = Compositor::layerRow(part.mode);
+        uint opacity = (part.opacity * 255 + 50) / 100;
+
+        // a uniform part is one row of its color over and over
+        QImage pixels = part.tile.pixels();
+        if(pixels.isNull())
+            std::fill(flat, flat + size.width(), part.tile.color);
+
+        for(int y = 0; y < size.height(); ++y)
+        {
+            const uint *src = pixels.isNull() ? flat
+                            : reinterpret_cast<const uint*>(pixels.constScanLine(y));
+            kernel(reinterpret_cast<uint*>(image.scanLine(y)), src, size.width(), opacity);
+        }
+    }
+    tile.image = image;
+    return tile;
+}
+
+/**
+ * @brief LayerStack::isDirect - True if nothing but the current layer,
+ *                               fully shown, is on a tile
+ */
+bool LayerStack::isDirect(int column, int row) const
+{
+    if(!current()->visible || current()->opacity < 100
+       || !isClear(below.tileAt(column, row)) || !isClear(above.tileAt(column, row)))
+        return false;
+
+    // over nothing every mode shows the layer as it is
+    QVector<Part> parts;
+    addParts(parts, aboveEnd(), layers.size(), column, row);
+    return parts.isEmpty();
+}
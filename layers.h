@@ -0,0 +1,150 @@
+#ifndef LAYERS_H
+#define LAYERS_H
+
+#include <QList>
+#include <QVector>
+#include <QString>
+#include <QPainter>
+#include <QSharedPointer>
+
+#include "canvas.h"
+#include "compositor.h"
+
+
+/** one layer of the image */
+struct Layer
+{
+    Canvas canvas;
+    QString name;
+    /** percent, 0-100 */
+    int opacity;
+    bool visible;
+    /** how it goes onto the layers under it, any mode but erase_blend */
+    BlendMode mode;
+};
+
+/**
+ * The layers of the image, bottom first, and the image they make. That
+ * composite is cached per tile and only composed again where a layer
+ * changed. The layers below and above the current one are cached
+ * flattened as well, so a paint on the current layer composes three
+ * tiles per changed tile however many layers there are. Only normal
+ * layers flatten into the cache above, from the first layer above the
+ * current one with another mode on each is blended in on its own.
+ *
+ * The view is only close to the image: blending in 8 bits rounds, so the
+ * layers above flattened first and then put on the rest come out a level
+ * or so per channel off from putting them on one by one, and differently
+ * for each current layer. toImage() flattens bottom up without the caches
+ * and is exact. Layers are never moved in memory, tools keep painting on
+ * &current()->canvas. They are shared with the undo history, a layer
+ * taken off the stack lives on as long as a command can put it back.
+ */
+class LayerStack
+{
+public:
+    /** one layer, size filled with color */
+    LayerStack(const QSize &size = QSize(), const QColor &fill = Qt::transparent);
+
+    int count() const { return layers.size(); }
+    Layer* layer(int index) const { return layers.at(index).data(); }
+    int currentIndex() const { return currentLayer; }
+    Layer* current() const { return layers.at(currentLayer).data(); }
+    void setCurrent(int index);
+
+    /** which layers there are and which one is current, for undo */
+    struct State
+    {
+        QList<QSharedPointer<Layer> > layers;
+        int current;
+    };
+    State state() const;
+    void restore(const State &from, const State &to);
+
+    /** the current layer's size. Only a layer an undo left at another
+     *  size can differ, it isn't shown until it fits again. */
+    QSize size() const { return current()->canvas.size(); }
+    QRect rect() const { return current()->canvas.rect(); }
+
+    /** a transparent layer over index, it becomes the current one */
+    Layer* insert(int index, const QString &name);
+    /** there is always one layer left */
+    void remove(int index);
+    void move(int from, int to);
+    void setOpacity(int index, int percent);
+    void setVisible(int index, bool);
+    void setMode(int index, BlendMode);
+
+    /** start over with canvas as the only layer, e.g. for a new image */
+    void reset(const Canvas &canvas);
+
+    /** show canvas in place of the current layer's, e.g. a filter's
+     *  preview, until set back to null. It has to be the same size. */
+    void setPreview(const Canvas *canvas);
+
+    /** a layer's pixels changed inside area. Only the composite tiles
+     *  there are stale then, for the current layer not even the cached
+     *  layers below and above it. */
+    void changed(int index, const QRect &area);
+    /** any layer may have changed anywhere, e.g. after undo */
+    void changedAll();
+
+    /** draw the composite inside area, composing stale tiles first */
+    void draw(QPainter*, const QRect &area);
+
+    /** every layer put on the one under it in turn, for saving */
+    QImage toImage() const;
+
+private:
+    enum Stale {below_stale = 1, above_stale = 2, composite_stale = 4};
+
+    /** a tile of a layer and how it goes on */
+    struct Part
+    {
+        Tile tile;
+        int opacity;
+        BlendMode mode;
+    };
+
+    /** a fully shown normal layer */
+    static QSharedPointer<Layer> makeLayer(const Canvas&, const QString &name);
+
+    /** resize the caches to the image if it changed size, all stale */
+    void fit();
+
+    /** the pixels a layer shows, the preview's for the current one */
+    const Canvas& shown(int index) const;
+
+    /** bring the cached tiles in sync, the composite only if full */
+    void compose(int column, int row, bool full);
+
+    /** the first layer above the current one that isn't normal */
+    int aboveEnd() const;
+
+    /** append the visible layers from up to to, for one tile */
+    void addParts(QVector<Part>&, int from, int to, int column, int row) const;
+
+    /** the layers from up to to flattened, for one tile */
+    Tile flatten(int from, int to, int column, int row) const;
+    static Tile blend(const QVector<Part>&, const QSize&);
+    static bool isClear(const Tile &tile) { return tile.isUniform() && tile.color == 0; }
+
+    /** true if the current layer alone makes the tile */
+    bool isDirect(int column, int row) const;
+
+    QList<QSharedPointer<Layer> > layers;
+    int currentLayer;
+    const Canvas *preview;
+
+    /** the caches, and which of their tiles are stale */
+    Canvas below;
+    Canvas above;
+    Canvas composite;
+    QVector<quint8> stale;
+
+    /** Don't allow copying */
+    LayerStack(const LayerStack&);
+    LayerStack& operator=(const LayerStack&);
+};
+
+#endif // LAYERS_H
@@ -2,6 +2,7 @@
 #include <qlocale.h>
 
 #include "Paint.h"
+#include "benchmark.h"
 
 
 int main(int argc, char* argv[])
@@ -11,6 +12,10 @@ int main(int argc, char* argv[])
     a.setApplicationVersion(APP_VERSION);
     a.setWindowIcon(QIcon(":/icons/Icon"));
 
+    // time the pixel kernels instead of opening the window
+    if(a.arguments().contains("--benchmark"))
+        return Benchmark::run();
+
     MainWindow w;
     w.show();
     return a.exec();
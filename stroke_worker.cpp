@@ -0,0 +1,140 @@
+#include <QMutexLocker>
+
+#include "stroke_worker.h"
+#include "tool.h"
+
+
+/**
+ * @brief StrokeWorker::StrokeWorker - A thread drawing into canvas,
+ *                                     started right away
+ */
+StrokeWorker::StrokeWorker(Canvas *canvas, QObject *parent)
+    : QThread(parent)
+{
+    this->canvas = canvas;
+    start();
+}
+
+StrokeWorker::~StrokeWorker()
+{
+    StrokeSample sample;
+    sample.kind = StrokeSample::Quit;
+    sample.tool = nullptr;
+    post(sample);
+    wait();
+}
+
+/**
+ * @brief StrokeWorker::beginStroke - Start a stroke with tool at point
+ */
+void StrokeWorker::beginStroke(PenTool *tool, const QPoint &point)
+{
+    StrokeSample sample;
+    sample.kind = StrokeSample::Begin;
+    sample.point = point;
+    sample.tool = tool;
+    post(sample);
+}
+
+/**
+ * @brief StrokeWorker::addPoint - Queue a point of the current stroke
+ */
+void StrokeWorker::addPoint(const QPoint &point)
+{
+    StrokeSample sample;
+    sample.kind = StrokeSample::Move;
+    sample.point = point;
+    sample.tool = nullptr;
+    post(sample);
+}
+
+/**
+ * @brief StrokeWorker::finishStroke - End the stroke and block until the
+ *                                     worker has drawn all of it
+ */
+QRect StrokeWorker::finishStroke()
+{
+    StrokeSample sample;
+    sample.kind = StrokeSample::End;
+    sample.tool = nullptr;
+    post(sample);
+
+    finished.acquire();
+    return strokeDirty;
+}
+
+/**
+ * @brief StrokeWorker::setCanvas - Switch canvases, e.g. to another layer
+ */
+void StrokeWorker::setCanvas(Canvas *canvas)
+{
+    QMutexLocker locker(&lock);
+    this->canvas = canvas;
+}
+
+/**
+ * @brief StrokeWorker::post - Push a sample and wake the worker. Only
+ *                             waits if the worker is 1024 samples behind.
+ */
+void StrokeWorker::post(const StrokeSample &sample)
+{
+    while(!queue.push(sample))
+        QThread::yieldCurrentThread();
+    available.release();
+}
+
+/**
+ * @brief StrokeWorker::run - Drain the queue, draw the batch, repeat
+ */
+void StrokeWorker::run()
+{
+    PenTool *tool = nullptr;
+    forever
+    {
+        // the count only wakes us up, a wake up may find nothing left
+        available.acquire();
+
+        bool end = false;
+        StrokeSample sample;
+        while(queue.pop(sample))
+        {
+            switch(sample.kind)
+            {
+                case StrokeSample::Begin:
+                    tool = sample.tool;
+                    tool->beginStroke();
+                    tool->setStartPoint(sample.point);
+                    strokeDirty = QRect();
+                    break;
+                case StrokeSample::Move:
+                    if(tool)
+                        tool->addPoint(sample.point);
+                    break;
+                case StrokeSample::End:
+                    end = true;
+                    break;
+                case StrokeSample::Quit:
+                    return;
+            }
+            if(end)
+                break;
+        }
+
+        if(tool && tool->hasPending())
+        {
+            QRect dirty;
+            {
+                QMutexLocker locker(&lock);
+                dirty = tool->flush(canvas);
+            }
+            strokeDirty |= dirty;
+            emit damaged(dirty);
+        }
+
+        if(end)
+        {
+            tool = nullptr;
+            finished.release();
+        }
+    }
+}
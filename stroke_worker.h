@@ -0,0 +1,76 @@
+#ifndef STROKE_WORKER_H
+#define STROKE_WORKER_H
+
+#include <QThread>
+#include <QMutex>
+#include <QSemaphore>
+#include <QPoint>
+#include <QRect>
+
+#include "spsc_queue.h"
+
+
+class PenTool;
+class Canvas;
+
+/** one input sample handed from the GUI thread to the worker */
+struct StrokeSample
+{
+    enum Kind {Begin, Move, End, Quit};
+
+    Kind kind;
+    QPoint point;
+    PenTool* tool;
+};
+
+/**
+ * Rasterizes pen/eraser strokes on its own thread. The GUI thread pushes
+ * samples into a lock-free queue, the worker drains whatever is there,
+ * draws it as one polyline and posts the damaged rect back.
+ */
+class StrokeWorker : public QThread
+{
+    Q_OBJECT
+
+public:
+    StrokeWorker(Canvas *canvas, QObject *parent = nullptr);
+    ~StrokeWorker();
+
+    /** GUI thread only */
+    void beginStroke(PenTool*, const QPoint&);
+    void addPoint(const QPoint&);
+
+    /** wait until everything is drawn, returns all the stroke painted */
+    QRect finishStroke();
+
+    /** draw the next strokes into another canvas, between strokes only */
+    void setCanvas(Canvas*);
+
+    /** held while the worker paints, paintEvent takes it while blitting */
+    QMutex* canvasLock() { return &lock; }
+
+signals:
+    void damaged(const QRect&);
+
+protected:
+    void run() override;
+
+private:
+    void post(const StrokeSample&);
+
+    Canvas* canvas;
+    QMutex lock;
+
+    SpscQueue<StrokeSample, 1024> queue;
+    QSemaphore available;
+    QSemaphore finished;
+
+    /** worker thread only, handed over through 'finished' */
+    QRect strokeDirty;
+
+    /** Don't allow copying */
+    StrokeWorker(const StrokeWorker&);
+    StrokeWorker& operator=(const StrokeWorker&);
+};
+
+#endif // STROKE_WORKER_H
@@ -0,0 +1,131 @@
+#include <QMutexLocker>
+#include <cstring>
+
+#include "tile_pool.h"
+#include "constants.h"
+
+
+namespace {
+
+const size_t BLOCK_BYTES = size_t(TILE_SIZE) * TILE_SIZE * 4;
+
+/** cache line aligned, so SIMD loads of a row never split a line */
+const size_t BLOCK_ALIGNMENT = 64;
+
+} // namespace
+
+Q_GLOBAL_STATIC(TilePool, globalPool)
+
+
+TilePool::TilePool()
+{
+    allocations = 0;
+    reuses = 0;
+    used = 0;
+    freeBlocks.reserve(TILE_POOL_FREE);
+}
+
+TilePool::~TilePool()
+{
+    foreach(uchar *block, freeBlocks)
+        qFreeAligned(block);
+}
+
+/**
+ * @brief TilePool::instance - The pool all tiles share
+ */
+TilePool* TilePool::instance()
+{
+    return globalPool();
+}
+
+/**
+ * @brief TilePool::create - A tile image on a recycled buffer if there is
+ *                           one, else on a new one
+ */
+QImage TilePool::create(const QSize &size)
+{
+    Q_ASSERT(size.width() <= TILE_SIZE && size.height() <= TILE_SIZE);
+
+    uchar *block = nullptr;
+    {
+        QMutexLocker lock(&mutex);
+        if(!freeBlocks.isEmpty())
+        {
+            block = freeBlocks.takeLast();
+            reuses++;
+        }
+        else
+        {
+            allocations++;
+        }
+        used++;
+    }
+
+    if(!block)
+        block = static_cast<uchar*>(qMallocAligned(BLOCK_BYTES, BLOCK_ALIGNMENT));
+
+    return QImage(block, size.width(), size.height(), size.width() * 4,
+                  CANVAS_FORMAT, &TilePool::release, block);
+}
+
+/**
+ * @brief TilePool::copy - Copy a tile row by row into a pool buffer
+ */
+QImage TilePool::copy(const QImage &image)
+{
+    QImage tile = create(image.size());
+    const size_t rowBytes = size_t(image.width()) * 4;
+    for(int y = 0; y < image.height(); ++y)
+        memcpy(tile.scanLine(y), image.constScanLine(y), rowBytes);
+    return tile;
+}
+
+qint64 TilePool::heapAllocations() const
+{
+    QMutexLocker lock(&mutex);
+    return allocations;
+}
+
+qint64 TilePool::recycled() const
+{
+    QMutexLocker lock(&mutex);
+    return reuses;
+}
+
+int TilePool::inUse() const
+{
+    QMutexLocker lock(&mutex);
+    return used;
+}
+
+/**
+ * @brief TilePool::release - QImage cleanup function, called when the
+ *                            last copy of a pool image is gone. Images
+ *                            that outlive the pool at exit just free.
+ */
+void TilePool::release(void *block)
+{
+    if(globalPool.isDestroyed())
+        qFreeAligned(block);
+    else
+        globalPool()->put(static_cast<uchar*>(block));
+}
+
+/**
+ * @brief TilePool::put - Keep a buffer for the next tile, or free it
+ *                        if enough are kept already
+ */
+void TilePool::put(uchar *block)
+{
+    {
+        QMutexLocker lock(&mutex);
+        used--;
+        if(freeBlocks.size() < TILE_POOL_FREE)
+        {
+            freeBlocks.append(block);
+            return;
+        }
+    }
+    qFreeAligned(block);
+}
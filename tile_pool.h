@@ -0,0 +1,51 @@
+#ifndef TILE_POOL_H
+#define TILE_POOL_H
+
+#include <QImage>
+#include <QVector>
+#include <QMutex>
+
+
+/**
+ * Recycles the pixel buffers of canvas tiles. Every buffer holds one full
+ * TILE_SIZE square, images made by the pool hand their buffer back when
+ * the last copy is gone, and the next tile reuses it instead of going to
+ * the heap. Up to TILE_POOL_FREE buffers are kept, the rest are freed.
+ * Tiles come and go on the GUI, stroke worker and undo packer threads,
+ * every access goes through the mutex.
+ */
+class TilePool
+{
+public:
+    TilePool();
+    ~TilePool();
+
+    static TilePool* instance();
+
+    /** an uninitialized CANVAS_FORMAT image, at most TILE_SIZE square */
+    QImage create(const QSize&);
+
+    /** a copy of a tile in pool memory, with no one else sharing it */
+    QImage copy(const QImage&);
+
+    /** counters, a steady state stroke shouldn't raise heapAllocations */
+    qint64 heapAllocations() const;
+    qint64 recycled() const;
+    int inUse() const;
+
+private:
+    static void release(void *block);
+    void put(uchar *block);
+
+    mutable QMutex mutex;
+    QVector<uchar*> freeBlocks;
+    qint64 allocations;
+    qint64 reuses;
+    int used;
+
+    /** Don't allow copying */
+    TilePool(const TilePool&);
+    TilePool& operator=(const TilePool&);
+};
+
+#endif // TILE_POOL_H
@@ -0,0 +1,161 @@
+#include <QDir>
+#include <QMutexLocker>
+#include <cstring>
+
+#include "tile_swap.h"
+#include "tile_pool.h"
+#include "constants.h"
+
+
+namespace {
+
+/** every slot holds a full tile, edge tiles just leave some unused */
+const qint64 SLOT_BYTES = qint64(TILE_SIZE) * TILE_SIZE * 4;
+const qint64 CHUNK_BYTES = SLOT_BYTES * TILE_SWAP_CHUNK;
+
+} // namespace
+
+
+/**
+ * @brief SwapPage::SwapPage - A written slot, owned by the tiles that
+ *                             share this page
+ */
+SwapPage::SwapPage(const QSharedPointer<TileSwap> &swap, int slot, const QSize &size)
+{
+    this->swap = swap;
+    this->slot = slot;
+    pageSize = size;
+}
+
+SwapPage::~SwapPage()
+{
+    swap->release(slot);
+}
+
+/**
+ * @brief SwapPage::read - Page the tile back in
+ */
+QImage SwapPage::read() const
+{
+    return swap->read(slot, pageSize);
+}
+
+/**
+ * @brief TileSwap::TileSwap - The swap file is only created once the
+ *                             first tile is paged out
+ */
+TileSwap::TileSwap()
+    : file(QDir::tempPath() + "/paintpp-tiles-XXXXXX.swap")
+{
+    ins = 0;
+    outs = 0;
+}
+
+TileSwap::~TileSwap()
+{
+    foreach(uchar *chunk, chunks)
+        file.unmap(chunk);
+}
+
+/**
+ * @brief TileSwap::write - Copy a tile into a free slot
+ */
+QSharedPointer<SwapPage> TileSwap::write(const QImage &image)
+{
+    Q_ASSERT(image.format() == CANVAS_FORMAT);
+    Q_ASSERT(image.width() <= TILE_SIZE && image.height() <= TILE_SIZE);
+
+    int slot;
+    {
+        QMutexLocker lock(&mutex);
+        if(freeSlots.isEmpty() && !grow())
+            return QSharedPointer<SwapPage>();
+        slot = freeSlots.takeLast();
+
+        uchar *dst = slotData(slot);
+        const size_t rowBytes = size_t(image.width()) * 4;
+        for(int y = 0; y < image.height(); ++y)
+            memcpy(dst + y * rowBytes, image.constScanLine(y), rowBytes);
+        outs++;
+    }
+    return QSharedPointer<SwapPage>(new SwapPage(sharedFromThis(), slot, image.size()));
+}
+
+/**
+ * @brief TileSwap::read - Copy a slot out into a new tile image
+ */
+QImage TileSwap::read(int slot, const QSize &size)
+{
+    QImage image = TilePool::instance()->create(size);
+
+    QMutexLocker lock(&mutex);
+    const uchar *src = slotData(slot);
+    const size_t rowBytes = size_t(size.width()) * 4;
+    for(int y = 0; y < size.height(); ++y)
+        memcpy(image.scanLine(y), src + y * rowBytes, rowBytes);
+    ins++;
+    return image;
+}
+
+/**
+ * @brief TileSwap::release - Hand a slot out again, its pages are gone
+ */
+void TileSwap::release(int slot)
+{
+    QMutexLocker lock(&mutex);
+    freeSlots.append(slot);
+}
+
+/**
+ * @brief TileSwap::slotData - Where a slot is mapped, mutex held
+ */
+uchar* TileSwap::slotData(int slot) const
+{
+    return chunks.at(slot / TILE_SWAP_CHUNK) + qint64(slot % TILE_SWAP_CHUNK) * SLOT_BYTES;
+}
+
+/**
+ * @brief TileSwap::grow - Add a chunk of free slots to the end of the
+ *                         file and map it, mutex held
+ */
+bool TileSwap::grow()
+{
+    if(!file.isOpen() && !file.open())
+        return false;
+
+    qint64 offset = chunks.size() * CHUNK_BYTES;
+    if(!file.resize(offset + CHUNK_BYTES))
+        return false;
+
+    uchar *chunk = file.map(offset, CHUNK_BYTES);
+    if(!chunk)
+    {
+        file.resize(offset);
+        return false;
+    }
+
+    // hand out the lowest slots first
+    int first = chunks.size() * TILE_SWAP_CHUNK;
+    chunks.append(chunk);
+    for(int slot = first + TILE_SWAP_CHUNK - 1; slot >= first; --slot)
+        freeSlots.append(slot);
+    return true;
+}
+
+qint64 TileSwap::pageIns() const
+{
+    QMutexLocker lock(&mutex);
+    return ins;
+}
+
+qint64 TileSwap::pageOuts() const
+{
+    QMutexLocker lock(&mutex);
+    return outs;
+}
+
+qint64 TileSwap::fileSize() const
+{
+    QMutexLocker lock(&mutex);
+    return chunks.size() * CHUNK_BYTES;
+}
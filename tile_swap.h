@@ -0,0 +1,79 @@
+#ifndef TILE_SWAP_H
+#define TILE_SWAP_H
+
+#include <QImage>
+#include <QVector>
+#include <QMutex>
+#include <QTemporaryFile>
+#include <QSharedPointer>
+#include <QEnableSharedFromThis>
+
+
+class TileSwap;
+
+/**
+ * One tile's pixels in the swap file. Pages never change once written,
+ * the slot is handed out again when the last tile referring to it is gone.
+ */
+class SwapPage
+{
+public:
+    SwapPage(const QSharedPointer<TileSwap> &swap, int slot, const QSize &size);
+    ~SwapPage();
+
+    /** copy the pixels back into a new image */
+    QImage read() const;
+    QSize size() const { return pageSize; }
+
+private:
+    QSharedPointer<TileSwap> swap;
+    int slot;
+    QSize pageSize;
+
+    /** Don't allow copying */
+    SwapPage(const SwapPage&);
+    SwapPage& operator=(const SwapPage&);
+};
+
+/**
+ * A scratch file canvas tiles are paged out to. It grows in chunks of
+ * TILE_SWAP_CHUNK slots, each chunk stays mapped into memory while the
+ * file is open, so paging is a plain copy and the OS decides what of the
+ * file is actually in RAM. Used from the GUI, stroke worker and undo
+ * packer threads, every access goes through the mutex.
+ */
+class TileSwap : public QEnableSharedFromThis<TileSwap>
+{
+public:
+    TileSwap();
+    ~TileSwap();
+
+    /** write a tile out, null if the file couldn't grow */
+    QSharedPointer<SwapPage> write(const QImage&);
+
+    /** counters, for the status bar */
+    qint64 pageIns() const;
+    qint64 pageOuts() const;
+    qint64 fileSize() const;
+
+private:
+    friend class SwapPage;
+
+    QImage read(int slot, const QSize&);
+    void release(int slot);
+    uchar* slotData(int slot) const;
+    bool grow();
+
+    mutable QMutex mutex;
+    QTemporaryFile file;
+    QVector<uchar*> chunks;
+    QVector<int> freeSlots;
+    qint64 ins;
+    qint64 outs;
+
+    /** Don't allow copying */
+    TileSwap(const TileSwap&);
+    TileSwap& operator=(const TileSwap&);
+};
+
+#endif // TILE_SWAP_H
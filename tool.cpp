@@ -1,10 +1,64 @@
 #include <QPainter>
 #include <QGraphicsLineItem>
+#include <QtMath>
 
 #include "tool.h"
-#include "draw_area.h"
+#include "fill.h"
 
 
+/**
+ * @brief Tool::extent - Half the pen width, grown for caps and joins that
+ *                       stick out further, plus room for antialiasing
+ *
+ */
+int Tool::extent() const
+{
+    qreal half = qMax(widthF(), qreal(1)) / 2;
+    qreal reach = half;
+    if(capStyle() == Qt::SquareCap)
+        reach = half * M_SQRT2;
+    if(joinStyle() == Qt::MiterJoin)
+        reach = qMax(reach, half * miterLimit());
+    return qCeil(reach) + 2;
+}
+
+/**
+ * @brief Tool::bounds - The outline's bounding rect grown by the extent,
+ *                       everything drawTo can touch
+ *
+ */
+QRect Tool::bounds(const QPoint &endPoint) const
+{
+    int rad = extent();
+    return outline(endPoint).boundingRect().toAlignedRect()
+                                           .adjusted(-rad, -rad, rad, rad);
+}
+
+/**
+ * @brief Tool::coverage - The outline stroked out to the extent, with its
+ *                         inside if it is filled. Round caps and joins of
+ *                         that width reach as far as any cap or join of
+ *                         the pen, whatever its style.
+ *
+ */
+QPainterPath Tool::coverage(const QPoint &endPoint) const
+{
+    QPainterPath shape = outline(endPoint);
+    QPainterPathStroker stroker;
+    stroker.setWidth(2 * extent());
+    stroker.setCapStyle(Qt::RoundCap);
+    stroker.setJoinStyle(Qt::RoundJoin);
+
+    QPainterPath covered = stroker.createStroke(shape);
+    if(fillBrush().style() != Qt::NoBrush)
+        covered = covered.united(shape);
+
+    // a click without a drag strokes to nothing, but still draws a dot
+    if(covered.isEmpty())
+        covered.addRect(bounds(endPoint));
+    return covered;
+}
+
 /**
  * @brief PenTool::drawTo - Draws line from startPoint to endPoint, where
  *                          startpoint is either:
@@ -15,18 +69,62 @@
  *                          -endPoint is where the mouse was moved TO on this event.
  *
  */
-void PenTool::drawTo(const QPoint &endPoint, QWidget *drawArea, QPixmap *image)
+QRect PenTool::drawTo(const QPoint &endPoint, Canvas *canvas)
+{
+    addPoint(endPoint);
+    return flush(canvas);
+}
+
+/**
+ * @brief PenTool::flush - Draws all buffered points as one polyline starting
+ *                         at startPoint, with one painter, no matter how
+ *                         many mouse events came in since the last frame,
+ *                         or as dabs for a soft brush. Doesn't touch any
+ *                         widget, so it may run on the stroke worker thread.
+ *
+ */
+QRect PenTool::flush(Canvas *canvas)
 {
-    QPainter painter(image);
-    painter.setPen(static_cast<QPen>(*this));
-    painter.drawLine(getStartPoint(), endPoint);
-
-    // speed things up a bit by only updating the immediate
-    // radius of the DrawArea
-    int rad = (this->width() / 2) + 2;
-    drawArea->update(QRect(getStartPoint(), endPoint).normalized()
-                                .adjusted(-rad, -rad, +rad, +rad));
-    setStartPoint(endPoint);
+    if(pending.isEmpty())
+        return QRect();
+
+    if(brush.isSoft())
+    {
+        // the first call of a stroke dabs the start point, after that
+        // startPoint is where the last flush stopped
+        QRect dirty = brush.strokeTo(canvas, getStartPoint(), widthF(), color());
+        foreach(const QPoint &point, pending)
+            dirty |= brush.strokeTo(canvas, point, widthF(), color());
+
+        setStartPoint(pending.last());
+        pending.clear();
+        return dirty;
+    }
+
+    // start one point back so the join at startPoint is drawn too,
+    // redrawing that segment is harmless for an opaque pen
+    polyline.clear();
+    polyline.reserve(pending.size() + 2);
+    if(hasJoin)
+        polyline << joinPoint;
+    polyline << getStartPoint() << pending;
+
+    // speed things up a bit by only touching the immediate
+    // radius of the polyline
+    int rad = extent();
+    QRect dirty = polyline.boundingRect().adjusted(-rad, -rad, +rad, +rad);
+
+    const QPen pen = *this;
+    canvas->paint(dirty, [&](QPainter &painter) {
+        painter.setPen(pen);
+        painter.drawPolyline(polyline);
+    });
+
+    joinPoint = polyline.size() > 1 ? polyline.at(polyline.size() - 2) : getStartPoint();
+    hasJoin = true;
+    setStartPoint(pending.last());
+    pending.clear();
+    return dirty;
 }
 
 /**
@@ -35,12 +133,27 @@ void PenTool::drawTo(const QPoint &endPoint, QWidget *drawArea, QPixmap *image)
  *                           -endPoint is where the mouse was released
  *
  */
-void LineTool::drawTo(const QPoint &endPoint, QWidget *drawArea, QPixmap *image)
+QRect LineTool::drawTo(const QPoint &endPoint, Canvas *canvas)
 {
-    QPainter painter(image);
-    painter.setPen(static_cast<QPen>(*this));
-    painter.drawLine(getStartPoint(), endPoint);
-    drawArea->update();
+    QRect dirty = bounds(endPoint);
+    const QPen pen = *this;
+    const QPoint startPoint = getStartPoint();
+    canvas->paint(coverage(endPoint), [&](QPainter &painter) {
+        painter.setPen(pen);
+        painter.drawLine(startPoint, endPoint);
+    });
+    return dirty;
+}
+
+/**
+ * @brief LineTool::outline - The line from startPoint to endPoint
+ *
+ */
+QPainterPath LineTool::outline(const QPoint &endPoint) const
+{
+    QPainterPath path(getStartPoint());
+    path.lineTo(endPoint);
+    return path;
 }
 
 /**
@@ -64,38 +177,74 @@ RectTool::RectTool(const QBrush &brush, qreal width, Qt::PenStyle s,
  *                           -endPoint is where the mouse was released
  *
  */
-void RectTool::drawTo(const QPoint &endPoint, QWidget *drawArea, QPixmap *image)
+QRect RectTool::drawTo(const QPoint &endPoint, Canvas *canvas)
 {
-    QPainter painter(image);
-    painter.setPen(static_cast<QPen>(*this));
     QRect rect = adjustPoints(endPoint);
+    QRect dirty = bounds(endPoint);
+    const QPen pen = *this;
 
-    //draw a rectangle, square, or ellipse--fill or no fill--based on settings
-    switch(shapeType)
-    {
-        case rectangle:
-        {
-            if(fillColor != no_fill)
-                painter.fillRect(rect, fillColor);
-            painter.drawRect(rect);
-        } break;
-        case rounded_rectangle:
+    canvas->paint(coverage(endPoint), [&](QPainter &painter) {
+        painter.setPen(pen);
+
+        //draw a rectangle, square, or ellipse--fill or no fill--based on settings
+        switch(shapeType)
         {
-            if(fillMode != no_fill)
-                painter.setBrush(QBrush(fillColor));
-            painter.drawRoundedRect(rect, roundedCurve, roundedCurve,
-                                          Qt::RelativeSize); break;
+            case rectangle:
+            {
+                if(fillMode != no_fill)
+                    painter.fillRect(rect, fillColor);
+                painter.drawRect(rect);
+            } break;
+            case rounded_rectangle:
+            {
+                if(fillMode != no_fill)
+                    painter.setBrush(QBrush(fillColor));
+                painter.drawRoundedRect(rect, roundedCurve, roundedCurve,
+                                              Qt::RelativeSize); break;
+            }
+            case ellipse:
+            {
+                if(fillMode != no_fill)
+                    painter.setBrush(QBrush(fillColor));
+                painter.drawEllipse(rect);
+            } break;
+            default:
+              break;
         }
-        case ellipse:
-        {
-            if(fillMode != no_fill)
-                painter.setBrush(QBrush(fillColor));
-            painter.drawEllipse(rect);
-        } break;
-        default:
-          break;
+    });
+    return dirty;
+}
+
+/**
+ * @brief RectTool::outline - The rectangle, rounded rectangle or ellipse
+ *                            from startPoint to endPoint
+ *
+ */
+QPainterPath RectTool::outline(const QPoint &endPoint) const
+{
+    QRect rect = adjustPoints(endPoint);
+    QPainterPath path;
+    switch(shapeType)
+    {
+        case rectangle: path.addRect(rect); break;
+        case rounded_rectangle: path.addRoundedRect(rect, roundedCurve,
+                                                    roundedCurve,
+                                                    Qt::RelativeSize); break;
+        case ellipse: path.addEllipse(rect); break;
+        default: break;
     }
-    drawArea->update();
+    return path;
+}
+
+/**
+ * @brief RectTool::fillBrush - The fill of the shape, if any
+ *
+ */
+QBrush RectTool::fillBrush() const
+{
+    if(fillMode == no_fill)
+        return Qt::NoBrush;
+    return QBrush(fillColor);
 }
 
 /**
@@ -103,7 +252,7 @@ void RectTool::drawTo(const QPoint &endPoint, QWidget *drawArea, QPixmap *image)
  *                                 a rectangle
  *
  */
-QRect RectTool::adjustPoints(const QPoint &endPoint)
+QRect RectTool::adjustPoints(const QPoint &endPoint) const
 {
     // 'top left' and 'bottom right' are relative, so we may need to
     // switch the points
@@ -114,3 +263,78 @@ QRect RectTool::adjustPoints(const QPoint &endPoint)
         rect = QRect(getStartPoint(), endPoint);
     return rect;
 }
+
+/**
+ * @brief BucketTool::drawTo - Flood fill from the point with the tool's
+ *                             color. A region too big for one thread is
+ *                             found again by all of them, nothing is
+ *                             painted until one of the fills finishes.
+ *
+ */
+QRect BucketTool::drawTo(const QPoint &point, Canvas *canvas)
+{
+    const uint channelTolerance = uint(tolerance * 255 / 100);
+    FloodFill fill(canvas, channelTolerance);
+    if(parallel)
+        fill.setLimit(PARALLEL_FILL_PIXELS);
+
+    QRect dirty = fill.fill(point, color());
+    if(!fill.overLimit())
+        return dirty;
+
+    ParallelFill parallelFill(canvas, channelTolerance);
+    return parallelFill.fill(point, color());
+}
+
+/**
+ * @brief ToolOp::record - Keep what a line or rect tool would draw when
+ *                         released at endPoint
+ *
+ */
+ToolOp ToolOp::record(const Tool &tool, const QPoint &endPoint)
+{
+    ToolOp op;
+    op.type = tool.getType();
+    op.pen = tool;
+    op.start = tool.getStartPoint();
+    op.end = endPoint;
+    op.shape = rectangle;
+    op.fill = QColor(Qt::transparent);
+    op.fillMode = no_fill;
+    op.curve = DEFAULT_RECT_CURVE;
+
+    if(op.type == rect_tool)
+    {
+        const RectTool &rect = static_cast<const RectTool&>(tool);
+        op.shape = rect.getShapeType();
+        op.fill = rect.getFillColor();
+        op.fillMode = rect.getFillMode();
+        op.curve = rect.getCurve();
+    }
+    return op;
+}
+
+/**
+ * @brief ToolOp::drawTo - Draw the operation again with a tool set up
+ *                         the way it was
+ *
+ */
+QRect ToolOp::drawTo(Canvas *canvas) const
+{
+    Q_ASSERT(type == line || type == rect_tool);
+
+    if(type == rect_tool)
+    {
+        RectTool tool(pen.brush(), pen.widthF(), pen.style(), pen.capStyle(),
+                      pen.joinStyle(), fill, shape, fillMode, curve);
+        static_cast<QPen&>(tool) = pen;
+        tool.setStartPoint(start);
+        return tool.drawTo(end, canvas);
+    }
+
+    LineTool tool(pen.brush(), pen.widthF(), pen.style(), pen.capStyle(),
+                  pen.joinStyle());
+    static_cast<QPen&>(tool) = pen;
+    tool.setStartPoint(start);
+    return tool.drawTo(end, canvas);
+}
@@ -3,9 +3,13 @@
 
 #include <QWidget>
 #include <QPen>
+#include <QVector>
+#include <QPainterPath>
 #include <QGraphicsScene>
 
 #include "constants.h"
+#include "canvas.h"
+#include "brush.h"
 
 
 class DrawArea;
@@ -20,11 +24,28 @@ public:
     virtual ~Tool() {}
 
     virtual ToolType getType() const = 0;
-    virtual void drawTo(const QPoint&, QWidget*, QPixmap*) {}
+
+    /** draws onto the canvas and returns the area it painted, the
+     *  caller repaints it */
+    virtual QRect drawTo(const QPoint&, Canvas*) { return QRect(); }
+
+    /** the shape drawTo would draw, for previewing it without painting */
+    virtual QPainterPath outline(const QPoint&) const { return QPainterPath(); }
+    virtual QBrush fillBrush() const { return Qt::NoBrush; }
 
     QPoint getStartPoint() const { return startPoint; }
     void setStartPoint(QPoint point) { startPoint = point; }
 
+    /** how far painted pixels can reach past the drawn geometry */
+    int extent() const;
+
+    /** the area the outline covers once drawn with this pen */
+    QRect bounds(const QPoint&) const;
+
+    /** the same, hugging the outline, so a long line or a hollow shape
+     *  doesn't reach every tile of its bounding rect */
+    QPainterPath coverage(const QPoint&) const;
+
 private:
     QPoint startPoint;
 
@@ -42,9 +63,35 @@ public:
        : Tool(brush, width, s, c, j) {}
 
     virtual ToolType getType() const { return pen; }
-    virtual void drawTo(const QPoint&, QWidget*, QPixmap*);
+    virtual QRect drawTo(const QPoint&, Canvas*);
+
+    /** stroke accumulator: points are buffered as they come in and
+     *  drawn once per frame as one polyline. flush only touches the
+     *  canvas, the caller repaints the returned rect. */
+    void addPoint(const QPoint &point) { pending.append(point); }
+    bool hasPending() const { return !pending.isEmpty(); }
+    QRect flush(Canvas*);
+
+    /** forget the previous point, a new stroke starts */
+    void beginStroke() { pending.clear(); joinPoint = QPoint(); hasJoin = false; brush.beginStroke(); }
+
+    /** hardness, spacing and opacity; a soft or translucent brush
+     *  draws dabs instead of a line */
+    BrushEngine& getBrush() { return brush; }
 
 private:
+    QVector<QPoint> pending;
+
+    BrushEngine brush;
+
+    /** the polyline flush draws, kept so its buffer is reused */
+    QPolygon polyline;
+
+    /** the point before startPoint, so the next flush joins onto the
+     *  last segment of the previous one */
+    QPoint joinPoint;
+    bool hasJoin = false;
+
     /** Don't allow copying */
     PenTool(const PenTool&);
     PenTool& operator=(const PenTool&);
@@ -58,7 +105,8 @@ public:
              Qt::PenJoinStyle j = Qt::BevelJoin)
        : Tool(brush, width, s, c, j) {}
     virtual ToolType getType() const { return line; }
-    virtual void drawTo(const QPoint&, QWidget*, QPixmap*);
+    virtual QRect drawTo(const QPoint&, Canvas*);
+    virtual QPainterPath outline(const QPoint&) const;
 
 private:
     /** Don't allow copying */
@@ -95,14 +143,19 @@ public:
              int roundedCurve = DEFAULT_RECT_CURVE);
 
     virtual ToolType getType() const { return rect_tool; }
-    virtual void drawTo(const QPoint&, QWidget*, QPixmap*);
+    virtual QRect drawTo(const QPoint&, Canvas*);
+    virtual QPainterPath outline(const QPoint&) const;
+    virtual QBrush fillBrush() const;
 
     FillColor getFillMode() const { return fillMode; }
     void setFillMode(FillColor mode) { fillMode = mode; }
+    ShapeType getShapeType() const { return shapeType; }
     void setShapeType(ShapeType shape) { shapeType = shape; }
+    QColor getFillColor() const { return fillColor; }
     void setFillColor(QColor color) { fillColor = color; }
+    int getCurve() const { return roundedCurve; }
     void setCurve(int value) { roundedCurve = value; }
-    QRect adjustPoints(const QPoint&);
+    QRect adjustPoints(const QPoint&) const;
 
 private:
     ShapeType shapeType;
@@ -115,4 +168,59 @@ private:
     RectTool& operator=(const RectTool&);
 };
 
+class BucketTool : public Tool
+{
+public:
+    BucketTool(const QBrush &brush, int tolerance = DEFAULT_FILL_TOLERANCE)
+        : Tool(brush, 1), tolerance(tolerance), parallel(PARALLEL_FILL) {}
+
+    virtual ToolType getType() const { return bucket; }
+
+    /** fill the area around the point that has its color */
+    virtual QRect drawTo(const QPoint&, Canvas*);
+
+    /** how far a color may be from the clicked one and still get
+     *  filled, 0-100 percent of each channel's range */
+    int getTolerance() const { return tolerance; }
+    void setTolerance(int percent) { tolerance = qBound(MIN_FILL_TOLERANCE, percent, MAX_FILL_TOLERANCE); }
+
+    /** fills growing past PARALLEL_FILL_PIXELS start over as a
+     *  ParallelFill on every core */
+    bool isParallel() const { return parallel; }
+    void setParallel(bool enabled) { parallel = enabled; }
+
+private:
+    int tolerance;
+    bool parallel;
+
+    /** Don't allow copying */
+    BucketTool(const BucketTool&);
+    BucketTool& operator=(const BucketTool&);
+};
+
+/**
+ * A line or shape as the line/rect tool drew it, a few bytes instead of
+ * the tiles it changed. Drawing it again on the same pixels gives the
+ * same result.
+ */
+struct ToolOp
+{
+    ToolType type;
+    QPen pen;
+    QPoint start;
+    QPoint end;
+
+    /** rect tool settings */
+    ShapeType shape;
+    QColor fill;
+    FillColor fillMode;
+    int curve;
+
+    /** what tool would draw if released at end */
+    static ToolOp record(const Tool &tool, const QPoint &end);
+
+    /** draw it, returns the area painted like Tool::drawTo */
+    QRect drawTo(Canvas*) const;
+};
+
 #endif // TOOL_H